@@ -4,20 +4,84 @@
 #include "inet_address.h"
 #include "sockets_ops.h"
 
-#include <functional>
 #include <glog/logging.h>
 
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 using namespace mouse;
 
-Acceptor::Acceptor(EventLoop* loop, const InetAddress& listenAddr)
+namespace
+{
+
+const int kDefaultMaxAcceptsPerEvent = 16;
+// out of fds without a reserved one, the listen socket is not read for
+// this long
+const double kPauseSeconds = 0.1;
+// the rejects are summed up, one warning per interval
+const double kWarningInterval = 1.0;
+
+}//namespace
+
+Acceptor::Acceptor(EventLoop* loop, const InetAddress& listenAddr, bool reuseport)
   : loop_(loop),
-    accept_socket_(sockets::createNonblocking()),
+    accept_socket_(sockets::createNonblocking(listenAddr.family())),
     accept_channel_(loop, accept_socket_.fd()),
-    listenning_(false)
+    listenning_(false),
+    idle_fd_(::open("/dev/null", O_RDONLY | O_CLOEXEC)),
+    max_accepts_per_event_(kDefaultMaxAcceptsPerEvent),
+    paused_(false),
+    unreported_rejects_(0),
+    events_(0),
+    accepted_(0),
+    rejected_(0),
+    max_batch_(0)
 {
+    assert(idle_fd_ >= 0);
     accept_socket_.setReuseAddr(true);
+    accept_socket_.setReusePort(reuseport);
     accept_socket_.bindAddress(listenAddr);
-    accept_channel_.setReadCallback(std::bind(&Acceptor::handleRead, this));
+    accept_channel_.setOwner(this);
+}
+
+Acceptor::Acceptor(EventLoop* loop, int sockfd)
+  : loop_(loop),
+    accept_socket_(sockfd),
+    accept_channel_(loop, sockfd),
+    listenning_(false),
+    idle_fd_(::open("/dev/null", O_RDONLY | O_CLOEXEC)),
+    max_accepts_per_event_(kDefaultMaxAcceptsPerEvent),
+    paused_(false),
+    unreported_rejects_(0),
+    events_(0),
+    accepted_(0),
+    rejected_(0),
+    max_batch_(0)
+{
+    assert(idle_fd_ >= 0);
+    sockets::setNonBlockAndCloseOnExec(sockfd);
+    accept_channel_.setOwner(this);
+}
+
+Acceptor::~Acceptor()
+{
+    stopListening();
+    if (idle_fd_ >= 0)
+    {
+        ::close(idle_fd_);
+    }
+}
+
+AcceptorStats Acceptor::stats() const
+{
+    AcceptorStats stats;
+    stats.events = events_.load(std::memory_order_relaxed);
+    stats.accepted = accepted_.load(std::memory_order_relaxed);
+    stats.rejected = rejected_.load(std::memory_order_relaxed);
+    stats.max_batch = max_batch_.load(std::memory_order_relaxed);
+    return stats;
 }
 
 void Acceptor::listen()
@@ -28,22 +92,122 @@ void Acceptor::listen()
     accept_channel_.enableReading();
 }
 
+void Acceptor::stopListening()
+{
+    if (listenning_)
+    {
+        loop_->assertInLoopThread();
+        listenning_ = false;
+        if (paused_)
+        {
+            paused_ = false;
+            loop_->cancel(resume_timer_);
+        }
+        accept_channel_.disableAll();
+        loop_->removeChannel(&accept_channel_);
+    }
+}
+
 void Acceptor::handleRead()
 {
     loop_->assertInLoopThread();
-    InetAddress peer_addr(0);
+    int batch = 0;
 
-    int connfd = accept_socket_.accept(&peer_addr);
-    if (connfd >= 0)
+    // drain the backlog, instead of one poll iteration per connection
+    for (int i = 0; i < max_accepts_per_event_; ++i)
     {
-        if (new_connection_callback_)
+        InetAddress peer_addr(0);
+        int connfd = accept_socket_.accept(&peer_addr);
+        if (connfd >= 0)
         {
-            new_connection_callback_(connfd, peer_addr);
+            ++batch;
+            if (new_connection_callback_)
+            {
+                new_connection_callback_(connfd, peer_addr);
+            }
+            else
+            {
+                sockets::close(connfd);
+            }
+        }
+        else if (errno == EMFILE || errno == ENFILE)
+        {
+            if (!rejectOne())
+            {
+                break;
+            }
         }
         else
         {
-            sockets::close(connfd);
+            // EAGAIN, backlog is empty
+            break;
+        }
+    }
+
+    events_.store(events_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    accepted_.store(accepted_.load(std::memory_order_relaxed) + batch, std::memory_order_relaxed);
+    if (batch > max_batch_.load(std::memory_order_relaxed))
+    {
+        max_batch_.store(batch, std::memory_order_relaxed);
+    }
+}
+
+// Out of fds, the pending connection stays readable, a level triggered
+// poller would spin. Release the reserved fd, accept and close the
+// connection, then reserve the fd again. The fd can be lost meanwhile,
+// e.g. to another thread, then reading stops for kPauseSeconds instead.
+// Returns false if nothing was rejected.
+bool Acceptor::rejectOne()
+{
+    if (idle_fd_ < 0)
+    {
+        idle_fd_ = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    int connfd = -1;
+    bool out_of_fds = true;
+    if (idle_fd_ >= 0)
+    {
+        ::close(idle_fd_);
+        connfd = ::accept(accept_socket_.fd(), NULL, NULL);
+        if (connfd >= 0)
+        {
+            ::close(connfd);
+            rejected_.store(rejected_.load(std::memory_order_relaxed) + 1,
+                            std::memory_order_relaxed);
+            ++unreported_rejects_;
+        }
+        // e.g. EAGAIN, another acceptor took the connection
+        out_of_fds = connfd < 0 && (errno == EMFILE || errno == ENFILE);
+        idle_fd_ = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    Timestamp now(Timestamp::now());
+    if (unreported_rejects_ > 0 && timeDifference(now, last_warning_) >= kWarningInterval)
+    {
+        LOG(WARNING) << "Acceptor::handleRead - out of file descriptors, "
+            << unreported_rejects_ << " connections rejected";
+        unreported_rejects_ = 0;
+        last_warning_ = now;
+    }
+
+    if (out_of_fds && !paused_)
+    {
+        if (timeDifference(now, last_warning_) >= kWarningInterval)
+        {
+            LOG(WARNING) << "Acceptor::handleRead - out of file descriptors, "
+                << "no fd reserved, stop accepting for " << kPauseSeconds << " s";
+            last_warning_ = now;
         }
+        paused_ = true;
+        accept_channel_.disableReading();
+        resume_timer_ = loop_->runAfter(kPauseSeconds,
+                                        std::bind(&Acceptor::resumeReading, this));
     }
+    return connfd >= 0;
 }
 
+void Acceptor::resumeReading()
+{
+    paused_ = false;
+    accept_channel_.enableReading();
+}
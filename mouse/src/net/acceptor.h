@@ -1,17 +1,28 @@
 #ifndef MOUSE_NET_ACCEPTOR_H
 #define MOUSE_NET_ACCEPTOR_H
 
+#include <atomic>
 #include <functional>
 
 #include "channel.h"
+#include "event_loop_fwd.h"
 #include "socket.h"
+#include "timer_id.h"
+#include "../base/timestamp.h"
 
 namespace mouse
 {
 
-class EventLoop;
 class InetAddress;
 
+struct AcceptorStats
+{
+    int64_t events;     // readiness events handled
+    int64_t accepted;
+    int64_t rejected;   // accepted and closed at once, out of fds
+    int max_batch;      // most connections accepted by one event
+};
+
 class Acceptor {
     //nocopyable
     Acceptor(const Acceptor&) = delete;
@@ -20,22 +31,54 @@ class Acceptor {
 public:
     typedef std::function<void (int sockfd, const InetAddress&)> NewConnectionCallback;
 
-    Acceptor(EventLoop* loop, const InetAddress& listen_addr);
+    Acceptor(EventLoop* loop, const InetAddress& listen_addr, bool reuseport);
+    /// Adopts a socket already bound, e.g. inherited from the process
+    /// we replace, see sockets::recvFds(). Takes the ownership of @c sockfd.
+    Acceptor(EventLoop* loop, int sockfd);
+    ~Acceptor();
 
     void setNewConnectionCallback(const NewConnectionCallback& cb)
     { new_connection_callback_ = cb; }
 
     bool listenning() const { return listenning_; }
     void listen();
+    /// Stops accepting, the socket stays open, connections queued on it
+    /// are still accepted by other processes sharing it.
+    void stopListening();
+    int listenFd() const { return accept_socket_.fd(); }
+
+    /// Accepts up to @c n connections per readiness event.
+    void setMaxAcceptsPerEvent(int n) { max_accepts_per_event_ = n; }
+
+    /// Thread safe.
+    AcceptorStats stats() const;
 
 private:
+    friend class Channel;
+
     void handleRead();
+    bool rejectOne();
+    void resumeReading();
 
     EventLoop* loop_;
     Socket accept_socket_;
     Channel accept_channel_;
     NewConnectionCallback new_connection_callback_;
     bool listenning_;
+    // reserved for EMFILE, see rejectOne(), -1 if lost
+    int idle_fd_;
+    int max_accepts_per_event_;
+    // reading stopped for a while, out of fds without a reserved one
+    bool paused_;
+    TimerId resume_timer_;
+    Timestamp last_warning_;
+    int64_t unreported_rejects_;
+
+    // written in loop thread only
+    std::atomic<int64_t> events_;
+    std::atomic<int64_t> accepted_;
+    std::atomic<int64_t> rejected_;
+    std::atomic<int> max_batch_;
 };
 
 }//namespace mouse
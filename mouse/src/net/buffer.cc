@@ -9,6 +9,9 @@
 
 using namespace mouse;
 
+const size_t Buffer::kCheapPrepend;
+const size_t Buffer::kInitialSize;
+
 ssize_t Buffer::readFd(int fd, int* saved_errno)
 {
     char extrabuf[65536];
@@ -29,7 +32,7 @@ ssize_t Buffer::readFd(int fd, int* saved_errno)
     }
     else
     {
-        writer_index_ = buffer_.size();
+        writer_index_ = capacity_;
         append(extrabuf, n - writable);
     }
     return n;
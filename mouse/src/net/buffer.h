@@ -2,14 +2,20 @@
 #define MOUSE_NET_BUFFER_H
 
 #include <algorithm>
+#include <memory>
 #include <string>
-#include <vector>
 
 #include <assert.h>
 
 namespace mouse
 {
 
+///
+/// Storage is allocated by the first write, at least kInitialSize bytes
+/// plus kCheapPrepend, and not zero filled. An empty buffer has no
+/// storage and nothing to prepend to, release() returns a buffer to it,
+/// so idle connections cost no buffer memory.
+///
 class Buffer
 {
 
@@ -18,20 +24,20 @@ public:
     static const size_t kInitialSize = 1024;
 
     Buffer()
-        : buffer_(kCheapPrepend + kInitialSize),
-          reader_index_(kCheapPrepend),
-          writer_index_(kCheapPrepend)
+        : capacity_(0),
+          reader_index_(0),
+          writer_index_(0)
     {
         assert(readableBytes() == 0);
-        assert(writableBytes() == kInitialSize);
-        assert(prependableBytes() == kCheapPrepend);
+        assert(writableBytes() == 0);
     }
 
-    // default copy-ctor, dtor and assignment are fine
+    // movable, not copyable
 
     void swap(Buffer& rhs)
     {
         buffer_.swap(rhs.buffer_);
+        std::swap(capacity_, rhs.capacity_);
         std::swap(reader_index_, rhs.reader_index_);
         std::swap(writer_index_, rhs.writer_index_);
     }
@@ -43,7 +49,7 @@ public:
 
     size_t writableBytes() const
     {
-        return buffer_.size() - writer_index_;
+        return capacity_ - writer_index_;
     }
 
     size_t prependableBytes() const
@@ -74,8 +80,9 @@ public:
 
     void retrieveAll()
     {
-        reader_index_ = kCheapPrepend;
-        writer_index_ = kCheapPrepend;
+        // 0 without storage
+        reader_index_ = std::min(kCheapPrepend, capacity_);
+        writer_index_ = reader_index_;
     }
 
     std::string retrieveAsString()
@@ -136,9 +143,30 @@ public:
 
     void shrink(size_t reserve)
     {
-        std::vector<char> buf(kCheapPrepend + readableBytes() + reserve);
-        std::copy(peek(), peek() + readableBytes(), buf.begin() + kCheapPrepend);
-        buf.swap(buffer_);
+        size_t readable = readableBytes();
+        size_t capacity = kCheapPrepend + readable + reserve;
+        std::unique_ptr<char[]> buf(new char[capacity]);
+        std::copy(peek(), peek() + readable, buf.get() + kCheapPrepend);
+        buffer_.swap(buf);
+        capacity_ = capacity;
+        reader_index_ = kCheapPrepend;
+        writer_index_ = kCheapPrepend + readable;
+    }
+
+    /// Frees the storage of an empty buffer.
+    void release()
+    {
+        assert(readableBytes() == 0);
+        buffer_.reset();
+        capacity_ = 0;
+        reader_index_ = 0;
+        writer_index_ = 0;
+    }
+
+    /// Bytes of storage, 0 if released.
+    size_t capacity() const
+    {
+        return capacity_;
     }
 
     /// Read data directly into buffer.
@@ -150,19 +178,29 @@ public:
 private:
     char* begin()
     {
-        return buffer_.data();
+        return buffer_.get();
     }
 
     const char* begin() const
     {
-        return buffer_.data();
+        return buffer_.get();
     }
 
     void makeSpace(size_t len)
     {
         if (writableBytes() + prependableBytes() < len + kCheapPrepend)
         {
-            buffer_.resize(writer_index_+len);
+            // readable data moves to the front of the new storage,
+            // which at least doubles so appends cost amortized O(1)
+            size_t readable = readableBytes();
+            size_t capacity = std::max(kCheapPrepend + std::max(kInitialSize, readable + len),
+                                       2 * capacity_);
+            std::unique_ptr<char[]> buf(new char[capacity]);
+            std::copy(peek(), peek() + readable, buf.get() + kCheapPrepend);
+            buffer_.swap(buf);
+            capacity_ = capacity;
+            reader_index_ = kCheapPrepend;
+            writer_index_ = kCheapPrepend + readable;
         }
         else
         {
@@ -178,7 +216,8 @@ private:
         }
     }
 
-    std::vector<char> buffer_;
+    std::unique_ptr<char[]> buffer_;
+    size_t capacity_;
     size_t reader_index_;
     size_t writer_index_;
 };
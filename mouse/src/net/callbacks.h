@@ -13,6 +13,8 @@ namespace mouse
 
 class Buffer;
 class TcpConnection;
+class UdpSocket;
+struct Datagram;
 
 typedef std::shared_ptr<TcpConnection> TcpConnectionPtr;
 
@@ -23,6 +25,12 @@ typedef std::function<void (const TcpConnectionPtr&,
                             Timestamp)> MessageCallback;
 typedef std::function<void (const TcpConnectionPtr&)> WriteCompleteCallback;
 typedef std::function<void (const TcpConnectionPtr&)> CloseCallback;
+typedef std::function<void (const TcpConnectionPtr&, size_t)> HighWaterMarkCallback;
+// a batch of datagrams, valid until the callback returns
+typedef std::function<void (UdpSocket*,
+                            const Datagram* datagrams,
+                            size_t count,
+                            Timestamp)> DatagramCallback;
 
 }//namespace mouse
 
@@ -1,5 +1,10 @@
 #include "channel.h"
+#include "acceptor.h"
+#include "connector.h"
 #include "event_loop.h"
+#include "tcp_connection.h"
+#include "timer_queue.h"
+#include "udp_socket.h"
 
 #include <glog/logging.h>
 
@@ -18,7 +23,10 @@ Channel::Channel(EventLoop* loop, int fd)
       events_(0),
       revents_(0),
       index_(-1),
-      event_handling_(false)
+      owner_kind_(kCallbacks),
+      priority_(kNormalPriority),
+      event_handling_(false),
+      owner_(nullptr)
 {
 }
 
@@ -27,6 +35,15 @@ Channel::~Channel()
     assert(!event_handling_);
 }
 
+Channel::Callbacks* Channel::callbacks()
+{
+    if (!callbacks_)
+    {
+        callbacks_.reset(new Callbacks);
+    }
+    return callbacks_.get();
+}
+
 void Channel::update()
 {
     loop_->updateChannel(this);
@@ -44,27 +61,81 @@ void Channel::handleEvent(Timestamp receive_time)
     if ((revents_ & POLLHUP) && !(revents_ & POLLIN))
     {
         LOG(WARNING) << "Channel::handle_event() POLLHUP";
-        if (close_callback_)
-            close_callback_();
+        dispatch(kClose, receive_time);
     }
 
     if (revents_ & (POLLERR | POLLNVAL))
     {
-        if (error_callback_)
-            error_callback_();
+        dispatch(kError, receive_time);
     }
 
-    if (revents_ & (POLLIN | POLLPRI | POLLRDHUP))
+    // an earlier channel of this poll round may have turned the interest
+    // off, e.g. a timer stopping the reads of a connection it hands over
+    if ((revents_ & (POLLIN | POLLPRI | POLLRDHUP)) && (events_ & kReadEvent))
     {
-        if (read_callback_)
-            read_callback_(receive_time);
+        dispatch(kRead, receive_time);
     }
 
-    if (revents_ & POLLOUT)
+    if ((revents_ & POLLOUT) && (events_ & kWriteEvent))
     {
-        if (write_callback_)
-            write_callback_();
+        dispatch(kWrite, receive_time);
     }
 
     event_handling_ = false;
 }
+
+void Channel::dispatch(EventType type, Timestamp receive_time)
+{
+    switch (owner_kind_)
+    {
+    case kTcpConnection:
+    {
+        TcpConnection* conn = static_cast<TcpConnection*>(owner_);
+        switch (type)
+        {
+        case kRead: conn->handleRead(receive_time); break;
+        case kWrite: conn->handleWrite(); break;
+        case kError: conn->handleError(); break;
+        case kClose: conn->handleClose(); break;
+        }
+        break;
+    }
+    case kAcceptor:
+        if (type == kRead)
+            static_cast<Acceptor*>(owner_)->handleRead();
+        break;
+    case kTimerQueue:
+        if (type == kRead)
+            static_cast<TimerQueue*>(owner_)->handleRead();
+        break;
+    case kConnector:
+        if (type == kWrite)
+            static_cast<Connector*>(owner_)->handleWrite();
+        else if (type == kError)
+            static_cast<Connector*>(owner_)->handleError();
+        break;
+    case kEventLoop:
+        if (type == kRead)
+            static_cast<EventLoop*>(owner_)->handleRead();
+        break;
+    case kUdpSocket:
+        if (type == kRead)
+            static_cast<UdpSocket*>(owner_)->handleRead(receive_time);
+        else if (type == kWrite)
+            static_cast<UdpSocket*>(owner_)->handleWrite();
+        else if (type == kError)
+            static_cast<UdpSocket*>(owner_)->handleError();
+        break;
+    case kCallbacks:
+        if (!callbacks_)
+            break;
+        switch (type)
+        {
+        case kRead: if (callbacks_->read) callbacks_->read(receive_time); break;
+        case kWrite: if (callbacks_->write) callbacks_->write(); break;
+        case kError: if (callbacks_->error) callbacks_->error(); break;
+        case kClose: if (callbacks_->close) callbacks_->close(); break;
+        }
+        break;
+    }
+}
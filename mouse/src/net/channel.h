@@ -2,14 +2,26 @@
 #define MOUSE_NET_CHANNEL_H
 
 #include "../base/timestamp.h"
+#include "event_loop_fwd.h"
 
 #include <functional>
+#include <memory>
 
 namespace mouse
 {
 
-class EventLoop;
-
+class Acceptor;
+class Connector;
+class TcpConnection;
+class TimerQueue;
+class UdpSocket;
+
+///
+/// Events of a Channel go to its owner, the library classes that own a
+/// channel are dispatched to by a switch on the owner kind with direct
+/// calls of their handlers. Other channels use callbacks, allocated when
+/// the first one is set.
+///
 class Channel
 {
     //nocopyable
@@ -20,14 +32,31 @@ public:
     typedef std::function<void()> EventCallback;
     typedef std::function<void(Timestamp)> ReadEventCallback;
 
+    /// Low priority channels are handled after the others, within the
+    /// budget of EventLoop::setLowPriorityBudget().
+    enum Priority : char
+    {
+        kNormalPriority,
+        kLowPriority,
+    };
+
     Channel(EventLoop* loop, int fd);
     ~Channel();
 
     void handleEvent(Timestamp receive_time);
-    void setReadCallback(const ReadEventCallback& cb) { read_callback_ = cb; }
-    void setWriteCallback(const EventCallback& cb) { write_callback_ = cb; }
-    void setErrorCallback(const EventCallback& cb) { error_callback_ = cb; }
-    void setCloseCallback(const EventCallback& cb) { close_callback_ = cb; }
+
+    /// Handlers of the owner are called instead of callbacks.
+    void setOwner(TcpConnection* owner) { setOwner(owner, kTcpConnection); }
+    void setOwner(Acceptor* owner) { setOwner(owner, kAcceptor); }
+    void setOwner(TimerQueue* owner) { setOwner(owner, kTimerQueue); }
+    void setOwner(Connector* owner) { setOwner(owner, kConnector); }
+    void setOwner(EventLoop* owner) { setOwner(owner, kEventLoop); }
+    void setOwner(UdpSocket* owner) { setOwner(owner, kUdpSocket); }
+
+    void setReadCallback(const ReadEventCallback& cb) { callbacks()->read = cb; }
+    void setWriteCallback(const EventCallback& cb) { callbacks()->write = cb; }
+    void setErrorCallback(const EventCallback& cb) { callbacks()->error = cb; }
+    void setCloseCallback(const EventCallback& cb) { callbacks()->close = cb; }
 
     int fd() const { return fd_; }
     int events() const { return events_; }
@@ -35,18 +64,50 @@ public:
     bool isNoneEvent() const { return events_ == kNoneEvent; }
 
     void enableReading() { events_ |= kReadEvent; update(); }
+    void disableReading() { events_ &= ~kReadEvent; update(); }
     void enableWriting() { events_ |= kWriteEvent; update(); }
     void disableWriting() { events_ &= ~kWriteEvent; update(); }
     void disableAll() { events_ = kNoneEvent; update(); }
     bool isWriting() const { return events_ & kWriteEvent; }
+    bool isReading() const { return events_ & kReadEvent; }
+
+    void setPriority(Priority priority) { priority_ = priority; }
+    Priority priority() const { return priority_; }
 
     //for Poller
     int index() { return index_; }
     void setIndex(int idx) { index_ = idx; }
 
     EventLoop* loop() { return loop_; }
+    /// Moves the channel to another loop, it must be removed from its
+    /// poller first.
+    void setLoop(EventLoop* loop) { loop_ = loop; }
 
 private:
+    enum OwnerKind : char
+    {
+        kCallbacks,
+        kTcpConnection,
+        kAcceptor,
+        kTimerQueue,
+        kConnector,
+        kEventLoop,
+        kUdpSocket,
+    };
+
+    enum EventType { kRead, kWrite, kError, kClose };
+
+    struct Callbacks
+    {
+        ReadEventCallback read;
+        EventCallback write;
+        EventCallback error;
+        EventCallback close;
+    };
+
+    void setOwner(void* owner, OwnerKind kind) { owner_ = owner; owner_kind_ = kind; }
+    Callbacks* callbacks();
+    void dispatch(EventType type, Timestamp receive_time);
     void update();
 
     static const int kNoneEvent;
@@ -59,12 +120,13 @@ private:
     int        revents_;
     int        index_;
 
+    OwnerKind  owner_kind_;
+    Priority   priority_;
     bool event_handling_;
 
-    ReadEventCallback read_callback_;
-    EventCallback write_callback_;
-    EventCallback error_callback_;
-    EventCallback close_callback_;
+    void* owner_;
+    // kCallbacks only, null until a callback is set
+    std::unique_ptr<Callbacks> callbacks_;
 };
 
 }//namespace mouse
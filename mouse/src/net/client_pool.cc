@@ -0,0 +1,241 @@
+#include "client_pool.h"
+
+#include "event_loop.h"
+#include "tcp_client.h"
+
+#include <glog/logging.h>
+
+#include <functional>
+using namespace std::placeholders;
+
+using namespace mouse;
+
+namespace
+{
+
+void ignoreResponse(bool ok, const char* data, size_t len)
+{
+}
+
+}//namespace
+
+ClientPool::ClientPool(EventLoop* loop, const ResponseParser& parser)
+    : loop_(CHECK_NOTNULL(loop)),
+      parser_(parser),
+      connections_per_server_(1),
+      max_pipeline_depth_(64),
+      health_check_interval_(0.0)
+{
+}
+
+ClientPool::~ClientPool()
+{
+    loop_->assertInLoopThread();
+    if (health_check_interval_ > 0.0)
+    {
+        loop_->cancel(health_check_timer_);
+    }
+}
+
+void ClientPool::setHealthCheck(double interval, const std::string& request)
+{
+    loop_->assertInLoopThread();
+    if (health_check_interval_ > 0.0)
+    {
+        loop_->cancel(health_check_timer_);
+    }
+    health_check_interval_ = interval;
+    health_check_request_ = request;
+    if (interval > 0.0)
+    {
+        health_check_timer_ = loop_->runEvery(
+                interval, std::bind(&ClientPool::checkHealth, this));
+    }
+}
+
+void ClientPool::request(const InetAddress& server,
+                         const std::string& request,
+                         const ResponseCallback& cb)
+{
+    loop_->assertInLoopThread();
+    Endpoint* endpoint = getEndpoint(server);
+    PooledConnection* pc = endpoint->waiting.empty() ? pick(endpoint) : NULL;
+    if (pc)
+    {
+        sendOn(pc, request, cb);
+    }
+    else if (endpoint->waiting.size()
+             < static_cast<size_t>(max_pipeline_depth_ * connections_per_server_))
+    {
+        Waiting waiting = { request, cb };
+        endpoint->waiting.push_back(waiting);
+    }
+    else
+    {
+        LOG(WARNING) << "ClientPool::request - too many requests waiting for "
+            << server.toIpPort();
+        cb(false, NULL, 0);
+    }
+}
+
+ClientPool::Endpoint* ClientPool::getEndpoint(const InetAddress& server)
+{
+    uint64_t key;
+    if (server.isUnix())
+    {
+        // above the 48 bits of IPv4 keys
+        key = std::hash<std::string>()(server.toIpPort()) | (1ull << 63);
+    }
+    else
+    {
+        const struct sockaddr_in& addr = server.addr();
+        key = (static_cast<uint64_t>(addr.sin_addr.s_addr) << 16) | addr.sin_port;
+    }
+    std::unique_ptr<Endpoint>& endpoint = endpoints_[key];
+    if (!endpoint)
+    {
+        endpoint.reset(new Endpoint);
+        for (int i = 0; i < connections_per_server_; ++i)
+        {
+            PooledConnection* pc = new PooledConnection;
+            endpoint->conns.push_back(std::unique_ptr<PooledConnection>(pc));
+            pc->client.reset(new TcpClient(loop_, server));
+            pc->client->setConnectionCallback(
+                    std::bind(&ClientPool::onConnection, this, endpoint.get(), pc, _1));
+            pc->client->setMessageCallback(
+                    std::bind(&ClientPool::onMessage, this, endpoint.get(), pc, _1, _2, _3));
+            pc->client->enableRetry();
+            pc->client->connect();
+        }
+    }
+    return endpoint.get();
+}
+
+// the connected one with the fewest requests in flight
+ClientPool::PooledConnection* ClientPool::pick(Endpoint* endpoint)
+{
+    PooledConnection* best = NULL;
+    for (size_t i = 0; i < endpoint->conns.size(); ++i)
+    {
+        PooledConnection* pc = endpoint->conns[i].get();
+        if (pc->conn
+                && pc->inflight.size() < static_cast<size_t>(max_pipeline_depth_)
+                && (best == NULL || pc->inflight.size() < best->inflight.size()))
+        {
+            best = pc;
+        }
+    }
+    return best;
+}
+
+void ClientPool::sendOn(PooledConnection* pc, const std::string& request,
+                        const ResponseCallback& cb)
+{
+    Inflight inflight = { cb, Timestamp::now() };
+    pc->inflight.push_back(inflight);
+    pc->last_active = inflight.sent;
+    pc->conn->send(request);
+}
+
+void ClientPool::drainWaiting(Endpoint* endpoint)
+{
+    while (!endpoint->waiting.empty())
+    {
+        PooledConnection* pc = pick(endpoint);
+        if (pc == NULL)
+        {
+            break;
+        }
+        Waiting waiting;
+        std::swap(waiting, endpoint->waiting.front());
+        endpoint->waiting.pop_front();
+        sendOn(pc, waiting.request, waiting.cb);
+    }
+}
+
+void ClientPool::onConnection(Endpoint* endpoint, PooledConnection* pc,
+                              const TcpConnectionPtr& conn)
+{
+    if (conn->connected())
+    {
+        conn->setTcpNoDelay(true);
+        pc->conn = conn;
+        pc->last_active = Timestamp::now();
+        drainWaiting(endpoint);
+        return;
+    }
+
+    // TcpClient connects again, requests sent on this connection are lost,
+    // they are not safe to send twice
+    pc->conn.reset();
+    std::deque<Inflight> lost;
+    lost.swap(pc->inflight);
+    if (!lost.empty())
+    {
+        LOG(WARNING) << "ClientPool - connection " << conn->name() << " lost with "
+            << lost.size() << " requests in flight";
+    }
+    for (size_t i = 0; i < lost.size(); ++i)
+    {
+        lost[i].cb(false, NULL, 0);
+    }
+}
+
+void ClientPool::onMessage(Endpoint* endpoint, PooledConnection* pc,
+                           const TcpConnectionPtr& conn, Buffer* buf,
+                           Timestamp receive_time)
+{
+    pc->last_active = receive_time;
+    while (buf->readableBytes() > 0)
+    {
+        ssize_t n = pc->inflight.empty() ? -1 : parser_(buf);
+        if (n == 0)
+        {
+            break;
+        }
+        else if (n < 0 || static_cast<size_t>(n) > buf->readableBytes())
+        {
+            LOG(ERROR) << "ClientPool - bad response on " << conn->name();
+            buf->retrieveAll();
+            conn->forceClose();
+            return;
+        }
+
+        ResponseCallback cb;
+        cb.swap(pc->inflight.front().cb);
+        pc->inflight.pop_front();
+        cb(true, buf->peek(), static_cast<size_t>(n));
+        buf->retrieve(static_cast<size_t>(n));
+    }
+    drainWaiting(endpoint);
+}
+
+void ClientPool::checkHealth()
+{
+    Timestamp now(Timestamp::now());
+    for (EndpointMap::iterator it = endpoints_.begin(); it != endpoints_.end(); ++it)
+    {
+        Endpoint* endpoint = it->second.get();
+        for (size_t i = 0; i < endpoint->conns.size(); ++i)
+        {
+            PooledConnection* pc = endpoint->conns[i].get();
+            if (!pc->conn)
+            {
+                continue;
+            }
+
+            if (!pc->inflight.empty()
+                    && timeDifference(now, pc->inflight.front().sent) > health_check_interval_)
+            {
+                LOG(WARNING) << "ClientPool - no response on " << pc->conn->name()
+                    << " for " << health_check_interval_ << " seconds, reconnecting";
+                pc->conn->forceClose();
+            }
+            else if (pc->inflight.empty()
+                     && timeDifference(now, pc->last_active) >= health_check_interval_)
+            {
+                sendOn(pc, health_check_request_, ignoreResponse);
+            }
+        }
+    }
+}
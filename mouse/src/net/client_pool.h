@@ -0,0 +1,129 @@
+#ifndef MOUSE_NET_CLIENT_POOL_H
+#define MOUSE_NET_CLIENT_POOL_H
+
+#include "callbacks.h"
+#include "event_loop_fwd.h"
+#include "inet_address.h"
+#include "timer_id.h"
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/types.h>
+
+namespace mouse
+{
+
+class TcpClient;
+
+///
+/// Client connections to any number of servers, keyed by server address.
+/// Requests are pipelined: a connection carries up to max pipeline depth
+/// requests at a time, responses are matched to requests in FIFO order.
+///
+/// A pool belongs to one loop and is used in that loop thread only, so
+/// nothing is locked. Give every IO loop its own pool, other threads hand
+/// requests over with EventLoop::runInLoop().
+///
+class ClientPool
+{
+    //nocopyable
+    ClientPool(const ClientPool&) = delete;
+    ClientPool& operator=(const ClientPool&) = delete;
+
+public:
+    /// @c data is valid in the callback only. @c ok is false if the
+    /// connection was lost before the response came, or too many requests
+    /// were waiting for a connection.
+    typedef std::function<void (bool ok, const char* data, size_t len)> ResponseCallback;
+
+    /// Returns the length of the complete response at the front of @c buf,
+    /// 0 if more bytes are needed, -1 on a protocol error, the connection
+    /// is closed then.
+    typedef std::function<ssize_t (const Buffer* buf)> ResponseParser;
+
+    ClientPool(EventLoop* loop, const ResponseParser& parser);
+    /// Must be called in the loop thread, callbacks of requests
+    /// not answered yet are dropped.
+    ~ClientPool();
+
+    EventLoop* loop() const { return loop_; }
+
+    /// Connections per server, made when the first request to the server
+    /// comes. Default is 1.
+    void setConnectionsPerServer(int n) { connections_per_server_ = n; }
+    /// Requests sent on a connection before their responses came,
+    /// default is 64. When all connections are full or down, requests wait
+    /// in a queue of the same size per connection.
+    void setMaxPipelineDepth(int n) { max_pipeline_depth_ = n; }
+    /// Every @c interval seconds, @c request is sent on connections idle
+    /// since the last check, and connections whose oldest request is not
+    /// answered in time are closed and connect again.
+    /// Must be called in the loop thread.
+    void setHealthCheck(double interval, const std::string& request);
+
+    /// Sends @c request to @c server, @c cb is called with the response.
+    /// Must be called in the loop thread.
+    void request(const InetAddress& server,
+                 const std::string& request,
+                 const ResponseCallback& cb);
+
+private:
+    struct Inflight
+    {
+        ResponseCallback cb;
+        Timestamp sent;
+    };
+
+    struct PooledConnection
+    {
+        std::unique_ptr<TcpClient> client;
+        TcpConnectionPtr conn; // null while connecting
+        std::deque<Inflight> inflight;
+        Timestamp last_active;
+    };
+
+    struct Waiting
+    {
+        std::string request;
+        ResponseCallback cb;
+    };
+
+    struct Endpoint
+    {
+        std::vector<std::unique_ptr<PooledConnection>> conns;
+        // requests no connection can take now
+        std::deque<Waiting> waiting;
+    };
+
+    typedef std::map<uint64_t, std::unique_ptr<Endpoint>> EndpointMap;
+
+    Endpoint* getEndpoint(const InetAddress& server);
+    PooledConnection* pick(Endpoint* endpoint);
+    void sendOn(PooledConnection* pc, const std::string& request,
+                const ResponseCallback& cb);
+    void drainWaiting(Endpoint* endpoint);
+    void onConnection(Endpoint* endpoint, PooledConnection* pc,
+                      const TcpConnectionPtr& conn);
+    void onMessage(Endpoint* endpoint, PooledConnection* pc,
+                   const TcpConnectionPtr& conn, Buffer* buf, Timestamp receive_time);
+    void checkHealth();
+
+    EventLoop* loop_;
+    ResponseParser parser_;
+    int connections_per_server_;
+    int max_pipeline_depth_;
+    double health_check_interval_;
+    std::string health_check_request_;
+    TimerId health_check_timer_;
+    EndpointMap endpoints_;
+};
+
+}//namespace mouse
+
+#endif
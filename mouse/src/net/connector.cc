@@ -34,7 +34,7 @@ Connector::~Connector()
 void Connector::start()
 {
     connect_ = true;
-    loop_->runInLoop(std::bind(&Connector::startInLoop, this));
+    loop_->runInLoop(std::bind(&Connector::startInLoop, shared_from_this()));
 }
 
 void Connector::startInLoop()
@@ -53,8 +53,8 @@ void Connector::startInLoop()
 
 void Connector::connect()
 {
-    int sockfd = sockets::createNonblocking();
-    int ret = sockets::connect(sockfd, server_addr_.addr());
+    int sockfd = sockets::createNonblocking(server_addr_.family());
+    int ret = sockets::connect(sockfd, server_addr_.sockAddr(), server_addr_.sockLen());
     int saved_errno = (ret == 0) ? 0 : errno;
     switch (saved_errno)
     {
@@ -70,6 +70,7 @@ void Connector::connect()
         case EADDRNOTAVAIL:
         case ECONNREFUSED:
         case ENETUNREACH:
+        case ENOENT:    // unix domain path not bound yet
             retry(sockfd);
             break;
 
@@ -105,6 +106,18 @@ void Connector::stop()
 {
     connect_ = false;
     loop_->cancel(timer_id_);
+    loop_->runInLoop(std::bind(&Connector::stopInLoop, shared_from_this()));
+}
+
+void Connector::stopInLoop()
+{
+    loop_->assertInLoopThread();
+    if (state_ == kConnecting)
+    {
+        int sockfd = removeAndResetChannel();
+        // connect_ is false, it only closes sockfd
+        retry(sockfd);
+    }
 }
 
 void Connector::connecting(int sockfd)
@@ -112,8 +125,7 @@ void Connector::connecting(int sockfd)
     setState(kConnecting);
     assert(!channel_);
     channel_.reset(new Channel(loop_, sockfd));
-    channel_->setWriteCallback(std::bind(&Connector::handleWrite, this));
-    channel_->setErrorCallback(std::bind(&Connector::handleError, this));
+    channel_->setOwner(this);
 
     // channel_->tie(shared_from_this()); is not working,
     // as channel_ is not managed by shared_ptr
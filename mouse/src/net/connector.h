@@ -1,6 +1,7 @@
 #ifndef MOUSE_NET_CONNECTOR_H
 #define MOUSE_NET_CONNECTOR_H
 
+#include "event_loop_fwd.h"
 #include "inet_address.h"
 #include "timer_id.h"
 
@@ -11,9 +12,9 @@ namespace mouse
 {
 
 class Channel;
-class EventLoop;
 
-class Connector
+/// Held by ConnectorPtr, start() and stop() queue it in its loop.
+class Connector : public std::enable_shared_from_this<Connector>
 {
 public:
     typedef std::function<void (int sockfd)> NewConnectionCallback;
@@ -26,17 +27,20 @@ public:
 
     void start();  // can be called in any thread
     void restart();  // must be called in loop thread
-    void stop();  // can be called in any thread
+    void stop();  // can be called in any thread, connecting is aborted
 
     const InetAddress& serverAddress() const { return server_addr_; }
 
 private:
+    friend class Channel;
+
     enum States { kDisconnected, kConnecting, kConnected };
     static const int kMaxRetryDelayMs = 30 * 1000;
     static const int kInitRetryDelayMs = 500;
 
     void setState(States s) { state_ = s; }
     void startInLoop();
+    void stopInLoop();
     void connect();
     void connecting(int sockfd);
     void handleWrite();
@@ -0,0 +1,605 @@
+#ifndef MOUSE_NET_COROUTINE_H
+#define MOUSE_NET_COROUTINE_H
+
+//
+// C++20 coroutines over EventLoop and TcpConnection, no extra thread:
+// a suspended coroutine is resumed by the loop callback it waits for.
+//
+//   coro::Task<> session(coro::Connection conn)
+//   {
+//       std::string line;
+//       while (!(line = co_await conn.readUntil("\r\n")).empty())
+//       {
+//           co_await conn.write(line);
+//       }
+//   }
+//   coro::spawn(session(coro::Connection(conn)));
+//
+// Header only, the library itself stays C++11, compile users with
+// -std=c++20. Everything is used in the loop thread.
+//
+
+#if __cplusplus < 202002L
+#error "coroutine.h needs C++20"
+#endif
+
+#include "connector.h"
+#include "event_loop.h"
+#include "sockets_ops.h"
+#include "tcp_connection.h"
+
+#include <algorithm>
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace mouse
+{
+namespace coro
+{
+
+namespace detail
+{
+
+// Free lists of coroutine frames by size class. A loop makes and frees
+// its frames in its own thread, so the thread local cache is per loop.
+class FrameAllocator
+{
+public:
+    static void* allocate(size_t size)
+    {
+        size_t size_class = sizeClass(size);
+        if (size_class < kClassesNum)
+        {
+            std::vector<void*>& free_list = cache().free_lists[size_class];
+            if (!free_list.empty())
+            {
+                void* frame = free_list.back();
+                free_list.pop_back();
+                return frame;
+            }
+            return ::operator new((size_class + 1) * kGranularity);
+        }
+        return ::operator new(size);
+    }
+
+    static void deallocate(void* frame, size_t size)
+    {
+        size_t size_class = sizeClass(size);
+        if (size_class < kClassesNum)
+        {
+            std::vector<void*>& free_list = cache().free_lists[size_class];
+            if (free_list.size() < kMaxFreeFrames)
+            {
+                free_list.push_back(frame);
+                return;
+            }
+        }
+        ::operator delete(frame);
+    }
+
+private:
+    static const size_t kGranularity = 64;
+    // frames up to 1 KiB are cached
+    static const size_t kClassesNum = 16;
+    static const size_t kMaxFreeFrames = 4096;
+
+    struct Cache
+    {
+        std::vector<void*> free_lists[kClassesNum];
+
+        ~Cache()
+        {
+            for (size_t i = 0; i < kClassesNum; ++i)
+            {
+                for (size_t j = 0; j < free_lists[i].size(); ++j)
+                {
+                    ::operator delete(free_lists[i][j]);
+                }
+            }
+        }
+    };
+
+    static size_t sizeClass(size_t size)
+    {
+        return (size - 1) / kGranularity;
+    }
+
+    static Cache& cache()
+    {
+        thread_local Cache cache;
+        return cache;
+    }
+};
+
+class PromiseBase
+{
+public:
+    static void* operator new(size_t size)
+    {
+        return FrameAllocator::allocate(size);
+    }
+
+    static void operator delete(void* frame, size_t size)
+    {
+        FrameAllocator::deallocate(frame, size);
+    }
+
+    // a task starts when it is awaited or detached
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            PromiseBase& promise = handle.promise();
+            if (promise.continuation_)
+            {
+                return promise.continuation_;
+            }
+            if (promise.detached_)
+            {
+                handle.destroy();
+            }
+            return std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception()
+    {
+        if (detached_)
+        {
+            // nobody to rethrow it to
+            std::terminate();
+        }
+        exception_ = std::current_exception();
+    }
+
+    void setContinuation(std::coroutine_handle<> continuation)
+    { continuation_ = continuation; }
+
+    void detach() { detached_ = true; }
+
+protected:
+    void rethrowIfFailed()
+    {
+        if (exception_)
+        {
+            std::rethrow_exception(exception_);
+        }
+    }
+
+private:
+    std::coroutine_handle<> continuation_;
+    bool detached_ = false;
+    std::exception_ptr exception_;
+};
+
+template <typename T>
+class Promise : public PromiseBase
+{
+public:
+    template <typename U>
+    void return_value(U&& value) { value_.emplace(std::forward<U>(value)); }
+
+    T result()
+    {
+        rethrowIfFailed();
+        return std::move(*value_);
+    }
+
+private:
+    std::optional<T> value_;
+};
+
+template <>
+class Promise<void> : public PromiseBase
+{
+public:
+    void return_void() {}
+
+    void result() { rethrowIfFailed(); }
+};
+
+}//namespace detail
+
+///
+/// A coroutine returning T. It starts when it is awaited, and the awaiter
+/// resumes when it returns, or when detached, see spawn().
+///
+template <typename T = void>
+class [[nodiscard]] Task
+{
+public:
+    struct promise_type : detail::Promise<T>
+    {
+        Task get_return_object()
+        { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    };
+
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    Task(Task&& rhs) noexcept
+        : handle_(std::exchange(rhs.handle_, nullptr))
+    {
+    }
+
+    Task& operator=(Task&& rhs) = delete;
+
+    ~Task()
+    {
+        if (handle_)
+        {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+    {
+        handle_.promise().setContinuation(awaiter);
+        return handle_;
+    }
+
+    T await_resume() { return handle_.promise().result(); }
+
+    /// Runs the task until its first suspension, it goes on by itself and
+    /// frees its frame when it returns.
+    void detach()
+    {
+        Handle handle = std::exchange(handle_, nullptr);
+        handle.promise().detach();
+        handle.resume();
+    }
+
+private:
+    explicit Task(Handle handle)
+        : handle_(handle)
+    {
+    }
+
+    Handle handle_;
+};
+
+inline void spawn(Task<>&& task)
+{
+    task.detach();
+}
+
+class SleepAwaiter
+{
+public:
+    SleepAwaiter(EventLoop* loop, double seconds)
+        : loop_(loop),
+          seconds_(seconds)
+    {
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        loop_->runAfter(seconds_, [handle] { handle.resume(); });
+    }
+
+    void await_resume() noexcept {}
+
+private:
+    EventLoop* loop_;
+    double seconds_;
+};
+
+/// co_await sleep(loop, 0.1) resumes in a timer callback of @c loop,
+/// 0 just lets other events run first.
+inline SleepAwaiter sleep(EventLoop* loop, double seconds)
+{
+    return SleepAwaiter(loop, seconds);
+}
+
+namespace detail
+{
+
+// shared by Connection and the callbacks it sets on the TcpConnection
+struct ConnectionState
+{
+    enum Wait { kNone, kRead, kReadUntil, kReadSome, kWrite };
+
+    // null once the Connection is gone
+    TcpConnection* conn = nullptr;
+    std::coroutine_handle<> waiter;
+    Wait wait = kNone;
+    size_t length = 0;
+    std::string delimiter;
+    bool closed = false;
+    // set on the connection only while a write waits, otherwise every
+    // send would queue a functor
+    WriteCompleteCallback write_complete;
+
+    // the end of the data the read waits for, null if it has not come
+    const char* readEnd(const Buffer* buf) const
+    {
+        const char* begin = buf->peek();
+        const char* end = begin + buf->readableBytes();
+        switch (wait)
+        {
+            case kRead:
+                return buf->readableBytes() >= length ? begin + length : nullptr;
+            case kReadSome:
+                return begin < end ? end : nullptr;
+            case kReadUntil:
+            {
+                const char* found = std::search(begin, end, delimiter.begin(), delimiter.end());
+                return found != end ? found + delimiter.size() : nullptr;
+            }
+            default:
+                return nullptr;
+        }
+    }
+
+    void resume()
+    {
+        std::coroutine_handle<> handle = std::exchange(waiter, nullptr);
+        handle.resume();
+    }
+};
+
+}//namespace detail
+
+class ReadAwaiter
+{
+public:
+    typedef detail::ConnectionState State;
+
+    ReadAwaiter(State* state, State::Wait wait, size_t length, std::string delimiter)
+        : state_(state),
+          wait_(wait),
+          length_(length),
+          delimiter_(std::move(delimiter))
+    {
+    }
+
+    bool await_ready()
+    {
+        state_->wait = wait_;
+        state_->length = length_;
+        state_->delimiter.swap(delimiter_);
+        return state_->closed || state_->readEnd(state_->conn->inputBuffer()) != nullptr;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle) { state_->waiter = handle; }
+
+    /// Empty if the connection was closed first.
+    std::string await_resume()
+    {
+        Buffer* buf = state_->conn->inputBuffer();
+        const char* end = state_->readEnd(buf);
+        state_->wait = State::kNone;
+        if (end == nullptr)
+        {
+            return std::string();
+        }
+        std::string data(buf->peek(), end);
+        buf->retrieve(data.size());
+        return data;
+    }
+
+private:
+    State* state_;
+    State::Wait wait_;
+    size_t length_;
+    std::string delimiter_;
+};
+
+class WriteAwaiter
+{
+public:
+    typedef detail::ConnectionState State;
+
+    WriteAwaiter(State* state, std::string data)
+        : state_(state),
+          data_(std::move(data))
+    {
+    }
+
+    // done at once if the socket took it all
+    bool await_ready()
+    {
+        if (state_->closed)
+        {
+            return true;
+        }
+        state_->conn->send(std::move(data_));
+        return state_->conn->outputBytes() == 0;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        state_->wait = State::kWrite;
+        state_->waiter = handle;
+        state_->conn->setWriteCompleteCallback(state_->write_complete);
+    }
+
+    /// False if the connection was closed first.
+    bool await_resume()
+    {
+        state_->wait = State::kNone;
+        return !state_->closed;
+    }
+
+private:
+    State* state_;
+    std::string data_;
+};
+
+class ConnectAwaiter;
+
+///
+/// Awaitable reads and writes of a TcpConnection. One coroutine awaits at
+/// a time, reads wait until the data is there, writes until the output
+/// buffer is drained. Data left in the input buffer by a read is there
+/// for the next one.
+///
+class Connection
+{
+public:
+    typedef detail::ConnectionState State;
+
+    /// Takes over the connection, message and write complete callbacks
+    /// of @c conn. Made in the loop thread, from the connection callback
+    /// of an established connection.
+    explicit Connection(const TcpConnectionPtr& conn)
+        : conn_(conn),
+          state_(std::make_shared<State>())
+    {
+        state_->conn = conn.get();
+        std::shared_ptr<State> state(state_);
+        conn->setConnectionCallback([state](const TcpConnectionPtr& c) {
+            if (!c->connected())
+            {
+                state->closed = true;
+                if (state->waiter)
+                {
+                    state->resume();
+                }
+            }
+        });
+        conn->setMessageCallback([state](const TcpConnectionPtr&, Buffer* buf, Timestamp) {
+            if (state->conn == nullptr)
+            {
+                buf->retrieveAll();
+            }
+            else if (state->waiter && state->readEnd(buf) != nullptr)
+            {
+                state->resume();
+            }
+        });
+        // the connection callbacks keep the state alive
+        State* raw_state = state_.get();
+        state_->write_complete = [raw_state](const TcpConnectionPtr& c) {
+            if (raw_state->waiter && raw_state->wait == State::kWrite && c->outputBytes() == 0)
+            {
+                c->setWriteCompleteCallback(WriteCompleteCallback());
+                raw_state->resume();
+            }
+        };
+    }
+
+    Connection(Connection&& rhs) noexcept = default;
+
+    /// Shuts the connection down, what was written is still sent.
+    ~Connection()
+    {
+        if (state_)
+        {
+            state_->conn = nullptr;
+            if (!state_->closed)
+            {
+                conn_->shutdown();
+            }
+        }
+    }
+
+    /// Connects to @c server_addr with a Connector, which retries with
+    /// backoff until it succeeds.
+    static ConnectAwaiter connect(EventLoop* loop, const InetAddress& server_addr);
+
+    bool connected() const { return state_ && !state_->closed; }
+    const TcpConnectionPtr& tcpConnection() const { return conn_; }
+
+    /// Exactly @c n bytes.
+    ReadAwaiter read(size_t n)
+    { return ReadAwaiter(state_.get(), State::kRead, n, std::string()); }
+
+    /// Up to and including @c delimiter.
+    ReadAwaiter readUntil(std::string delimiter)
+    { return ReadAwaiter(state_.get(), State::kReadUntil, 0, std::move(delimiter)); }
+
+    /// Whatever has been read, at least one byte.
+    ReadAwaiter readSome()
+    { return ReadAwaiter(state_.get(), State::kReadSome, 0, std::string()); }
+
+    WriteAwaiter write(std::string data)
+    { return WriteAwaiter(state_.get(), std::move(data)); }
+
+private:
+    TcpConnectionPtr conn_;
+    std::shared_ptr<State> state_;
+};
+
+class ConnectAwaiter
+{
+public:
+    ConnectAwaiter(EventLoop* loop, const InetAddress& server_addr)
+        : loop_(loop),
+          connector_(std::make_shared<Connector>(loop, server_addr)),
+          sockfd_(-1)
+    {
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        EventLoop* loop = loop_;
+        int* sockfd = &sockfd_;
+        connector_->setNewConnectionCallback([loop, sockfd, handle](int fd) {
+            *sockfd = fd;
+            // out of the Connector callback, the coroutine frees Connector
+            loop->queueInLoop([handle] { handle.resume(); });
+        });
+        connector_->start();
+    }
+
+    Connection await_resume()
+    {
+        // Connector may still have functors queued with its this pointer
+        ConnectorPtr connector(connector_);
+        loop_->queueInLoop([connector] {});
+
+        struct sockaddr_storage addr;
+        InetAddress peer_addr(addr, sockets::getPeerAddr(sockfd_, &addr));
+        TcpConnectionPtr conn(std::make_shared<TcpConnection>(
+                loop_, nextConnectionId(), sockfd_, peer_addr));
+        conn->setCloseCallback([](const TcpConnectionPtr& c) {
+            c->loop()->queueInLoop(std::bind(&TcpConnection::connectDestroyed, c));
+        });
+        Connection connection(conn);
+        conn->connectEstablished();
+        return connection;
+    }
+
+private:
+    static uint64_t nextConnectionId()
+    {
+        static std::atomic<uint64_t> next_id(1);
+        return next_id.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    EventLoop* loop_;
+    ConnectorPtr connector_;
+    int sockfd_;
+};
+
+inline ConnectAwaiter Connection::connect(EventLoop* loop, const InetAddress& server_addr)
+{
+    return ConnectAwaiter(loop, server_addr);
+}
+
+}//namespace coro
+}//namespace mouse
+
+#endif
@@ -0,0 +1,161 @@
+#include "epoller.h"
+
+#include "channel.h"
+#include "event_loop.h"
+
+#include <glog/logging.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+using namespace mouse;
+
+// Channel events are poll(2) flags, epoll(7) uses the same values
+static_assert(EPOLLIN == POLLIN, "epoll uses poll flags");
+static_assert(EPOLLPRI == POLLPRI, "epoll uses poll flags");
+static_assert(EPOLLOUT == POLLOUT, "epoll uses poll flags");
+static_assert(EPOLLRDHUP == POLLRDHUP, "epoll uses poll flags");
+static_assert(EPOLLERR == POLLERR, "epoll uses poll flags");
+static_assert(EPOLLHUP == POLLHUP, "epoll uses poll flags");
+
+namespace
+{
+
+const size_t kInitEventListSize = 16;
+
+}//namespace
+
+EPoller::EPoller(EventLoop* loop)
+    : owner_loop_(loop),
+      epollfd_(::epoll_create1(EPOLL_CLOEXEC)),
+      events_(kInitEventListSize)
+{
+    if (epollfd_ < 0)
+    {
+        LOG(FATAL) << "EPoller::EPoller epoll_create1";
+    }
+}
+
+EPoller::~EPoller()
+{
+    ::close(epollfd_);
+}
+
+void EPoller::assertInLoopThread()
+{
+    owner_loop_->assertInLoopThread();
+}
+
+Timestamp EPoller::poll(int timeout_ms, ChannelList* active_channels)
+{
+    int num_events = ::epoll_wait(epollfd_, events_.data(),
+                                  static_cast<int>(events_.size()), timeout_ms);
+    int saved_errno = errno;
+    Timestamp now(Timestamp::now());
+
+    if (num_events > 0)
+    {
+        DLOG(INFO) << num_events << " events happened";
+        fillActiveChannels(num_events, active_channels);
+        if (static_cast<size_t>(num_events) == events_.size())
+        {
+            // there may be more, the next wait gets them all
+            events_.resize(events_.size() * 2);
+        }
+    }
+    else if (num_events == 0)
+    {
+        DLOG(INFO) << "nothing happened";
+    }
+    else if (saved_errno != EINTR)
+    {
+        LOG(ERROR) << "EPoller::poll()";
+    }
+
+    return now;
+}
+
+void EPoller::fillActiveChannels(int num_events, ChannelList* active_channels) const
+{
+    for (int i = 0; i < num_events; ++i)
+    {
+        Channel* channel = static_cast<Channel*>(events_[static_cast<size_t>(i)].data.ptr);
+        channel->set_revents(static_cast<int>(events_[static_cast<size_t>(i)].events));
+        active_channels->push_back(channel);
+    }
+}
+
+void EPoller::updateChannel(Channel* channel)
+{
+    assertInLoopThread();
+
+    DLOG(INFO) << "fd = " << channel->fd() << " events = " << channel->events();
+    int index = channel->index();
+    if (index == kNew || index == kDeleted)
+    {
+        // a new one, or one without events, add with EPOLL_CTL_ADD
+        if (index == kNew)
+        {
+            assert(channels_.find(channel->fd()) == channels_.end());
+            channels_[channel->fd()] = channel;
+        }
+        else
+        {
+            assert(channels_.find(channel->fd()) != channels_.end());
+            assert(channels_[channel->fd()] == channel);
+        }
+        channel->setIndex(kAdded);
+        update(EPOLL_CTL_ADD, channel);
+    }
+    else
+    {
+        // update existing one with EPOLL_CTL_MOD/DEL
+        assert(channels_.find(channel->fd()) != channels_.end());
+        assert(channels_[channel->fd()] == channel);
+        assert(index == kAdded);
+        if (channel->isNoneEvent())
+        {
+            update(EPOLL_CTL_DEL, channel);
+            channel->setIndex(kDeleted);
+        }
+        else
+        {
+            update(EPOLL_CTL_MOD, channel);
+        }
+    }
+}
+
+void EPoller::removeChannel(Channel* channel)
+{
+    assertInLoopThread();
+    DLOG(INFO) << "fd = " << channel->fd();
+    assert(channels_.find(channel->fd()) != channels_.end());
+    assert(channels_[channel->fd()] == channel);
+    assert(channel->isNoneEvent());
+
+    int index = channel->index();
+    assert(index == kAdded || index == kDeleted);
+    size_t n = channels_.erase(channel->fd());
+    assert(n == 1); (void)n;
+    if (index == kAdded)
+    {
+        update(EPOLL_CTL_DEL, channel);
+    }
+    // may be added again
+    channel->setIndex(kNew);
+}
+
+void EPoller::update(int operation, Channel* channel)
+{
+    struct epoll_event event;
+    event.events = static_cast<uint32_t>(channel->events());
+    event.data.ptr = channel;
+    if (::epoll_ctl(epollfd_, operation, channel->fd(), &event) < 0)
+    {
+        LOG(ERROR) << "EPoller::update epoll_ctl op = " << operation
+            << " fd = " << channel->fd();
+    }
+}
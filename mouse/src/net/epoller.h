@@ -0,0 +1,61 @@
+#ifndef MOUSE_NET_EPOLLER_H
+#define MOUSE_NET_EPOLLER_H
+
+#include <map>
+#include <vector>
+
+#include "../base/timestamp.h"
+#include "event_loop_fwd.h"
+
+struct epoll_event;
+
+namespace mouse
+{
+
+class Channel;
+
+///
+/// epoll(7) backend of EventLoop, level triggered, see DefaultPoller.
+/// Same interface as Poller.
+///
+class EPoller
+{
+    //nocopyable
+    EPoller(const EPoller&) = delete;
+    EPoller& operator=(const EPoller&) = delete;
+
+public:
+    typedef std::vector<Channel*> ChannelList;
+
+    EPoller(EventLoop* loop);
+    ~EPoller();
+
+    Timestamp poll(int timeout_ms, ChannelList* active_channels);
+
+    void updateChannel(Channel* channel);
+
+    /// Remove the channel, when it destructs.
+    /// Must be called in the loop thread.
+    void removeChannel(Channel* channel);
+
+    void assertInLoopThread();
+
+private:
+    // Channel::index() of a channel
+    enum ChannelState { kNew = -1, kAdded = 1, kDeleted = 2 };
+
+    void fillActiveChannels(int num_events, ChannelList* active_channels) const;
+    void update(int operation, Channel* channel);
+
+    typedef std::vector<struct epoll_event> EventList;
+    typedef std::map<int, Channel*> ChannelMap;
+
+    EventLoop* owner_loop_;
+    const int epollfd_;
+    EventList events_;
+    ChannelMap channels_;
+};
+
+}//namespace mouse
+
+#endif
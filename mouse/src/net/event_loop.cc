@@ -1,11 +1,14 @@
 #include "event_loop.h"
 
 #include "channel.h"
+#include "mailbox.h"
 #include "poller.h"
 #include "timer_queue.h"
 
 #include <glog/logging.h>
 
+#include <algorithm>
+
 #include <assert.h>
 #include <poll.h>
 #include <stdlib.h>
@@ -14,8 +17,11 @@
 
 using namespace mouse;
 
-__thread EventLoop* t_loop_in_this_thread = 0;
+__thread void* t_loop_in_this_thread = 0;
 const int kPollTimeMs = 10000;
+// time constant of busy ratio moving average
+const double kBusyRatioDecay = 0.1;
+const size_t kDefaultMailboxCapacity = 1024;
 
 static int createEventfd()
 {
@@ -40,15 +46,26 @@ public:
 
 IgnoreSigPipe initObj;
 
+size_t detail::nextLoopLocalIndex()
+{
+    static std::atomic<size_t> next_index(0);
+    return next_index.fetch_add(1);
+}
+
 EventLoop::EventLoop()
     : looping_(false),
       quit_(false),
-      calling_pending_functors_(false),
+      event_handling_(false),
       thread_id_(std::this_thread::get_id()),
-      poller_(new Poller(this)),
-      timer_queue_(new TimerQueue(this)),
+      poller_(this),
+      timer_queue_(this),
+      low_priority_budget_(0.0),
       wakeup_fd_(createEventfd()),
-      wakeup_channel_(new Channel(this, wakeup_fd_))
+      wakeup_channel_(new Channel(this, wakeup_fd_)),
+      mailbox_capacity_(kDefaultMailboxCapacity),
+      connections_num_(0),
+      queue_size_(0),
+      busy_ratio_(0.0)
 {
     LOG(INFO) << "EventLoop created " << this << " in thread " << thread_id_;
     if (t_loop_in_this_thread)
@@ -61,7 +78,7 @@ EventLoop::EventLoop()
         t_loop_in_this_thread = this;
     }
 
-    wakeup_channel_->setReadCallback(std::bind(&EventLoop::handleRead, this));
+    wakeup_channel_->setOwner(this);
     // we are always reading the wakeupfd
     wakeup_channel_->enableReading();
 }
@@ -69,6 +86,8 @@ EventLoop::EventLoop()
 EventLoop::~EventLoop()
 {
     assert(!looping_);
+    // before anything they may refer to
+    locals_.clear();
     ::close(wakeup_fd_);
     t_loop_in_this_thread = NULL;
 }
@@ -79,20 +98,53 @@ void EventLoop::startLoop()
     assertInLoopThread();
     looping_ = true;
     quit_ = false;
+    Timestamp poll_start(Timestamp::now());
 
     while (!quit_)
     {
         active_channels_.clear();
-        poll_return_time_ = poller_->poll(kPollTimeMs, &active_channels_);
+        low_priority_channels_.clear();
+        // do not block if something was queued for the end of last iteration
+        // or left over by the budget
+        bool carried = !carried_functors_.empty() || !carried_fds_.empty();
+        int timeout_ms = iteration_end_functors_.empty() && !carried ? kPollTimeMs : 0;
+        poll_return_time_ = poller_.poll(timeout_ms, &active_channels_);
+        event_handling_ = true;
         for (ChannelList::iterator it = active_channels_.begin();
                 it != active_channels_.end(); it++)
         {
-            (*it)->handleEvent(poll_return_time_);
+            if ((*it)->priority() == Channel::kLowPriority)
+            {
+                low_priority_channels_.push_back(*it);
+            }
+            else
+            {
+                (*it)->handleEvent(poll_return_time_);
+            }
         }
 
-        doPendingFunctors();
+        // low priority channels go before functors, which may destroy
+        // connections polled in this iteration
+        Timestamp deadline(low_priority_budget_ > 0.0
+                           ? addTime(Timestamp::now(), low_priority_budget_)
+                           : Timestamp::invalid());
+        handleLowPriorityChannels(deadline);
+        event_handling_ = false;
+        doPendingFunctors(deadline);
+        doIterationEndFunctors();
+        drainMailboxes();
+        notifyMailboxTargets();
+
+        Timestamp end(Timestamp::now());
+        updateBusyRatio(poll_start, end);
+        poll_start = end;
     }
 
+    // e.g. queued by EventLoopThreadPool::broadcast() before the pool quit
+    // this loop
+    doPendingFunctors(Timestamp::invalid());
+    drainMailboxes();
+
     LOG(INFO) << "EventLoop " << this << " stop looping";
     looping_ = false;
 }
@@ -120,53 +172,92 @@ void EventLoop::runInLoop(const Functor& cb)
 
 void EventLoop::queueInLoop(const Functor& cb)
 {
+    size_t queued = pending_functors_.push(cb);
+    queue_size_.store(static_cast<int>(queued), std::memory_order_relaxed);
+
+    // queued by functors, iteration end functors or mailboxes, after
+    // doPendingFunctors() has taken the queue
+    if (!isInLoopThread() || !event_handling_)
     {
-        std::lock_guard<std::mutex> lock(mutex_);
-        pending_functors_.push_back(cb);
+        wakeup();
     }
+}
 
-    if (!isInLoopThread() || calling_pending_functors_)
+void EventLoop::queueAtIterationEnd(const Functor& cb)
+{
+    assertInLoopThread();
+    iteration_end_functors_.push_back(cb);
+}
+
+bool EventLoop::sendToLoop(EventLoop* target,
+                                                                  const Functor& cb)
+{
+    assertInLoopThread();
+    if (target == this)
     {
-        wakeup();
+        queueInLoop(cb);
+        return true;
+    }
+
+    std::shared_ptr<Mailbox>& mailbox = outgoing_mailboxes_[target];
+    if (!mailbox)
+    {
+        mailbox.reset(new Mailbox(this, target, target->mailboxCapacity()));
+        // target drains it from the iteration that runs this on, which
+        // sees what we push before too
+        target->queueInLoop(std::bind(&EventLoop::addMailboxInLoop, target, mailbox));
+    }
+    if (!mailbox->push(cb))
+    {
+        return false;
     }
+    if (!mailbox->notify_scheduled)
+    {
+        mailbox->notify_scheduled = true;
+        mailboxes_to_notify_.push_back(mailbox.get());
+    }
+    return true;
 }
 
-TimerId EventLoop::runAt(const Timestamp& time, const TimerCallback& cb)
+TimerId EventLoop::runAt(const Timestamp& time,
+                                                                const TimerCallback& cb)
 {
-    return timer_queue_->addTimer(cb, time, 0.0);
+    return timer_queue_.addTimer(cb, time, 0.0);
 }
 
-TimerId EventLoop::runAfter(double delay, const TimerCallback& cb)
+TimerId EventLoop::runAfter(double delay,
+                                                                   const TimerCallback& cb)
 {
     Timestamp time(addTime(Timestamp::now(), delay));
     return runAt(time, cb);
 }
 
-TimerId EventLoop::runEvery(double interval, const TimerCallback& cb)
+TimerId EventLoop::runEvery(double interval,
+                                                                   const TimerCallback& cb)
 {
     Timestamp time(addTime(Timestamp::now(), interval));
     //int64_t us = interval * (duration_cast<microseconds>(seconds(1))).count();
     //TimePoint time = Clock::now() + microseconds(us);
-    return timer_queue_->addTimer(cb, time, interval);
+    return timer_queue_.addTimer(cb, time, interval);
 }
 
 void EventLoop::cancel(TimerId timer_id)
 {
-  return timer_queue_->cancel(timer_id);
+  return timer_queue_.cancel(timer_id);
 }
 
 void EventLoop::updateChannel(Channel* channel)
 {
     assert(channel->loop() == this);
     assertInLoopThread();
-    poller_->updateChannel(channel);
+    poller_.updateChannel(channel);
 }
 
 void EventLoop::removeChannel(Channel* channel)
 {
   assert(channel->loop() == this);
   assertInLoopThread();
-  poller_->removeChannel(channel);
+  poller_.removeChannel(channel);
 }
 
 void EventLoop::abortNotInLoopThread()
@@ -196,22 +287,151 @@ void EventLoop::handleRead()
     }
 }
 
-void EventLoop::doPendingFunctors()
+void EventLoop::handleLowPriorityChannels(Timestamp deadline)
+{
+    if (!carried_fds_.empty())
+    {
+        // channels left over by the last iteration first
+        std::stable_partition(low_priority_channels_.begin(), low_priority_channels_.end(),
+                              [this](Channel* channel) {
+            return std::binary_search(carried_fds_.begin(), carried_fds_.end(), channel->fd());
+        });
+        carried_fds_.clear();
+    }
+
+    size_t i = 0;
+    while (i < low_priority_channels_.size()
+            && (i == 0 || !deadline.valid() || Timestamp::now() < deadline))
+    {
+        low_priority_channels_[i]->handleEvent(poll_return_time_);
+        ++i;
+    }
+    // still ready next iteration, poll is level triggered
+    for (; i < low_priority_channels_.size(); ++i)
+    {
+        carried_fds_.push_back(low_priority_channels_[i]->fd());
+    }
+    std::sort(carried_fds_.begin(), carried_fds_.end());
+}
+
+void EventLoop::doPendingFunctors(Timestamp deadline)
 {
     std::vector<Functor> functors;
-    calling_pending_functors_ = true;
 
+    //other thread may modify pending_functors_
+    pending_functors_.takeAll(&functors);
+    queue_size_.store(0, std::memory_order_relaxed);
+
+    if (!deadline.valid() && carried_functors_.empty())
     {
-        //other thread may modify pending_functors_
-        std::lock_guard<std::mutex> lock(mutex_);
-        functors.swap(pending_functors_);
+        for (size_t i = 0; i < functors.size(); ++i)
+        {
+            functors[i]();
+        }
     }
+    else
+    {
+        for (size_t i = 0; i < functors.size(); ++i)
+        {
+            carried_functors_.push_back(std::move(functors[i]));
+        }
+        bool first = true;
+        while (!carried_functors_.empty()
+                && (first || !deadline.valid() || Timestamp::now() < deadline))
+        {
+            Functor cb;
+            cb.swap(carried_functors_.front());
+            carried_functors_.pop_front();
+            cb();
+            first = false;
+        }
+        // may hide functors queued meanwhile, until the next queueInLoop()
+        queue_size_.store(static_cast<int>(carried_functors_.size()),
+                          std::memory_order_relaxed);
+    }
+}
+
+void EventLoop::updateBusyRatio(Timestamp poll_start,
+                                                                       Timestamp end)
+{
+    double total = timeDifference(end, poll_start);
+    if (total <= 0.0)
+    {
+        return;
+    }
+    double busy = timeDifference(end, poll_return_time_) / total;
+    // weight by duration, so a long idle poll resets the average at once
+    double alpha = std::min(1.0, total / kBusyRatioDecay);
+    double ratio = busy_ratio_.load(std::memory_order_relaxed);
+    busy_ratio_.store(ratio + alpha * (busy - ratio), std::memory_order_relaxed);
+}
+
+void EventLoop::doIterationEndFunctors()
+{
+    std::vector<Functor> functors;
+    functors.swap(iteration_end_functors_);
 
     for (size_t i = 0; i < functors.size(); ++i)
     {
         functors[i]();
     }
+}
+
+
+void EventLoop::addMailboxInLoop(
+        const std::shared_ptr<Mailbox>& mailbox)
+{
+    incoming_mailboxes_.push_back(mailbox);
+}
+
+void EventLoop::removeMailboxes(EventLoop* loop)
+{
+    assertInLoopThread();
+    // a wakeup scheduled for it would write to a closed eventfd
+    size_t kept = 0;
+    for (size_t i = 0; i < mailboxes_to_notify_.size(); ++i)
+    {
+        if (mailboxes_to_notify_[i]->target() != loop)
+        {
+            mailboxes_to_notify_[kept++] = mailboxes_to_notify_[i];
+        }
+    }
+    mailboxes_to_notify_.resize(kept);
+    outgoing_mailboxes_.erase(loop);
+
+    for (size_t i = 0; i < incoming_mailboxes_.size(); )
+    {
+        if (incoming_mailboxes_[i]->source() == loop)
+        {
+            incoming_mailboxes_[i]->drain();
+            incoming_mailboxes_.erase(incoming_mailboxes_.begin() + static_cast<ptrdiff_t>(i));
+        }
+        else
+        {
+            ++i;
+        }
+    }
+}
 
-    calling_pending_functors_ = false;
+void EventLoop::drainMailboxes()
+{
+    for (size_t i = 0; i < incoming_mailboxes_.size(); ++i)
+    {
+        incoming_mailboxes_[i]->drain();
+    }
 }
 
+void EventLoop::notifyMailboxTargets()
+{
+    // one wakeup per target and batch, none while the last one is pending
+    for (size_t i = 0; i < mailboxes_to_notify_.size(); ++i)
+    {
+        Mailbox* mailbox = mailboxes_to_notify_[i];
+        mailbox->notify_scheduled = false;
+        if (mailbox->needWakeup())
+        {
+            mailbox->target()->wakeup();
+        }
+    }
+    mailboxes_to_notify_.clear();
+}
@@ -3,11 +3,18 @@
 
 #include "../base/timestamp.h"
 #include "callbacks.h"
+#include "epoller.h"
+#include "event_loop_fwd.h"
+#include "poller.h"
+#include "task_queue.h"
 #include "timer_id.h"
+#include "timer_queue.h"
 
+#include <atomic>
+#include <deque>
 #include <functional>
+#include <map>
 #include <memory>
-#include <mutex>
 #include <thread>
 #include <vector>
 
@@ -15,9 +22,34 @@ namespace mouse
 {
 
 class Channel;
-class Poller;
-class TimerQueue;
+class Mailbox;
+class TcpConnection;
 
+namespace detail
+{
+
+size_t nextLoopLocalIndex();
+
+// one index per type, shared by all loops
+template <typename T>
+struct LoopLocalIndex
+{
+    static size_t get()
+    {
+        static const size_t index = nextLoopLocalIndex();
+        return index;
+    }
+};
+
+}//namespace detail
+
+///
+/// The backends are held by value, so the calls into them every iteration
+/// are direct and may be inlined, there is no virtual dispatch:
+///   DefaultPoller: Poller or EPoller, picked at build time, see
+///     event_loop_fwd.h
+///   TimerQueue, TaskQueue
+///
 class EventLoop
 {
     //nocopyable
@@ -30,6 +62,7 @@ public:
     EventLoop();
     ~EventLoop();
 
+    /// Functors queued before quit() still run before it returns.
     void startLoop();
 
     void quit();
@@ -46,6 +79,48 @@ public:
     /// Runs after finish pooling.
     /// Safe to call from other threads.
     void queueInLoop(const Functor& cb);
+    /// Queues callback to run once at the end of current iteration,
+    /// after pending functors, used to coalesce work of an iteration.
+    /// Must be called in the loop thread.
+    void queueAtIterationEnd(const Functor& cb);
+
+    /// Sends callback to @c target through a single producer, single
+    /// consumer mailbox from this loop to @c target, created on the first
+    /// send, no lock is taken. Sends of an iteration wake @c target up once
+    /// at its end, @c target runs them in a batch after pending functors.
+    /// Returns false if the mailbox holds mailboxCapacity() callbacks
+    /// already, e.g. to fall back to runInLoop().
+    /// Must be called in this loop thread.
+    bool sendToLoop(EventLoop* target, const Functor& cb);
+
+    /// Capacity of the mailboxes other loops create to send to this loop,
+    /// 1024 by default, rounded up to a power of two.
+    /// Must be called before any loop sends to this loop.
+    void setMailboxCapacity(size_t capacity) { mailbox_capacity_ = capacity; }
+    size_t mailboxCapacity() const { return mailbox_capacity_; }
+
+    /// Drops the mailboxes to and from @c loop, which has quit, after
+    /// running what it sent, e.g. when EventLoopThreadPool releases it.
+    /// @c loop is not dereferenced.
+    /// Must be called in this loop thread.
+    void removeMailboxes(EventLoop* loop);
+
+    /// Bounds the time an iteration spends on queued functors and low
+    /// priority channels, see Channel::setPriority(), after the normal
+    /// priority channels are handled. What is left carries over to the
+    /// next iteration and goes first there, the loop does not block in
+    /// poll meanwhile. At least one functor and one low priority channel
+    /// run per iteration. 0, the default, means no bound.
+    /// Must be called in the loop thread.
+    void setLowPriorityBudget(double seconds) { low_priority_budget_ = seconds; }
+
+    /// Per loop instance of @c T, default constructed on the first call
+    /// in this loop and destroyed with the loop, e.g. the shard of a cache
+    /// that only the handlers of this loop touch, without locking.
+    /// There is one instance per type, wrap a type to have several.
+    /// Must be called in the loop thread.
+    template <typename T>
+    T* local();
 
     // Runs callback at 'time'.
     TimerId runAt(const Timestamp& time, const TimerCallback& cb);
@@ -75,29 +150,95 @@ public:
         return thread_id_ == std::this_thread::get_id();
     }
 
+    /// Load published by the loop thread, can be read from any thread
+    /// without locking, the values may be slightly stale.
+
+    /// TcpConnections owned by this loop, counted from construction.
+    int connectionsNum() const
+    { return connections_num_.load(std::memory_order_relaxed); }
+
+    /// Functors waiting in the queue of runInLoop()/queueInLoop().
+    int queueSize() const
+    { return queue_size_.load(std::memory_order_relaxed); }
+
+    /// Fraction of time spent out of poll(2), moving average over
+    /// about 100ms, in [0, 1].
+    double busyRatio() const
+    { return busy_ratio_.load(std::memory_order_relaxed); }
+
 private:
+    friend class Channel;
+    friend class TcpConnection;
+
+    void addConnectionsNum(int delta)
+    { connections_num_.fetch_add(delta, std::memory_order_relaxed); }
+
+
     void abortNotInLoopThread();
     //for Wakeup, implement by eventfd
     void handleRead();
-    void doPendingFunctors();
+    void handleLowPriorityChannels(Timestamp deadline);
+    void doPendingFunctors(Timestamp deadline);
+    void doIterationEndFunctors();
+    void addMailboxInLoop(const std::shared_ptr<Mailbox>& mailbox);
+    void drainMailboxes();
+    void notifyMailboxTargets();
+    void updateBusyRatio(Timestamp poll_start, Timestamp end);
 
     typedef std::vector<Channel*> ChannelList;
 
     bool looping_;
     bool quit_;
-    bool calling_pending_functors_;
+    // dispatching polled events, functors queued meanwhile run in the
+    // same iteration, later ones need a wakeup
+    bool event_handling_;
     Timestamp poll_return_time_;
     const std::thread::id thread_id_;
-    std::unique_ptr<Poller> poller_;
-    std::unique_ptr<TimerQueue> timer_queue_;
+    DefaultPoller poller_;
+    // after poller_, its channel is removed from poller_ on destruction
+    TimerQueue timer_queue_;
     ChannelList active_channels_;
+    ChannelList low_priority_channels_;
+    double low_priority_budget_;
+    // fds of low priority channels left over by the last iteration,
+    // sorted, they are handled first when ready again
+    std::vector<int> carried_fds_;
     //for wakeup
     int wakeup_fd_;
     std::unique_ptr<Channel> wakeup_channel_;
-    std::mutex mutex_;
-    std::vector<Functor> pending_functors_; // @GuardedBy mutex_
+    TaskQueue pending_functors_;
+    // left over by the budget, run before pending_functors_
+    std::deque<Functor> carried_functors_;
+    std::vector<Functor> iteration_end_functors_;
+    //mailboxes, always in loop thread
+    size_t mailbox_capacity_;
+    std::map<EventLoop*, std::shared_ptr<Mailbox>> outgoing_mailboxes_;
+    std::vector<Mailbox*> mailboxes_to_notify_;
+    std::vector<std::shared_ptr<Mailbox>> incoming_mailboxes_;
+    //load metrics
+    std::atomic<int> connections_num_;
+    std::atomic<int> queue_size_;
+    std::atomic<double> busy_ratio_;
+    // by detail::LoopLocalIndex
+    std::vector<std::shared_ptr<void>> locals_;
 };
 
+template <typename T>
+T* EventLoop::local()
+{
+    assertInLoopThread();
+    size_t index = detail::LoopLocalIndex<T>::get();
+    if (index >= locals_.size())
+    {
+        locals_.resize(index + 1);
+    }
+    if (!locals_[index])
+    {
+        locals_[index] = std::make_shared<T>();
+    }
+    return static_cast<T*>(locals_[index].get());
+}
+
 }//namespace mouse
 
 #endif
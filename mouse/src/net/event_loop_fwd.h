@@ -0,0 +1,23 @@
+#ifndef MOUSE_NET_EVENT_LOOP_FWD_H
+#define MOUSE_NET_EVENT_LOOP_FWD_H
+
+namespace mouse
+{
+
+class EPoller;
+class EventLoop;
+class Poller;
+
+/// The poller of EventLoop, a build time choice since Channel and the
+/// pollers work with EventLoop itself. Building with MOUSE_USE_EPOLL
+/// defined, CMake option of the same name, polls with epoll(7) instead of
+/// poll(2).
+#ifdef MOUSE_USE_EPOLL
+typedef EPoller DefaultPoller;
+#else
+typedef Poller DefaultPoller;
+#endif
+
+}//namespace mouse
+
+#endif
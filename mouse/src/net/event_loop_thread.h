@@ -1,6 +1,8 @@
 #ifndef MOUES_NET_EVENT_LOOP_THREAD_H
 #define MOUSE_NET_EVENT_LOOP_THREAD_H
 
+#include "event_loop_fwd.h"
+
 #include <condition_variable>
 #include <mutex>
 #include <thread>
@@ -8,8 +10,6 @@
 namespace mouse
 {
 
-class EventLoop;
-
 class EventLoopThread
 {
     //nocopyable
@@ -4,6 +4,7 @@
 #include "event_loop_thread.h"
 
 #include <assert.h>
+#include <algorithm>
 #include <functional>
 #include <utility>
 
@@ -13,6 +14,7 @@ EventLoopThreadPool::EventLoopThreadPool(EventLoop* base_loop)
     : base_loop_(base_loop),
       started_(false),
       threads_num_(0),
+      strategy_(kRoundRobin),
       next_(0)
 {
 }
@@ -31,8 +33,98 @@ void EventLoopThreadPool::start()
 
     for (int i = 0; i < threads_num_; ++i) {
         EventLoopThread* t = new EventLoopThread;
+        EventLoop* loop = t->startLoop();
+        std::lock_guard<std::mutex> lock(mutex_);
         threads_.push_back(std::move(std::unique_ptr<EventLoopThread>(t)));
-        loops_.push_back(t->startLoop());
+        loops_.push_back(loop);
+    }
+}
+
+std::vector<EventLoop*> EventLoopThreadPool::resize(int threads_num)
+{
+    base_loop_->assertInLoopThread();
+    assert(started_ && !loops_.empty() && threads_num > 0);
+    std::vector<EventLoop*> retired;
+    while (static_cast<int>(loops_.size()) < threads_num)
+    {
+        // started outside the lock, broadcast() does not wait for it
+        EventLoopThread* t = new EventLoopThread;
+        EventLoop* loop = t->startLoop();
+        std::lock_guard<std::mutex> lock(mutex_);
+        threads_.push_back(std::unique_ptr<EventLoopThread>(t));
+        loops_.push_back(loop);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (static_cast<int>(loops_.size()) > threads_num)
+        {
+            retired.push_back(loops_.back());
+            retired_loops_.push_back(loops_.back());
+            retired_threads_.push_back(std::move(threads_.back()));
+            loops_.pop_back();
+            threads_.pop_back();
+        }
+    }
+    threads_num_ = threads_num;
+    next_ = 0;
+    return retired;
+}
+
+void EventLoopThreadPool::releaseLoop(EventLoop* loop)
+{
+    base_loop_->assertInLoopThread();
+    std::shared_ptr<EventLoopThread> thread;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<EventLoop*>::iterator it =
+            std::find(retired_loops_.begin(), retired_loops_.end(), loop);
+        assert(it != retired_loops_.end());
+        size_t i = static_cast<size_t>(it - retired_loops_.begin());
+        thread.reset(retired_threads_[i].release());
+        retired_threads_.erase(retired_threads_.begin() + static_cast<ptrdiff_t>(i));
+        retired_loops_.erase(it);
+    }
+    // the loop keeps running until every other one has dropped its
+    // mailboxes, no wakeup or drain reaches it once it is destroyed
+    gather<bool>([loop](EventLoop* running) { running->removeMailboxes(loop); return true; },
+                 base_loop_,
+                 [thread](const std::vector<bool>&) mutable {
+                     // quits the loop and joins
+                     thread.reset();
+                 });
+}
+
+std::vector<EventLoop*> EventLoopThreadPool::runningLoops() const
+{
+    if (loops_.empty())
+    {
+        return std::vector<EventLoop*>(1, base_loop_);
+    }
+    std::vector<EventLoop*> loops(loops_);
+    loops.insert(loops.end(), retired_loops_.begin(), retired_loops_.end());
+    return loops;
+}
+
+std::vector<EventLoop*> EventLoopThreadPool::getAllLoops()
+{
+    base_loop_->assertInLoopThread();
+    assert(started_);
+    if (loops_.empty())
+    {
+        return std::vector<EventLoop*>(1, base_loop_);
+    }
+    return loops_;
+}
+
+void EventLoopThreadPool::broadcast(const std::function<void(EventLoop*)>& cb)
+{
+    assert(started_);
+    // queued, not run here, cb may take mutex_ itself
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<EventLoop*> loops(runningLoops());
+    for (size_t i = 0; i < loops.size(); ++i)
+    {
+        loops[i]->queueInLoop(std::bind(cb, loops[i]));
     }
 }
 
@@ -40,19 +132,75 @@ void EventLoopThreadPool::start()
 EventLoop* EventLoopThreadPool::getNextLoop()
 {
     base_loop_->assertInLoopThread();
-    EventLoop* loop = base_loop_;
+    if (loops_.empty())
+    {
+        return base_loop_;
+    }
 
-    if (!loops_.empty())
+    switch (strategy_)
     {
-        // round-robin
-        loop = loops_[next_];
-        ++next_;
-        if (static_cast<size_t>(next_) >= loops_.size())
+    case kLeastConnections:
+    case kLeastLoaded:
+        return getLeastLoadedLoop();
+    default:
+        return getRoundRobinLoop();
+    }
+}
+
+EventLoop* EventLoopThreadPool::getLoopForHash(size_t hash_code)
+{
+    base_loop_->assertInLoopThread();
+    if (loops_.empty())
+    {
+        return base_loop_;
+    }
+    return loops_[hash_code % loops_.size()];
+}
+
+EventLoop* EventLoopThreadPool::getRoundRobinLoop()
+{
+    EventLoop* loop = loops_[next_];
+    ++next_;
+    if (static_cast<size_t>(next_) >= loops_.size())
+    {
+        next_ = 0;
+    }
+    return loop;
+}
+
+EventLoop* EventLoopThreadPool::getLeastLoadedLoop()
+{
+    // queued functors are weighted against the busy ratio,
+    // this many of them count as a fully busy loop
+    const double kQueueSizeFull = 64.0;
+
+    // scan from a rotating start, so ties are spread round-robin
+    EventLoop* best = NULL;
+    double best_load = 0.0;
+    int best_conns = 0;
+    for (size_t i = 0; i < loops_.size(); ++i)
+    {
+        EventLoop* loop = loops_[(next_ + i) % loops_.size()];
+        double load = 0.0;
+        if (strategy_ == kLeastLoaded)
+        {
+            load = loop->busyRatio() + loop->queueSize() / kQueueSizeFull;
+        }
+        int conns = loop->connectionsNum();
+        if (best == NULL || load < best_load
+                || (load == best_load && conns < best_conns))
         {
-            next_ = 0;
+            best = loop;
+            best_load = load;
+            best_conns = conns;
         }
     }
 
-    return loop;
+    ++next_;
+    if (static_cast<size_t>(next_) >= loops_.size())
+    {
+        next_ = 0;
+    }
+    return best;
 }
 
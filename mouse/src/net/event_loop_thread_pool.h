@@ -1,17 +1,20 @@
 #ifndef MOUSE_NET_EVENT_LOOP_THREAD_POOL_H
 #define MOUSE_NET_EVENT_LOOP_THREAD_POOL_H
 
+#include "event_loop.h"
+
+#include <atomic>
 #include <condition_variable>
 #include <functional>
 #include <memory>
 #include <mutex>
 #include <thread>
+#include <utility>
 #include <vector>
 
 namespace mouse
 {
 
-class EventLoop;
 class EventLoopThread;
 
 class EventLoopThreadPool
@@ -21,22 +24,155 @@ class EventLoopThreadPool
     EventLoopThreadPool& operator=(const EventLoopThread&) = delete;
 
 public:
+    /// How getNextLoop() picks an IO loop, the load aware strategies
+    /// read the metrics every loop publishes, no lock is taken.
+    enum Strategy
+    {
+        kRoundRobin,
+        // fewest TcpConnections
+        kLeastConnections,
+        // lowest busy ratio plus queued functors, ties go to
+        // fewer connections
+        kLeastLoaded,
+        // the same hash code always maps to the same loop, see
+        // getLoopForHash(), getNextLoop() falls back to round-robin
+        kHash,
+    };
+
     EventLoopThreadPool(EventLoop* base_loop);
     ~EventLoopThreadPool();
     void setThreadsNum(int threads_num) { threads_num_ = threads_num; }
+    /// IO loops in the rotation.
+    int threadsNum() const { return threads_num_; }
+    void setStrategy(Strategy strategy) { strategy_ = strategy; }
+    Strategy strategy() const { return strategy_; }
     void start();
     EventLoop* getNextLoop();
+    EventLoop* getLoopForHash(size_t hash_code);
+
+    /// All IO loops in the rotation, or the base loop if there is no thread.
+    std::vector<EventLoop*> getAllLoops();
+
+    /// Changes the number of IO loops at runtime, at least one. New loops
+    /// join the rotation at once. Retired loops, the last ones, leave the
+    /// rotation and are returned, they keep running until releaseLoop(),
+    /// so their owner can move their work elsewhere first. kHash maps to
+    /// other loops afterwards.
+    /// Must be called in the base loop thread, after start() with threads.
+    std::vector<EventLoop*> resize(int threads_num);
 
+    /// Stops a loop returned by resize() and joins its thread, its
+    /// EventLoop::local() objects are destroyed with it. The other loops
+    /// drop their mailboxes from and to it first, see
+    /// EventLoop::sendToLoop(), then it is stopped from the base loop, so
+    /// it still runs for a while. Functors queued there before, e.g. by
+    /// broadcast(), still run. Nothing may send to it afterwards.
+    /// Must be called in the base loop thread.
+    void releaseLoop(EventLoop* loop);
+
+    /// Queues @c cb in every running loop, getAllLoops() and the retired
+    /// ones not released yet, e.g. on the EventLoop::local() shards, the
+    /// calling loop too.
+    /// Thread safe, after start().
+    void broadcast(const std::function<void(EventLoop*)>& cb);
+
+    /// Runs @c cb in every loop broadcast() reaches and then @c done in
+    /// @c reply_loop with the results in the order of the loops. Every
+    /// loop stores its result in a slot of its own, nothing is locked.
+    /// Thread safe, after start().
+    template <typename R>
+    void gather(const std::function<R(EventLoop*)>& cb,
+                EventLoop* reply_loop,
+                const std::function<void(const std::vector<R>&)>& done);
 
 private:
+    template <typename R>
+    struct GatherState
+    {
+        // a slot per loop, std::vector<bool> would pack the results of
+        // several loops into one word
+        struct Slot
+        {
+            R result;
+        };
+
+        std::vector<Slot> slots;
+        std::atomic<size_t> remaining;
+        EventLoop* reply_loop;
+        std::function<void(const std::vector<R>&)> done;
+    };
+
+    // mutex_ must be held while queueing to them, releaseLoop() stops
+    // a loop once it is out of these
+    std::vector<EventLoop*> runningLoops() const;
+    template <typename R>
+    static void gatherInLoop(const std::shared_ptr<GatherState<R>>& state,
+                             const std::function<R(EventLoop*)>& cb,
+                             EventLoop* loop, size_t index);
+    template <typename R>
+    static void gatherDone(const std::shared_ptr<GatherState<R>>& state);
+    EventLoop* getRoundRobinLoop();
+    EventLoop* getLeastLoadedLoop();
+
     EventLoop* base_loop_;
     bool started_;
     int threads_num_;
+    Strategy strategy_;
     int next_;  // always in loop thread
+    // written in the base loop thread with mutex_ held, read there
+    // without it
     std::vector<std::unique_ptr<EventLoopThread>> threads_;
     std::vector<EventLoop*> loops_;
+    // retired by resize(), running until releaseLoop()
+    std::vector<std::unique_ptr<EventLoopThread>> retired_threads_;
+    std::vector<EventLoop*> retired_loops_;
+    mutable std::mutex mutex_;
 };
 
+template <typename R>
+void EventLoopThreadPool::gather(const std::function<R(EventLoop*)>& cb,
+                                 EventLoop* reply_loop,
+                                 const std::function<void(const std::vector<R>&)>& done)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<EventLoop*> loops(runningLoops());
+    std::shared_ptr<GatherState<R>> state(new GatherState<R>);
+    state->slots.resize(loops.size());
+    state->remaining.store(loops.size());
+    state->reply_loop = reply_loop;
+    state->done = done;
+    for (size_t i = 0; i < loops.size(); ++i)
+    {
+        loops[i]->queueInLoop(std::bind(&EventLoopThreadPool::gatherInLoop<R>,
+                                        state, cb, loops[i], i));
+    }
+}
+
+template <typename R>
+void EventLoopThreadPool::gatherInLoop(const std::shared_ptr<GatherState<R>>& state,
+                                       const std::function<R(EventLoop*)>& cb,
+                                       EventLoop* loop, size_t index)
+{
+    state->slots[index].result = cb(loop);
+    // the last one sees the results of all
+    if (state->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        state->reply_loop->runInLoop(std::bind(&EventLoopThreadPool::gatherDone<R>, state));
+    }
+}
+
+template <typename R>
+void EventLoopThreadPool::gatherDone(const std::shared_ptr<GatherState<R>>& state)
+{
+    std::vector<R> results;
+    results.reserve(state->slots.size());
+    for (size_t i = 0; i < state->slots.size(); ++i)
+    {
+        results.push_back(std::move(state->slots[i].result));
+    }
+    state->done(results);
+}
+
 }//namespace mouse
 
 #endif
@@ -1,11 +1,24 @@
 #include "inet_address.h"
 #include "sockets_ops.h"
 
+#include <glog/logging.h>
+
+#include <algorithm>
+
+#include <stddef.h>
+#include <string.h>
 #include <strings.h>
 #include <netinet/in.h>
 
 using namespace mouse;
 
+namespace
+{
+
+const size_t kUnixPathSize = sizeof(struct sockaddr_un) - offsetof(struct sockaddr_un, sun_path);
+
+}//namespace
+
 InetAddress::InetAddress(uint16_t port)
 {
     bzero(&addr_, sizeof addr_);
@@ -20,10 +33,110 @@ InetAddress::InetAddress(const std::string& ip, uint16_t port)
     sockets::fromIpPort(ip.c_str(), port, &addr_);
 }
 
+InetAddress::InetAddress(const struct sockaddr_storage& address, socklen_t len)
+{
+    bzero(&addr_, sizeof addr_);
+    addr_.sin_family = address.ss_family;
+    if (address.ss_family == AF_UNIX)
+    {
+        const struct sockaddr_un* unix_addr =
+            reinterpret_cast<const struct sockaddr_un*>(&address);
+        size_t path_len = std::min(static_cast<size_t>(len), sizeof(struct sockaddr_un));
+        path_len = path_len > offsetof(struct sockaddr_un, sun_path)
+            ? path_len - offsetof(struct sockaddr_un, sun_path) : 0;
+        setUnix(unix_addr->sun_path, path_len);
+    }
+    else
+    {
+        if (address.ss_family != AF_INET)
+        {
+            LOG(ERROR) << "InetAddress::InetAddress - unsupported family "
+                << address.ss_family;
+        }
+        memcpy(&addr_, &address, std::min(static_cast<size_t>(len), sizeof addr_));
+    }
+}
+
+InetAddress InetAddress::unixPath(const std::string& path)
+{
+    InetAddress address;
+    if (path.size() >= kUnixPathSize)
+    {
+        LOG(FATAL) << "InetAddress::unixPath - too long " << path;
+    }
+    // with the terminating NUL
+    address.setUnix(path.c_str(), path.size() + 1);
+    return address;
+}
+
+InetAddress InetAddress::unixAbstract(const std::string& name)
+{
+    InetAddress address;
+    if (name.size() + 1 > kUnixPathSize)
+    {
+        LOG(FATAL) << "InetAddress::unixAbstract - too long " << name;
+    }
+    // a leading NUL, no terminating NUL
+    std::string path(1, '\0');
+    path += name;
+    address.setUnix(path.data(), path.size());
+    return address;
+}
+
+void InetAddress::setUnix(const char* path, size_t len)
+{
+    bzero(&addr_, sizeof addr_);
+    addr_.sin_family = AF_UNIX;
+    unix_addr_.reset();
+    if (len > 0)
+    {
+        std::shared_ptr<UnixAddress> unix_addr(std::make_shared<UnixAddress>());
+        bzero(&unix_addr->addr, sizeof unix_addr->addr);
+        unix_addr->addr.sun_family = AF_UNIX;
+        memcpy(unix_addr->addr.sun_path, path, len);
+        unix_addr->len = static_cast<socklen_t>(offsetof(struct sockaddr_un, sun_path) + len);
+        unix_addr_ = unix_addr;
+    }
+}
+
+const struct sockaddr* InetAddress::sockAddr() const
+{
+    if (unix_addr_)
+    {
+        return reinterpret_cast<const struct sockaddr*>(&unix_addr_->addr);
+    }
+    return reinterpret_cast<const struct sockaddr*>(&addr_);
+}
+
+socklen_t InetAddress::sockLen() const
+{
+    if (unix_addr_)
+    {
+        return unix_addr_->len;
+    }
+    // an unnamed unix domain address is its family
+    return isUnix() ? static_cast<socklen_t>(sizeof(sa_family_t))
+                    : static_cast<socklen_t>(sizeof addr_);
+}
+
 std::string InetAddress::toIpPort() const
 {
+    if (isUnix())
+    {
+        if (!unix_addr_)
+        {
+            return "unix:";
+        }
+        const struct sockaddr_un& unix_addr = unix_addr_->addr;
+        size_t path_len = unix_addr_->len - offsetof(struct sockaddr_un, sun_path);
+        if (unix_addr.sun_path[0] == '\0')
+        {
+            return "unix:@" + std::string(unix_addr.sun_path + 1, path_len - 1);
+        }
+        return "unix:" + std::string(unix_addr.sun_path,
+                                     strnlen(unix_addr.sun_path, path_len));
+    }
     char buf[32];
     sockets::toIpPort(buf, sizeof buf, addr_);
     return buf;
 }
-
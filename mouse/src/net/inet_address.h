@@ -1,14 +1,21 @@
 #ifndef MOUSE_INET_ADDRESS_H
 #define MOUSE_INET_ADDRESS_H
 
+#include <memory>
 #include <string>
 
+#include <assert.h>
 #include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 namespace mouse
 {
 
-//This is a POD interface class
+//A value class, cheap to copy
+//An IPv4 address, or a unix domain (AF_UNIX) one for same host peers.
+//A unix domain path or name is kept out of line, shared by the copies,
+//so the inline part stays a sockaddr_in, e.g. in every TcpConnection.
 class InetAddress
 {
 public:
@@ -21,15 +28,51 @@ public:
     {
     }
 
+    /// Any family, as returned by accept(2) or getsockname(2).
+    InetAddress(const struct sockaddr_storage& address, socklen_t len);
+
+    /// Unix domain socket on a file system @c path. Binding fails if the
+    /// path exists, remove the socket file of a previous run first.
+    static InetAddress unixPath(const std::string& path);
+    /// Unix domain socket in the abstract namespace of the network
+    /// namespace, @c name without the leading NUL. Nothing is created in
+    /// the file system, the name goes away with the last socket.
+    static InetAddress unixAbstract(const std::string& name);
+
     //default copy/assignment
 
+    /// "ip:port", "unix:path" or "unix:@name", "unix:" if unnamed,
+    /// e.g. the peers of a unix domain server.
     std::string toIpPort() const;
 
-    const struct sockaddr_in& addr() const { return addr_; }
-    void setAddr(const struct sockaddr_in& address) { addr_ = address; }
+    sa_family_t family() const { return addr_.sin_family; }
+    bool isUnix() const { return family() == AF_UNIX; }
+
+    /// For the system calls, any family.
+    const struct sockaddr* sockAddr() const;
+    socklen_t sockLen() const;
+
+    /// IPv4 only.
+    const struct sockaddr_in& addr() const
+    { assert(family() == AF_INET); return addr_; }
+    void setAddr(const struct sockaddr_in& address)
+    { addr_ = address; unix_addr_.reset(); }
 
 private:
+    struct UnixAddress
+    {
+        struct sockaddr_un addr;
+        // the length of an abstract name is part of it
+        socklen_t len;
+    };
+
+    InetAddress() {}
+    void setUnix(const char* path, size_t len);
+
+    // only sin_family is set for unix domain
     struct sockaddr_in addr_;
+    // NULL if unnamed or IPv4
+    std::shared_ptr<const UnixAddress> unix_addr_;
 };
 
 } // namespace Mouse
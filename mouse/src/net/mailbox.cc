@@ -0,0 +1,73 @@
+#include "mailbox.h"
+
+using namespace mouse;
+
+namespace
+{
+
+size_t roundUpToPowerOfTwo(size_t n)
+{
+    size_t power = 1;
+    while (power < n)
+    {
+        power <<= 1;
+    }
+    return power;
+}
+
+}//namespace
+
+Mailbox::Mailbox(EventLoop* source, EventLoop* target, size_t capacity)
+    : notify_scheduled(false),
+      source_(source),
+      target_(target),
+      mask_(roundUpToPowerOfTwo(capacity) - 1),
+      slots_(mask_ + 1),
+      cached_head_(0)
+{
+    head_.value.store(0, std::memory_order_relaxed);
+    tail_.value.store(0, std::memory_order_relaxed);
+    wakeup_pending_.value.store(0, std::memory_order_relaxed);
+}
+
+bool Mailbox::push(const Functor& cb)
+{
+    size_t tail = tail_.value.load(std::memory_order_relaxed);
+    if (tail - cached_head_ == slots_.size())
+    {
+        cached_head_ = head_.value.load(std::memory_order_acquire);
+        if (tail - cached_head_ == slots_.size())
+        {
+            return false;
+        }
+    }
+    slots_[tail & mask_] = cb;
+    tail_.value.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+bool Mailbox::needWakeup()
+{
+    // pairs with the fence in drain(), either the consumer sees the pushed
+    // functors or we see the wakeup was consumed
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return wakeup_pending_.value.exchange(1, std::memory_order_relaxed) == 0;
+}
+
+size_t Mailbox::drain()
+{
+    wakeup_pending_.value.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    size_t head = head_.value.load(std::memory_order_relaxed);
+    const size_t tail = tail_.value.load(std::memory_order_acquire);
+    // the batch pushed so far, later ones wait for the next drain
+    for (size_t i = head; i != tail; ++i)
+    {
+        Functor cb;
+        cb.swap(slots_[i & mask_]);
+        cb();
+    }
+    head_.value.store(tail, std::memory_order_release);
+    return tail - head;
+}
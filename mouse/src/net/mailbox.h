@@ -0,0 +1,71 @@
+#ifndef MOUSE_NET_MAILBOX_H
+#define MOUSE_NET_MAILBOX_H
+
+#include "event_loop_fwd.h"
+
+#include <atomic>
+#include <functional>
+#include <vector>
+
+#include <stddef.h>
+
+namespace mouse
+{
+
+///
+/// Single producer, single consumer ring of functors from one EventLoop
+/// to another, see EventLoop::sendToLoop(). The producer loop pushes, the
+/// consumer loop pops, no lock is taken. Internal use only.
+///
+class Mailbox
+{
+    //nocopyable
+    Mailbox(const Mailbox&) = delete;
+    Mailbox& operator=(const Mailbox&) = delete;
+
+public:
+    typedef std::function<void()> Functor;
+
+    /// @c capacity is rounded up to a power of two.
+    Mailbox(EventLoop* source, EventLoop* target, size_t capacity);
+
+    EventLoop* source() const { return source_; }
+    EventLoop* target() const { return target_; }
+    size_t capacity() const { return slots_.size(); }
+
+    /// Producer side, false if the mailbox is full.
+    bool push(const Functor& cb);
+    /// Producer side, true if the consumer has to be woken up, at most
+    /// once until the consumer drains.
+    bool needWakeup();
+
+    /// Consumer side, runs the functors pushed so far and returns
+    /// how many.
+    size_t drain();
+
+    // producer side, the wakeup is pending at the end of its iteration
+    bool notify_scheduled;
+
+private:
+    // padded to a cache line, written by different threads, alignas
+    // would need C++17 aligned new
+    struct Index
+    {
+        std::atomic<size_t> value;
+        char padding[64 - sizeof(std::atomic<size_t>)];
+    };
+
+    EventLoop* const source_;
+    EventLoop* const target_;
+    const size_t mask_;
+    std::vector<Functor> slots_;
+    char padding_[64];
+    Index head_;                // next to pop, written by the consumer
+    Index tail_;                // next to push, written by the producer
+    Index wakeup_pending_;      // 1 while a wakeup is not drained yet
+    size_t cached_head_;        // producer's copy of head_
+};
+
+}//namespace mouse
+
+#endif
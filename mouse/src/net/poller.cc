@@ -1,6 +1,7 @@
 #include "poller.h"
 
 #include "channel.h"
+#include "event_loop.h"
 
 #include <glog/logging.h>
 
@@ -59,6 +60,11 @@ void Poller::fillActiveChannels(int num_events, ChannelList* active_channels) co
     }
 }
 
+void Poller::assertInLoopThread()
+{
+    owner_loop_->assertInLoopThread();
+}
+
 void Poller::updateChannel(Channel* channel)
 {
     assertInLoopThread();
@@ -128,5 +134,7 @@ void Poller::removeChannel(Channel* channel)
         channels_[channel_at_end]->setIndex(idx);
         pollfds_.pop_back();
     }
+    // may be added again
+    channel->setIndex(-1);
 }
 
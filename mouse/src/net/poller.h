@@ -5,7 +5,7 @@
 #include <vector>
 
 #include "../base/timestamp.h"
-#include "event_loop.h"
+#include "event_loop_fwd.h"
 
 struct pollfd;
 
@@ -14,6 +14,9 @@ namespace mouse
 
 class Channel;
 
+///
+/// poll(2) backend of EventLoop, the default.
+///
 class Poller
 {
     //nocopyable
@@ -35,7 +38,7 @@ public:
     void removeChannel(Channel* channel);
 
 
-    void assertInLoopThread() { owner_loop_->assertInLoopThread(); }
+    void assertInLoopThread();
 
 private:
     void fillActiveChannels(int num_events, ChannelList* active_channels) const;
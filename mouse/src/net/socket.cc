@@ -3,8 +3,11 @@
 #include "inet_address.h"
 #include "sockets_ops.h"
 
+#include <glog/logging.h>
+
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <strings.h>
 
 using namespace mouse;
@@ -16,7 +19,7 @@ Socket::~Socket()
 
 void Socket::bindAddress(const InetAddress& addr)
 {
-    sockets::bind(fd_, addr.addr());
+    sockets::bind(fd_, addr.sockAddr(), addr.sockLen());
 }
 
 void Socket::listen()
@@ -26,12 +29,13 @@ void Socket::listen()
 
 int Socket::accept(InetAddress* peeraddr)
 {
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
     bzero(&addr, sizeof addr);
-    int connfd = sockets::accept(fd_, &addr);
+    socklen_t addrlen = 0;
+    int connfd = sockets::accept(fd_, &addr, &addrlen);
     if (connfd >= 0)
     {
-        peeraddr->setAddr(addr);
+        *peeraddr = InetAddress(addr, addrlen);
     }
     return connfd;
 }
@@ -43,6 +47,44 @@ void Socket::setReuseAddr(bool on)
             &optval, sizeof optval);
 }
 
+void Socket::setReusePort(bool on)
+{
+    int optval = on ? 1 : 0;
+    int ret = ::setsockopt(fd_, SOL_SOCKET, SO_REUSEPORT,
+            &optval, sizeof optval);
+    if (ret < 0 && on)
+    {
+        LOG(ERROR) << "SO_REUSEPORT failed.";
+    }
+}
+
+void Socket::setTcpNoDelay(bool on)
+{
+    int optval = on ? 1 : 0;
+    ::setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY,
+            &optval, sizeof optval);
+}
+
+bool Socket::setZeroCopy(bool on)
+{
+    int optval = on ? 1 : 0;
+    return ::setsockopt(fd_, SOL_SOCKET, SO_ZEROCOPY,
+            &optval, sizeof optval) == 0;
+}
+
+bool Socket::setUdpGro(bool on)
+{
+    int optval = on ? 1 : 0;
+    return ::setsockopt(fd_, SOL_UDP, UDP_GRO, &optval, sizeof optval) == 0;
+}
+
+bool Socket::probeUdpGso()
+{
+    // 0 keeps segmentation off unless a send asks for it
+    int optval = 0;
+    return ::setsockopt(fd_, SOL_UDP, UDP_SEGMENT, &optval, sizeof optval) == 0;
+}
+
 void Socket::shutdownWrite()
 {
   sockets::shutdownWrite(fd_);
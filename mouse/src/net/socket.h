@@ -1,5 +1,5 @@
 #ifndef MOUSE_NET_SOCKET_H
-#define MOUES_NET_SOCKET_H
+#define MOUSE_NET_SOCKET_H
 
 namespace mouse
 {
@@ -26,6 +26,20 @@ public:
     int accept(InetAddress* peeraddr);
 
     void setReuseAddr(bool on);
+    void setReusePort(bool on);
+
+    // Enable/disable TCP_NODELAY (disable/enable Nagle's algorithm).
+    void setTcpNoDelay(bool on);
+
+    // Enable SO_ZEROCOPY, returns false if not supported by kernel.
+    bool setZeroCopy(bool on);
+
+    // UDP only, enable receive offload (UDP_GRO), returns false if not
+    // supported by kernel.
+    bool setUdpGro(bool on);
+    // UDP only, probes send offload (UDP_SEGMENT), returns false if not
+    // supported by kernel.
+    bool probeUdpGso();
 
     void shutdownWrite();
 
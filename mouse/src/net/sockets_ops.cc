@@ -2,9 +2,11 @@
 
 #include <glog/logging.h>
 
+#include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -16,17 +18,14 @@ namespace
 
 typedef struct sockaddr SA;
 
-const SA* sockaddr_cast(const struct sockaddr_in* addr)
-{
-    return reinterpret_cast<const SA*>(addr);
-}
-
-SA* sockaddr_cast(struct sockaddr_in* addr)
+SA* sockaddr_cast(struct sockaddr_storage* addr)
 {
     return reinterpret_cast<SA*>(addr);
 }
 
-void setNonBlockAndCloseOnExec(int sockfd)
+}//namespace
+
+void sockets::setNonBlockAndCloseOnExec(int sockfd)
 {
   // non-block
     int flags = ::fcntl(sockfd, F_GETFL, 0);
@@ -39,13 +38,11 @@ void setNonBlockAndCloseOnExec(int sockfd)
     ::fcntl(sockfd, F_SETFD, flags);
 }
 
-}//namespace
-
-int sockets::createNonblocking()
+int sockets::createNonblocking(sa_family_t family)
 {
-    int sockfd = ::socket(AF_INET,
+    int sockfd = ::socket(family,
             SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
-            IPPROTO_TCP);
+            family == AF_UNIX ? 0 : IPPROTO_TCP);
     if (sockfd < 0)
     {
         LOG(FATAL) << "sockets::createNonblocking";
@@ -54,14 +51,27 @@ int sockets::createNonblocking()
     return sockfd;
 }
 
-int sockets::connect(int sockfd, const struct sockaddr_in& addr)
+int sockets::createNonblockingUdp()
+{
+    int sockfd = ::socket(AF_INET,
+            SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            IPPROTO_UDP);
+    if (sockfd < 0)
+    {
+        LOG(FATAL) << "sockets::createNonblockingUdp";
+    }
+
+    return sockfd;
+}
+
+int sockets::connect(int sockfd, const struct sockaddr* addr, socklen_t addrlen)
 {
-    return ::connect(sockfd, sockaddr_cast(&addr), sizeof addr);
+    return ::connect(sockfd, addr, addrlen);
 }
 
-void sockets::bind(int sockfd, const struct sockaddr_in& addr)
+void sockets::bind(int sockfd, const struct sockaddr* addr, socklen_t addrlen)
 {
-    int ret = ::bind(sockfd, sockaddr_cast(&addr), sizeof addr);
+    int ret = ::bind(sockfd, addr, addrlen);
     if (ret < 0)
     {
         LOG(FATAL) << "sockets::bind";
@@ -77,17 +87,21 @@ void sockets::listen(int sockfd)
     }
 }
 
-int sockets::accept(int sockfd, struct sockaddr_in* addr)
+int sockets::accept(int sockfd, struct sockaddr_storage* addr, socklen_t* addrlen)
 {
-    socklen_t addrlen = sizeof *addr;
+    *addrlen = sizeof *addr;
 
     int connfd = ::accept4(sockfd, sockaddr_cast(addr),
-            &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
 
     if (connfd < 0)
     {
         int saved_errno = errno;
-        LOG(ERROR) << "Socket::accept";
+        // out of fds is handled and reported by Acceptor
+        if (saved_errno != EAGAIN && saved_errno != EMFILE && saved_errno != ENFILE)
+        {
+            LOG(ERROR) << "Socket::accept";
+        }
         switch (saved_errno)
         {
             case EAGAIN:
@@ -96,13 +110,13 @@ int sockets::accept(int sockfd, struct sockaddr_in* addr)
             case EPROTO: // ???
             case EPERM:
             case EMFILE: // per-process lmit of open file desctiptor ???
+            case ENFILE: // handled by Acceptor with its reserved fd
                 // expected errors
                 errno = saved_errno;
                 break;
             case EBADF:
             case EFAULT:
             case EINVAL:
-            case ENFILE:
             case ENOBUFS:
             case ENOMEM:
             case ENOTSOCK:
@@ -127,6 +141,15 @@ void sockets::close(int sockfd)
     }
 }
 
+void sockets::closeWithReset(int sockfd)
+{
+    struct linger opt;
+    opt.l_onoff = 1;
+    opt.l_linger = 0;
+    ::setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &opt, static_cast<socklen_t>(sizeof opt));
+    close(sockfd);
+}
+
 void sockets::shutdownWrite(int sockfd)
 {
   if (::shutdown(sockfd, SHUT_WR) < 0)
@@ -136,6 +159,86 @@ void sockets::shutdownWrite(int sockfd)
 }
 
 
+ssize_t sockets::sendFds(int sockfd, const void* data, size_t len,
+                         const int* fds, int fds_num)
+{
+    assert(len > 0 && 0 <= fds_num && fds_num <= kMaxFdsPerMessage);
+    struct iovec iov;
+    iov.iov_base = const_cast<void*>(data);
+    iov.iov_len = len;
+
+    char control[CMSG_SPACE(sizeof(int) * kMaxFdsPerMessage)];
+    struct msghdr msg;
+    bzero(&msg, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fds_num > 0)
+    {
+        size_t fds_len = sizeof(int) * static_cast<size_t>(fds_num);
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(fds_len);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fds_len);
+        memcpy(CMSG_DATA(cmsg), fds, fds_len);
+    }
+
+    ssize_t n = ::sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    if (n < 0)
+    {
+        LOG(ERROR) << "sockets::sendFds";
+    }
+    return n;
+}
+
+ssize_t sockets::recvFds(int sockfd, void* data, size_t len,
+                         int* fds, int max_fds, int* fds_num)
+{
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = len;
+    return recvFds(sockfd, &iov, 1, fds, max_fds, fds_num);
+}
+
+ssize_t sockets::recvFds(int sockfd, const struct iovec* iov, int iovcnt,
+                         int* fds, int max_fds, int* fds_num)
+{
+    assert(0 <= max_fds && max_fds <= kMaxFdsPerMessage);
+    char control[CMSG_SPACE(sizeof(int) * kMaxFdsPerMessage)];
+    struct msghdr msg;
+    bzero(&msg, sizeof msg);
+    msg.msg_iov = const_cast<struct iovec*>(iov);
+    msg.msg_iovlen = static_cast<size_t>(iovcnt);
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * static_cast<size_t>(max_fds));
+
+    *fds_num = 0;
+    ssize_t n = ::recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0)
+    {
+        LOG(ERROR) << "sockets::recvFds";
+        return n;
+    }
+    if (msg.msg_flags & MSG_CTRUNC)
+    {
+        // the kernel has closed the fds that did not fit
+        LOG(ERROR) << "sockets::recvFds - more than " << max_fds << " fds, truncated";
+    }
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            size_t fds_len = cmsg->cmsg_len - CMSG_LEN(0);
+            memcpy(fds + *fds_num, CMSG_DATA(cmsg), fds_len);
+            *fds_num += static_cast<int>(fds_len / sizeof(int));
+        }
+    }
+    return n;
+}
+
 void sockets::toIpPort(char* buf, size_t size, const struct sockaddr_in& addr)
 {
     char ip[INET_ADDRSTRLEN] = "INVALID";
@@ -154,28 +257,26 @@ void sockets::fromIpPort(const char* ip, uint16_t port, struct sockaddr_in* addr
     }
 }
 
-struct sockaddr_in sockets::getLocalAddr(int sockfd)
+socklen_t sockets::getLocalAddr(int sockfd, struct sockaddr_storage* addr)
 {
-    struct sockaddr_in local_addr;
-    bzero(&local_addr, sizeof local_addr);
-    socklen_t addrlen = sizeof(local_addr);
-    if (::getsockname(sockfd, sockaddr_cast(&local_addr), &addrlen) < 0)
+    bzero(addr, sizeof *addr);
+    socklen_t addrlen = sizeof *addr;
+    if (::getsockname(sockfd, sockaddr_cast(addr), &addrlen) < 0)
     {
         LOG(ERROR) << "sockets::getLocalAddr";
     }
-    return local_addr;
+    return addrlen;
 }
 
-struct sockaddr_in sockets::getPeerAddr(int sockfd)
+socklen_t sockets::getPeerAddr(int sockfd, struct sockaddr_storage* addr)
 {
-    struct sockaddr_in peer_addr;
-    bzero(&peer_addr, sizeof peer_addr);
-    socklen_t addrlen = sizeof(peer_addr);
-    if (::getpeername(sockfd, sockaddr_cast(&peer_addr), &addrlen) < 0)
+    bzero(addr, sizeof *addr);
+    socklen_t addrlen = sizeof *addr;
+    if (::getpeername(sockfd, sockaddr_cast(addr), &addrlen) < 0)
     {
         LOG(ERROR) << "sockets::getPeerAddr";
     }
-    return peer_addr;
+    return addrlen;
 }
 
 int sockets::getSocketError(int sockfd)
@@ -195,8 +296,19 @@ int sockets::getSocketError(int sockfd)
 
 bool sockets::isSelfConnect(int sockfd)
 {
-    struct sockaddr_in local_addr = getLocalAddr(sockfd);
-    struct sockaddr_in peer_addr = getPeerAddr(sockfd);
-    return local_addr.sin_port == peer_addr.sin_port
-        && local_addr.sin_addr.s_addr == peer_addr.sin_addr.s_addr;
+    struct sockaddr_storage local_storage;
+    struct sockaddr_storage peer_storage;
+    getLocalAddr(sockfd, &local_storage);
+    getPeerAddr(sockfd, &peer_storage);
+    if (local_storage.ss_family != AF_INET)
+    {
+        // a unix domain client is unnamed
+        return false;
+    }
+    const struct sockaddr_in* local_addr =
+        reinterpret_cast<const struct sockaddr_in*>(&local_storage);
+    const struct sockaddr_in* peer_addr =
+        reinterpret_cast<const struct sockaddr_in*>(&peer_storage);
+    return local_addr->sin_port == peer_addr->sin_port
+        && local_addr->sin_addr.s_addr == peer_addr->sin_addr.s_addr;
 }
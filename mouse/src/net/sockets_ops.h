@@ -3,6 +3,8 @@
 
 #include <arpa/inet.h>
 #include <endian.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 namespace mouse
 {
@@ -11,21 +13,44 @@ namespace sockets
 {
 
 //create a non-blocking socket file description
+//of @c family, AF_INET for TCP or AF_UNIX for a unix domain stream
 //abort is any error
-int createNonblocking();
+int createNonblocking(sa_family_t family = AF_INET);
+//create a non-blocking UDP socket, abort on error
+int createNonblockingUdp();
+void setNonBlockAndCloseOnExec(int sockfd);
 
-int  connect(int sockfd, const struct sockaddr_in& addr);
-void bind(int sockfd, const struct sockaddr_in& addr);
+int  connect(int sockfd, const struct sockaddr* addr, socklen_t addrlen);
+void bind(int sockfd, const struct sockaddr* addr, socklen_t addrlen);
 void listen(int sockfd);
-int  accept(int sockfd, struct sockaddr_in* addr);
+// @c *addrlen is set to the length of the peer address
+int  accept(int sockfd, struct sockaddr_storage* addr, socklen_t* addrlen);
 void close(int sockfd);
+// close with RST, leaves no TIME_WAIT behind
+void closeWithReset(int sockfd);
 void shutdownWrite(int sockfd);
 
+// SCM_MAX_FD of the kernel
+const int kMaxFdsPerMessage = 253;
+
+// Passes @c fds along with @c len (> 0) bytes of @c data over a unix
+// domain socket with SCM_RIGHTS, returns bytes sent or -1.
+ssize_t sendFds(int sockfd, const void* data, size_t len,
+                const int* fds, int fds_num);
+// Receives up to @c max_fds fds, they are close-on-exec,
+// @c *fds_num is set to the number received. Returns bytes received or -1.
+ssize_t recvFds(int sockfd, void* data, size_t len,
+                int* fds, int max_fds, int* fds_num);
+// The same, scattered into @c iovcnt buffers.
+ssize_t recvFds(int sockfd, const struct iovec* iov, int iovcnt,
+                int* fds, int max_fds, int* fds_num);
+
 void toIpPort(char* buf, size_t size, const struct sockaddr_in& addr);
 void fromIpPort(const char* ip, uint16_t port, struct sockaddr_in* addr);
 
-struct sockaddr_in getLocalAddr(int sockfd);
-struct sockaddr_in getPeerAddr(int sockfd);
+// return the length of the address
+socklen_t getLocalAddr(int sockfd, struct sockaddr_storage* addr);
+socklen_t getPeerAddr(int sockfd, struct sockaddr_storage* addr);
 
 int getSocketError(int sockfd);
 bool isSelfConnect(int sockfd);
@@ -0,0 +1,53 @@
+#ifndef MOUSE_NET_TASK_QUEUE_H
+#define MOUSE_NET_TASK_QUEUE_H
+
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <stddef.h>
+
+namespace mouse
+{
+
+///
+/// Functors queued for an EventLoop by any thread, taken by the loop
+/// thread in a batch per iteration. Inline, called on every queueInLoop()
+/// and every iteration.
+///
+class TaskQueue
+{
+    //nocopyable
+    TaskQueue(const TaskQueue&) = delete;
+    TaskQueue& operator=(const TaskQueue&) = delete;
+
+public:
+    typedef std::function<void()> Functor;
+
+    TaskQueue() {}
+
+    /// Returns the number of functors queued now.
+    /// Thread safe.
+    size_t push(const Functor& cb)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        functors_.push_back(cb);
+        return functors_.size();
+    }
+
+    /// Swaps the queued functors into the empty @c functors.
+    /// Thread safe.
+    void takeAll(std::vector<Functor>* functors)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        functors->swap(functors_);
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<Functor> functors_; // @GuardedBy mutex_
+};
+
+}//namespace mouse
+
+#endif
@@ -0,0 +1,138 @@
+#include "tcp_client.h"
+
+#include "event_loop.h"
+#include "sockets_ops.h"
+
+#include <glog/logging.h>
+
+#include <functional>
+using namespace std::placeholders;
+
+#include <assert.h>
+
+using namespace mouse;
+
+namespace
+{
+
+void removeDetachedConnection(EventLoop* loop, const TcpConnectionPtr& conn)
+{
+    loop->queueInLoop(std::bind(&TcpConnection::connectDestroyed, conn));
+}
+
+void defaultConnectionCallback(const TcpConnectionPtr& conn)
+{
+}
+
+void defaultMessageCallback(const TcpConnectionPtr& conn, Buffer* buf, Timestamp)
+{
+    buf->retrieveAll();
+}
+
+void keepConnector(const ConnectorPtr& connector)
+{
+}
+
+}//namespace
+
+TcpClient::TcpClient(EventLoop* loop, const InetAddress& server_addr)
+    : loop_(CHECK_NOTNULL(loop)),
+      connector_(new Connector(loop, server_addr)),
+      connection_callback_(defaultConnectionCallback),
+      message_callback_(defaultMessageCallback),
+      retry_(false),
+      connect_(false),
+      next_conn_id_(1)
+{
+    connector_->setNewConnectionCallback(
+            std::bind(&TcpClient::newConnection, this, _1));
+    DLOG(INFO) << "TcpClient::TcpClient[" << this << "] - connector "
+        << connector_.get();
+}
+
+TcpClient::~TcpClient()
+{
+    loop_->assertInLoopThread();
+    DLOG(INFO) << "TcpClient::~TcpClient[" << this << "] - connector "
+        << connector_.get();
+    TcpConnectionPtr conn;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        conn.swap(connection_);
+    }
+
+    connector_->stop();
+    if (conn)
+    {
+        // the connection may outlive us, detach it from this
+        conn->setConnectionCallback(defaultConnectionCallback);
+        conn->setMessageCallback(defaultMessageCallback);
+        conn->setWriteCompleteCallback(WriteCompleteCallback());
+        conn->setCloseCallback(std::bind(removeDetachedConnection, loop_, _1));
+        conn->forceClose();
+    }
+    // Connector may still have functors queued with its this pointer,
+    // they run before this one.
+    loop_->queueInLoop(std::bind(keepConnector, connector_));
+}
+
+void TcpClient::connect()
+{
+    DLOG(INFO) << "TcpClient::connect[" << this << "] - connecting to "
+        << connector_->serverAddress().toIpPort();
+    connect_ = true;
+    connector_->start();
+}
+
+void TcpClient::disconnect()
+{
+    connect_ = false;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (connection_)
+    {
+        connection_->shutdown();
+    }
+}
+
+void TcpClient::stop()
+{
+    connect_ = false;
+    connector_->stop();
+}
+
+void TcpClient::newConnection(int sockfd)
+{
+    loop_->assertInLoopThread();
+    struct sockaddr_storage addr;
+    InetAddress peer_addr(addr, sockets::getPeerAddr(sockfd, &addr));
+    TcpConnectionPtr conn(
+            std::make_shared<TcpConnection>(loop_, next_conn_id_++, sockfd, peer_addr));
+    conn->setConnectionCallback(connection_callback_);
+    conn->setMessageCallback(message_callback_);
+    conn->setWriteCompleteCallback(write_complete_callback_);
+    conn->setCloseCallback(std::bind(&TcpClient::removeConnection, this, _1));
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        connection_ = conn;
+    }
+    conn->connectEstablished();
+}
+
+void TcpClient::removeConnection(const TcpConnectionPtr& conn)
+{
+    loop_->assertInLoopThread();
+    assert(loop_ == conn->loop());
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        assert(connection_ == conn);
+        connection_.reset();
+    }
+
+    loop_->queueInLoop(std::bind(&TcpConnection::connectDestroyed, conn));
+    if (retry_ && connect_)
+    {
+        LOG(INFO) << "TcpClient::removeConnection[" << this << "] - reconnecting to "
+            << connector_->serverAddress().toIpPort();
+        connector_->restart();
+    }
+}
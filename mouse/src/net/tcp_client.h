@@ -0,0 +1,85 @@
+#ifndef MOUSE_NET_TCP_CLIENT_H
+#define MOUSE_NET_TCP_CLIENT_H
+
+#include "callbacks.h"
+#include "connector.h"
+#include "tcp_connection.h"
+
+#include <mutex>
+
+#include <stdint.h>
+
+namespace mouse
+{
+
+///
+/// One connection to a server, the connection is made by Connector, which
+/// retries with exponential backoff until it succeeds.
+/// With retry enabled the client connects again after it is disconnected.
+///
+class TcpClient
+{
+    //nocopyable
+    TcpClient(const TcpClient&) = delete;
+    TcpClient& operator=(const TcpClient&) = delete;
+
+public:
+    TcpClient(EventLoop* loop, const InetAddress& server_addr);
+    /// Must be called in the loop thread, the connection is force closed,
+    /// no callback is called any more.
+    ~TcpClient();
+
+    /// Thread safe.
+    void connect();
+    /// Shuts down the connection, does not reconnect.
+    /// Thread safe.
+    void disconnect();
+    /// Stops connecting, the connection made already is kept.
+    /// Thread safe.
+    void stop();
+
+    /// Null while disconnected.
+    /// Thread safe.
+    TcpConnectionPtr connection() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return connection_;
+    }
+
+    EventLoop* loop() const { return loop_; }
+    const InetAddress& serverAddress() const { return connector_->serverAddress(); }
+    bool retry() const { return retry_; }
+    /// Connects again after the connection is closed, by either side.
+    void enableRetry() { retry_ = true; }
+
+    /// Not thread safe, set them before connect().
+    void setConnectionCallback(const ConnectionCallback& cb)
+    { connection_callback_ = cb; }
+
+    void setMessageCallback(const MessageCallback& cb)
+    { message_callback_ = cb; }
+
+    void setWriteCompleteCallback(const WriteCompleteCallback& cb)
+    { write_complete_callback_ = cb; }
+
+private:
+    // in loop thread
+    void newConnection(int sockfd);
+    void removeConnection(const TcpConnectionPtr& conn);
+
+    EventLoop* loop_;
+    ConnectorPtr connector_;
+    ConnectionCallback connection_callback_;
+    MessageCallback message_callback_;
+    WriteCompleteCallback write_complete_callback_;
+    bool retry_;   // atomic
+    bool connect_; // atomic
+    // always in loop thread
+    uint64_t next_conn_id_;
+    mutable std::mutex mutex_;
+    TcpConnectionPtr connection_; // @GuardedBy mutex_
+};
+
+}//namespace mouse
+
+#endif
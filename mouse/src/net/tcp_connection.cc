@@ -4,6 +4,7 @@
 #include "event_loop.h"
 #include "socket.h"
 #include "sockets_ops.h"
+#include "tcp_relay.h"
 
 #include <glog/logging.h>
 
@@ -11,69 +12,499 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
 #include <stdio.h>
+#include <strings.h>
+#include <sys/socket.h>
 
 using namespace mouse;
 
+namespace
+{
+
+// reading with fds spills into the stack like Buffer::readFd()
+const size_t kFdPassingReadSize = 65536;
+
+// storage grown past the initial size by a burst goes back once drained,
+// the initial size is kept for the next message, see releaseBuffers()
+void releaseGrown(Buffer* buffer)
+{
+    assert(buffer->readableBytes() == 0);
+    if (buffer->capacity() > Buffer::kCheapPrepend + Buffer::kInitialSize)
+    {
+        buffer->release();
+    }
+}
+
+// what a connection has until setCallbacks() or the setters
+const std::shared_ptr<const TcpConnection::Callbacks>& emptyCallbacks()
+{
+    static const std::shared_ptr<const TcpConnection::Callbacks> callbacks(
+            std::make_shared<TcpConnection::Callbacks>());
+    return callbacks;
+}
+
+}//namespace
+
 TcpConnection::TcpConnection(EventLoop* loop,
-                             const std::string& name,
+                             uint64_t id,
                              int sockfd,
-                             const InetAddress& local_address,
-                             const InetAddress& peer_address) 
+                             const InetAddress& peer_address)
     : loop_(CHECK_NOTNULL(loop)),
-      name_(name),
+      id_(id),
       state_(kConnecting),
-      socket_(new Socket(sockfd)),
-      channel_(new Channel(loop, sockfd)),
-      local_address_(local_address),
-      peer_address_(peer_address)
+      reading_(true),
+      deferred_flush_(false),
+      flush_scheduled_(false),
+      socket_(sockfd),
+      channel_(loop, sockfd),
+      peer_address_(peer_address),
+      callbacks_(emptyCallbacks()),
+      high_water_mark_(64*1024*1024),
+      high_water_mark_timeout_(0.0),
+      high_water_mark_timer_armed_(false),
+      zerocopy_threshold_(0),
+      zerocopy_writing_(false),
+      fd_passing_(false),
+      bytes_received_(0),
+      migrating_(false),
+      extras_(NULL)
 {
-    DLOG(INFO) << "TcpConnection::ctor[" <<  name_ << "] at " << this
+    DLOG(INFO) << "TcpConnection::ctor[" <<  name() << "] at " << this
         << " fd=" << sockfd;
-    using std::placeholders::_1;
-    channel_->setReadCallback(std::bind(&TcpConnection::handleRead, this, _1));
-    channel_->setWriteCallback(std::bind(&TcpConnection::handleWrite, this));
-    channel_->setCloseCallback(std::bind(&TcpConnection::handleClose, this));
-    channel_->setErrorCallback(std::bind(&TcpConnection::handleError, this));
+    loop->addConnectionsNum(1);
+    channel_.setOwner(this);
 }
 
 TcpConnection::~TcpConnection()
 {
-    DLOG(INFO) << "TcpConnection::dtor[" <<  name_ << "] at " << this
-        << " fd=" << channel_->fd();
+    DLOG(INFO) << "TcpConnection::dtor[" <<  name() << "] at " << this
+        << " fd=" << channel_.fd();
+    Extras* extras = this->extras();
+    if (extras == NULL)
+    {
+        return;
+    }
+    for (std::list<OutgoingFds>::iterator it = extras->outgoing_fds.begin();
+            it != extras->outgoing_fds.end(); ++it)
+    {
+        for (size_t i = 0; i < it->fds.size(); ++i)
+        {
+            sockets::close(it->fds[i]);
+        }
+    }
+    for (size_t i = 0; i < extras->received_fds.size(); ++i)
+    {
+        sockets::close(extras->received_fds[i]);
+    }
+    delete extras;
+}
+
+TcpConnection::Extras* TcpConnection::ensureExtras()
+{
+    Extras* extras = extras_.load(std::memory_order_acquire);
+    if (extras == NULL)
+    {
+        // another thread may race us, the first one wins
+        Extras* created = new Extras;
+        if (extras_.compare_exchange_strong(extras, created, std::memory_order_acq_rel))
+        {
+            extras = created;
+        }
+        else
+        {
+            delete created;
+        }
+    }
+    return extras;
+}
+
+// Copied on every change, the connections sharing the old ones keep them.
+TcpConnection::Callbacks* TcpConnection::copyCallbacks()
+{
+    std::shared_ptr<Callbacks> callbacks(std::make_shared<Callbacks>(*callbacks_));
+    callbacks_ = callbacks;
+    return callbacks.get();
+}
+
+void TcpConnection::setConnectionCallback(const ConnectionCallback& cb)
+{
+    copyCallbacks()->connection = cb;
+}
+
+void TcpConnection::setMessageCallback(const MessageCallback& cb)
+{
+    copyCallbacks()->message = cb;
+}
+
+void TcpConnection::setWriteCompleteCallback(const WriteCompleteCallback& cb)
+{
+    copyCallbacks()->write_complete = cb;
+}
+
+void TcpConnection::setHighWaterMarkCallback(const HighWaterMarkCallback& cb,
+                                             size_t high_water_mark)
+{
+    copyCallbacks()->high_water_mark = cb;
+    high_water_mark_ = high_water_mark;
+}
+
+std::string TcpConnection::name() const
+{
+    char buf[32];
+    snprintf(buf, sizeof buf, "#%llu", static_cast<unsigned long long>(id_));
+    return peer_address_.toIpPort() + buf;
+}
+
+InetAddress TcpConnection::localAddress() const
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sockets::getLocalAddr(socket_.fd(), &addr);
+    return InetAddress(addr, addrlen);
 }
 
 void TcpConnection::send(const std::string& message)
 {
     if (state_ == kConnected)
     {
-        if (loop_->isInLoopThread())
+        if (inOwnLoopThread())
         {
             sendInLoop(message);
         }
         else
         {
             //message will be copy
-            loop_->runInLoop(
-                    std::bind(&TcpConnection::sendInLoop, this, message));
+            runInOwnLoop(std::bind(&TcpConnection::sendInLoop, this, message));
+        }
+    }
+}
+
+void TcpConnection::send(std::string&& message)
+{
+    if (state_ == kConnected)
+    {
+        if (inOwnLoopThread()
+                && (zerocopy_threshold_ == 0 || message.size() < zerocopy_threshold_))
+        {
+            sendInLoop(message);
+        }
+        else
+        {
+            // message is moved, not copied
+            std::shared_ptr<std::string> payload(
+                    std::make_shared<std::string>(std::move(message)));
+            runInOwnLoop(std::bind(&TcpConnection::sendPayloadInLoop, this, payload));
+        }
+    }
+}
+
+void TcpConnection::sendWithFds(const std::string& message, const std::vector<int>& fds)
+{
+    assert(!message.empty());
+    assert(fds.size() <= static_cast<size_t>(sockets::kMaxFdsPerMessage));
+    if (state_ == kConnected)
+    {
+        runInOwnLoop(std::bind(&TcpConnection::sendWithFdsInLoop, this, message, fds));
+        return;
+    }
+    for (size_t i = 0; i < fds.size(); ++i)
+    {
+        sockets::close(fds[i]);
+    }
+}
+
+void TcpConnection::sendWithFdsInLoop(const std::string& message, const std::vector<int>& fds)
+{
+    loop()->assertInLoopThread();
+    if (state_ == kDisconnected)
+    {
+        LOG(WARNING) << "disconnected, give up writing";
+        for (size_t i = 0; i < fds.size(); ++i)
+        {
+            sockets::close(fds[i]);
         }
+        return;
+    }
+
+    // queued, handleWrite() passes the fds when it gets to the message
+    OutgoingFds entry;
+    entry.offset = output_buffer_.readableBytes();
+    entry.fds = fds;
+    ensureExtras()->outgoing_fds.push_back(entry);
+    size_t old_len = outputBytes();
+    output_buffer_.append(message.data(), message.size());
+    checkHighWaterMark(old_len);
+    if (!channel_.isWriting())
+    {
+        channel_.enableWriting();
     }
 }
 
+// One write of the output buffer. The fds of a message go with its first
+// byte, so a write stops before it, and the message starts a sendmsg(2).
+ssize_t TcpConnection::writeOutputBuffer()
+{
+    Extras* extras = this->extras();
+    if (extras == NULL || extras->outgoing_fds.empty())
+    {
+        ssize_t n = ::write(channel_.fd(), output_buffer_.peek(),
+                            output_buffer_.readableBytes());
+        if (n > 0)
+        {
+            output_buffer_.retrieve(n);
+        }
+        return n;
+    }
+
+    std::list<OutgoingFds>& outgoing_fds = extras->outgoing_fds;
+    ssize_t n = 0;
+    if (outgoing_fds.front().offset > 0)
+    {
+        n = ::write(channel_.fd(), output_buffer_.peek(), outgoing_fds.front().offset);
+    }
+    else
+    {
+        std::list<OutgoingFds>::iterator next = ++outgoing_fds.begin();
+        size_t len = next != outgoing_fds.end()
+            ? next->offset : output_buffer_.readableBytes();
+        std::vector<int>& fds = outgoing_fds.front().fds;
+        n = sockets::sendFds(channel_.fd(), output_buffer_.peek(), len,
+                             fds.data(), static_cast<int>(fds.size()));
+        if (n > 0)
+        {
+            // the peer has its own
+            for (size_t i = 0; i < fds.size(); ++i)
+            {
+                sockets::close(fds[i]);
+            }
+            outgoing_fds.pop_front();
+        }
+    }
+
+    if (n > 0)
+    {
+        output_buffer_.retrieve(n);
+        for (std::list<OutgoingFds>::iterator it = outgoing_fds.begin();
+                it != outgoing_fds.end(); ++it)
+        {
+            it->offset -= static_cast<size_t>(n);
+        }
+    }
+    return n;
+}
+
+std::vector<int> TcpConnection::takeReceivedFds()
+{
+    loop()->assertInLoopThread();
+    std::vector<int> fds;
+    Extras* extras = this->extras();
+    if (extras != NULL)
+    {
+        fds.swap(extras->received_fds);
+    }
+    return fds;
+}
+
+void TcpConnection::sendPayloadInLoop(const std::shared_ptr<std::string>& payload)
+{
+    loop()->assertInLoopThread();
+    // zero copy only when nothing is queued before it, to keep the order
+    if (zerocopy_threshold_ == 0 || payload->size() < zerocopy_threshold_
+            || state_ == kDisconnected || deferred_flush_
+            || channel_.isWriting() || output_buffer_.readableBytes() > 0)
+    {
+        sendInLoop(*payload);
+        return;
+    }
+
+    Extras* extras = ensureExtras();
+    ZeroCopyPayload entry;
+    entry.data = payload;
+    entry.last_id = extras->zerocopy_next_id - 1;
+    size_t old_len = outputBytes();
+    extras->zerocopy_inflight.push_back(entry);
+    extras->zerocopy_offset = 0;
+    zerocopy_writing_ = true;
+
+    if (!writeZeroCopy())
+    {
+        return;
+    }
+    checkHighWaterMark(old_len);
+    if (zerocopy_writing_ || output_buffer_.readableBytes() > 0)
+    {
+        channel_.enableWriting();
+    }
+    else if (callbacks_->write_complete)
+    {
+        loop()->queueInLoop(std::bind(&TcpConnection::writeCompleteInLoop,
+                                      shared_from_this(), callbacks_->write_complete));
+    }
+}
+
+bool TcpConnection::writeZeroCopy()
+{
+    Extras* extras = this->extras();
+    assert(zerocopy_writing_ && !extras->zerocopy_inflight.empty());
+    ZeroCopyPayload& entry = extras->zerocopy_inflight.back();
+    const std::string& data = *entry.data;
+    size_t& offset = extras->zerocopy_offset;
+    while (offset < data.size())
+    {
+        ssize_t n = ::send(channel_.fd(),
+                           data.data() + offset,
+                           data.size() - offset,
+                           MSG_ZEROCOPY);
+        if (n > 0)
+        {
+            entry.last_id = extras->zerocopy_next_id++;
+            offset += n;
+        }
+        else if (n < 0 && errno == EWOULDBLOCK)
+        {
+            // wait for POLLOUT
+            return true;
+        }
+        else if (n < 0 && errno == ENOBUFS)
+        {
+            // out of optmem for pinned pages, copy the rest
+            output_buffer_.append(data.data() + offset, data.size() - offset);
+            if (offset == 0)
+            {
+                // nothing is pinned by kernel
+                extras->zerocopy_inflight.pop_back();
+            }
+            break;
+        }
+        else
+        {
+            // the rest of the message is lost, the stream cannot go on
+            LOG(ERROR) << "TcpConnection::writeZeroCopy";
+            if (offset == 0)
+            {
+                // nothing is pinned, no completion will come
+                extras->zerocopy_inflight.pop_back();
+            }
+            zerocopy_writing_ = false;
+            loop()->queueInLoop(std::bind(&TcpConnection::forceCloseInLoop,
+                                          shared_from_this()));
+            return false;
+        }
+    }
+    zerocopy_writing_ = false;
+    return true;
+}
+
+void TcpConnection::handleZeroCopyCompletions()
+{
+    std::list<ZeroCopyPayload>& inflight = ensureExtras()->zerocopy_inflight;
+    char control[128];
+    for (;;)
+    {
+        struct msghdr msg;
+        bzero(&msg, sizeof msg);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        if (::recvmsg(channel_.fd(), &msg, MSG_ERRQUEUE) < 0)
+        {
+            // error queue is drained
+            break;
+        }
+
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+                cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                    && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+            {
+                continue;
+            }
+
+            const struct sock_extended_err* serr =
+                reinterpret_cast<const struct sock_extended_err*>(CMSG_DATA(cmsg));
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            {
+                continue;
+            }
+
+            if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && zerocopy_threshold_ > 0)
+            {
+                // e.g. loopback, the deferred copy costs more than a plain write
+                LOG(INFO) << "TcpConnection [" << name()
+                    << "] kernel copied zero copy data, fall back to copying";
+                zerocopy_threshold_ = 0;
+            }
+
+            // sends numbered [ee_info, ee_data] are released by kernel
+            uint32_t hi = serr->ee_data;
+            while (!inflight.empty())
+            {
+                const ZeroCopyPayload& front = inflight.front();
+                bool unsent = zerocopy_writing_ && inflight.size() == 1;
+                if (unsent || static_cast<int32_t>(hi - front.last_id) < 0)
+                {
+                    break;
+                }
+                inflight.pop_front();
+            }
+        }
+    }
+}
+
+void TcpConnection::setZeroCopyThreshold(size_t threshold)
+{
+    loop()->assertInLoopThread();
+    if (threshold > 0 && !socket_.setZeroCopy(true))
+    {
+        LOG(WARNING) << "TcpConnection [" << name() << "] SO_ZEROCOPY is not supported";
+        return;
+    }
+    zerocopy_threshold_ = threshold;
+}
+
 void TcpConnection::sendInLoop(const std::string& message)
 {
-    loop_->assertInLoopThread();
+    loop()->assertInLoopThread();
+    if (state_ == kDisconnected)
+    {
+        LOG(WARNING) << "disconnected, give up writing";
+        return;
+    }
+
+    if (deferred_flush_)
+    {
+        size_t old_len = outputBytes();
+        output_buffer_.append(message.data(), message.size());
+        checkHighWaterMark(old_len);
+        // when writing, handleWrite() will drain the output buffer
+        if (!channel_.isWriting() && !flush_scheduled_)
+        {
+            flush_scheduled_ = true;
+            loop()->queueAtIterationEnd(
+                    std::bind(&TcpConnection::flushInLoop, shared_from_this()));
+        }
+        return;
+    }
+
     ssize_t nwrote = 0;
+    bool fault_error = false;
     // if no thing in output queue, try writing directly
-    if (!channel_->isWriting() && output_buffer_.readableBytes() == 0)
+    if (!channel_.isWriting() && output_buffer_.readableBytes() == 0)
     {
-        nwrote = ::write(channel_->fd(), message.data(), message.size());
+        nwrote = ::write(channel_.fd(), message.data(), message.size());
         if (nwrote >= 0)
         {
             if (static_cast<size_t>(nwrote) < message.size())
             {
                 DLOG(INFO) << "I am going to write more data";
             }
+            else if (callbacks_->write_complete)
+            {
+                loop()->queueInLoop(std::bind(&TcpConnection::writeCompleteInLoop,
+                                              shared_from_this(), callbacks_->write_complete));
+            }
         }
         else
         {
@@ -81,17 +512,23 @@ void TcpConnection::sendInLoop(const std::string& message)
             if (errno != EWOULDBLOCK)
             {
                 LOG(ERROR) << "TcpConnection::SendInLoop";
+                if (errno == EPIPE || errno == ECONNRESET)
+                {
+                    fault_error = true;
+                }
             }
         }
     }
 
     assert(nwrote >= 0);
-    if (static_cast<size_t>(nwrote) < message.size())
+    if (!fault_error && static_cast<size_t>(nwrote) < message.size())
     {
+        size_t old_len = outputBytes();
         output_buffer_.append(message.data() + nwrote, message.size() - nwrote);
-        if (!channel_->isWriting())
+        checkHighWaterMark(old_len);
+        if (!channel_.isWriting())
         {
-            channel_->enableWriting();
+            channel_.enableWriting();
         }
     }
 }
@@ -103,47 +540,431 @@ void TcpConnection::shutdown()
     {
         setState(kDisconnecting);
         // FIXME: shared_from_this()?
-        loop_->runInLoop(std::bind(&TcpConnection::shutdownInLoop, this));
+        runInOwnLoop(std::bind(&TcpConnection::shutdownInLoop, this));
     }
 }
 
 void TcpConnection::shutdownInLoop()
 {
-    loop_->assertInLoopThread();
-    if (!channel_->isWriting())
+    loop()->assertInLoopThread();
+    if (!channel_.isWriting() && !flush_scheduled_)
     {
         // we are not writing
-        socket_->shutdownWrite();
+        socket_.shutdownWrite();
+    }
+}
+
+void TcpConnection::flushInLoop()
+{
+    if (!loop()->isInLoopThread())
+    {
+        // queued at the iteration end of the loop we migrated from
+        loop()->runInLoop(std::bind(&TcpConnection::flushInLoop, shared_from_this()));
+        return;
+    }
+    flush_scheduled_ = false;
+    if (state_ == kDisconnected || channel_.isWriting()
+            || output_buffer_.readableBytes() == 0)
+    {
+        return;
+    }
+
+    ssize_t n = writeOutputBuffer();
+    if (n < 0 && errno != EWOULDBLOCK)
+    {
+        LOG(ERROR) << "TcpConnection::flushInLoop";
+        return;
+    }
+
+    if (output_buffer_.readableBytes() > 0)
+    {
+        channel_.enableWriting();
+        return;
+    }
+    releaseGrown(&output_buffer_);
+
+    if (callbacks_->write_complete)
+    {
+        loop()->queueInLoop(std::bind(&TcpConnection::writeCompleteInLoop,
+                                      shared_from_this(), callbacks_->write_complete));
+    }
+    if (state_ == kDisconnecting)
+    {
+        shutdownInLoop();
+    }
+}
+
+void TcpConnection::setTcpNoDelay(bool on)
+{
+    socket_.setTcpNoDelay(on);
+}
+
+void TcpConnection::forceClose()
+{
+    if (state_ == kConnected || state_ == kDisconnecting)
+    {
+        setState(kDisconnecting);
+        queueInOwnLoop(std::bind(&TcpConnection::forceCloseInLoop, shared_from_this()));
+    }
+}
+
+void TcpConnection::forceCloseInLoop()
+{
+    loop()->assertInLoopThread();
+    if (state_ == kConnected || state_ == kDisconnecting)
+    {
+        // as if we received 0 byte in handleRead();
+        handleClose();
+    }
+}
+
+bool TcpConnection::isIdle() const
+{
+    if (state_ != kConnected
+            || input_buffer_.readableBytes() > 0
+            || output_buffer_.readableBytes() > 0
+            || flush_scheduled_
+            || zerocopy_writing_)
+    {
+        return false;
+    }
+    const Extras* extras = this->extras();
+    return extras == NULL
+        || (extras->zerocopy_inflight.empty()
+            && extras->outgoing_fds.empty()
+            && extras->received_fds.empty()
+            && !extras->relay);
+}
+
+void TcpConnection::releaseBuffers()
+{
+    loop()->assertInLoopThread();
+    if (input_buffer_.readableBytes() == 0)
+    {
+        input_buffer_.release();
+    }
+    if (output_buffer_.readableBytes() == 0)
+    {
+        output_buffer_.release();
+    }
+}
+
+int TcpConnection::releaseSocket()
+{
+    loop()->assertInLoopThread();
+    assert(isIdle());
+    // nothing may be read into input_buffer_ before the close
+    stopReadInLoop();
+    int fd = ::fcntl(socket_.fd(), F_DUPFD_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        LOG(ERROR) << "TcpConnection::releaseSocket [" << name() << "] dup";
+    }
+    forceClose();
+    return fd;
+}
+
+void TcpConnection::startRead()
+{
+    runInOwnLoop(std::bind(&TcpConnection::startReadInLoop, shared_from_this()));
+}
+
+void TcpConnection::stopRead()
+{
+    runInOwnLoop(std::bind(&TcpConnection::stopReadInLoop, shared_from_this()));
+}
+
+void TcpConnection::startReadInLoop()
+{
+    loop()->assertInLoopThread();
+    if (state_ == kDisconnected)
+    {
+        return;
+    }
+    if (!reading_ || !channel_.isReading())
+    {
+        channel_.enableReading();
+        reading_ = true;
+    }
+}
+
+void TcpConnection::stopReadInLoop()
+{
+    loop()->assertInLoopThread();
+    if (state_ == kDisconnected)
+    {
+        return;
+    }
+    if (reading_ || channel_.isReading())
+    {
+        channel_.disableReading();
+        reading_ = false;
+    }
+}
+
+void TcpConnection::checkHighWaterMark(size_t old_len)
+{
+    size_t new_len = outputBytes();
+    if (old_len >= high_water_mark_ || new_len < high_water_mark_)
+    {
+        return;
+    }
+
+    if (callbacks_->high_water_mark)
+    {
+        loop()->queueInLoop(std::bind(&TcpConnection::highWaterMarkInLoop, shared_from_this(),
+                                      callbacks_->high_water_mark, new_len));
+    }
+
+    if (high_water_mark_timeout_ > 0.0 && !high_water_mark_timer_armed_)
+    {
+        // the timer must not keep the connection alive
+        std::weak_ptr<TcpConnection> weak_conn(shared_from_this());
+        high_water_mark_timer_armed_ = true;
+        high_water_mark_timer_ = loop()->runAfter(high_water_mark_timeout_,
+                std::bind(&TcpConnection::onHighWaterMarkTimeout, weak_conn));
+    }
+}
+
+void TcpConnection::onHighWaterMarkTimeout(const std::weak_ptr<TcpConnection>& weak_conn)
+{
+    TcpConnectionPtr conn(weak_conn.lock());
+    if (!conn)
+    {
+        return;
+    }
+
+    conn->high_water_mark_timer_armed_ = false;
+    if (conn->outputBytes() >= conn->high_water_mark_)
+    {
+        LOG(WARNING) << "TcpConnection [" << conn->name() << "] stays above high water mark "
+            << conn->high_water_mark_ << " for " << conn->high_water_mark_timeout_
+            << " seconds, force close";
+        conn->forceClose();
+    }
+}
+
+void TcpConnection::writeCompleteInLoop(const WriteCompleteCallback& cb)
+{
+    if (!loop()->isInLoopThread())
+    {
+        // queued by the loop we migrated from
+        loop()->runInLoop(std::bind(&TcpConnection::writeCompleteInLoop,
+                                    shared_from_this(), cb));
+        return;
+    }
+    cb(shared_from_this());
+}
+
+void TcpConnection::highWaterMarkInLoop(const HighWaterMarkCallback& cb, size_t len)
+{
+    if (!loop()->isInLoopThread())
+    {
+        loop()->runInLoop(std::bind(&TcpConnection::highWaterMarkInLoop,
+                                    shared_from_this(), cb, len));
+        return;
+    }
+    cb(shared_from_this(), len);
+}
+
+bool TcpConnection::inOwnLoopThread() const
+{
+    // loop_ is published after migrating_ is set, see leaveLoop()
+    return loop()->isInLoopThread() && !migrating_.load(std::memory_order_relaxed);
+}
+
+void TcpConnection::runInOwnLoop(const Functor& cb)
+{
+    Extras* extras = ensureExtras();
+    std::unique_lock<std::mutex> lock(extras->migrate_mutex);
+    if (migrating_.load(std::memory_order_relaxed))
+    {
+        extras->held_back.push_back(cb);
+        return;
+    }
+    EventLoop* loop = this->loop();
+    if (loop->isInLoopThread())
+    {
+        lock.unlock();
+        cb();
+        return;
+    }
+    // with the lock held, a migration starting later runs it first
+    loop->queueInLoop(cb);
+}
+
+void TcpConnection::queueInOwnLoop(const Functor& cb)
+{
+    Extras* extras = ensureExtras();
+    std::lock_guard<std::mutex> lock(extras->migrate_mutex);
+    if (migrating_.load(std::memory_order_relaxed))
+    {
+        extras->held_back.push_back(cb);
+        return;
+    }
+    loop()->queueInLoop(cb);
+}
+
+void TcpConnection::migrate(EventLoop* target,
+                            const LeaveCallback& leave_cb,
+                            const ArriveCallback& arrive_cb)
+{
+    EventLoop* loop = this->loop();
+    loop->assertInLoopThread();
+    if (target == loop || state_ != kConnected || !movable())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(ensureExtras()->migrate_mutex);
+        if (migrating_.load(std::memory_order_relaxed))
+        {
+            return;
+        }
+        migrating_.store(true, std::memory_order_relaxed);
+    }
+    // functors other threads queued for us so far run in this loop first,
+    // later ones are held back
+    loop->queueInLoop(std::bind(&TcpConnection::leaveLoop, shared_from_this(),
+                                target, leave_cb, arrive_cb));
+}
+
+// Relaying and zero copy sends in flight tie the connection to its loop.
+bool TcpConnection::movable() const
+{
+    const Extras* extras = this->extras();
+    return !zerocopy_writing_
+        && (extras == NULL || (!extras->relay && extras->zerocopy_inflight.empty()));
+}
+
+void TcpConnection::leaveLoop(EventLoop* target,
+                              const LeaveCallback& leave_cb,
+                              const ArriveCallback& arrive_cb)
+{
+    EventLoop* loop = this->loop();
+    loop->assertInLoopThread();
+    // closed or started something that cannot move meanwhile
+    if (state_ != kConnected || !movable() || (leave_cb && !leave_cb(shared_from_this())))
+    {
+        releaseHeldBack();
+        return;
+    }
+
+    bool writing = channel_.isWriting();
+    channel_.disableAll();
+    loop->removeChannel(&channel_);
+    if (high_water_mark_timer_armed_)
+    {
+        // armed again in target
+        loop->cancel(high_water_mark_timer_);
+    }
+    loop->addConnectionsNum(-1);
+    target->addConnectionsNum(1);
+    channel_.setLoop(target);
+    {
+        std::lock_guard<std::mutex> lock(extras()->migrate_mutex);
+        loop_.store(target, std::memory_order_release);
+    }
+    target->queueInLoop(std::bind(&TcpConnection::arriveInLoop, shared_from_this(),
+                                  arrive_cb, writing));
+}
+
+void TcpConnection::arriveInLoop(const ArriveCallback& arrive_cb, bool writing)
+{
+    EventLoop* loop = this->loop();
+    loop->assertInLoopThread();
+    if (arrive_cb)
+    {
+        arrive_cb(shared_from_this());
+    }
+    // registers the channel with the poller
+    channel_.disableAll();
+    if (reading_)
+    {
+        channel_.enableReading();
+    }
+    if (writing)
+    {
+        channel_.enableWriting();
+    }
+    if (high_water_mark_timer_armed_)
+    {
+        std::weak_ptr<TcpConnection> weak_conn(shared_from_this());
+        high_water_mark_timer_ = loop->runAfter(high_water_mark_timeout_,
+                std::bind(&TcpConnection::onHighWaterMarkTimeout, weak_conn));
+    }
+    releaseHeldBack();
+}
+
+void TcpConnection::releaseHeldBack()
+{
+    Extras* extras = this->extras();
+    std::vector<Functor> held_back;
+    {
+        std::lock_guard<std::mutex> lock(extras->migrate_mutex);
+        migrating_.store(false, std::memory_order_relaxed);
+        held_back.swap(extras->held_back);
+    }
+    // in the order of the calls
+    for (size_t i = 0; i < held_back.size(); ++i)
+    {
+        held_back[i]();
     }
 }
 
 void TcpConnection::connectEstablished()
 {
-    loop_->assertInLoopThread();
+    loop()->assertInLoopThread();
     assert(state_ == kConnecting);
     setState(kConnected);
-    channel_->enableReading();
-    connection_callback_(shared_from_this());
+    channel_.enableReading();
+    callbacks_->connection(shared_from_this());
 }
 
 void TcpConnection::connectDestroyed()
 {
-    loop_->assertInLoopThread();
-    assert(state_ == kConnected || state_ == kDisconnecting);
-    setState(kDisconnected);
-    channel_->disableAll();
-    connection_callback_(shared_from_this());
+    if (!loop()->isInLoopThread())
+    {
+        // queued by the loop we migrated from
+        loop()->runInLoop(std::bind(&TcpConnection::connectDestroyed, shared_from_this()));
+        return;
+    }
+    if (state_ == kConnected)
+    {
+        setState(kDisconnected);
+        channel_.disableAll();
+        callbacks_->connection(shared_from_this());
+    }
+    if (high_water_mark_timer_armed_)
+    {
+        high_water_mark_timer_armed_ = false;
+        loop()->cancel(high_water_mark_timer_);
+    }
 
-    loop_->removeChannel(channel_.get());
+    loop()->removeChannel(&channel_);
+    loop()->addConnectionsNum(-1);
 }
 
 void TcpConnection::handleRead(Timestamp receive_time)
 {
+    Extras* extras = this->extras();
+    if (extras != NULL && extras->relay)
+    {
+        extras->relay->handleRead(this);
+        return;
+    }
+
     int saved_errno = 0;
-    ssize_t n = input_buffer_.readFd(channel_->fd(), &saved_errno);
+    ssize_t n = fd_passing_ ? readWithFds(&saved_errno)
+                            : input_buffer_.readFd(channel_.fd(), &saved_errno);
     if (n > 0)
     {
-        message_callback_(shared_from_this(), &input_buffer_, receive_time);
+        bytes_received_ += static_cast<uint64_t>(n);
+        callbacks_->message(shared_from_this(), &input_buffer_, receive_time);
+        if (input_buffer_.readableBytes() == 0)
+        {
+            releaseGrown(&input_buffer_);
+        }
     }
     else if (n == 0)
     {
@@ -157,37 +978,111 @@ void TcpConnection::handleRead(Timestamp receive_time)
     }
 }
 
+// recvmsg(2) for the fds, into the input buffer and, like Buffer::readFd(),
+// a stack buffer for the rest, the input buffer is not grown up front.
+// A unix domain socket ends a read before bytes sent with fds, they start
+// the next one.
+ssize_t TcpConnection::readWithFds(int* saved_errno)
+{
+    char extrabuf[kFdPassingReadSize];
+    struct iovec vec[2];
+    const size_t writable = input_buffer_.writableBytes();
+    vec[0].iov_base = input_buffer_.beginWrite();
+    vec[0].iov_len = writable;
+    vec[1].iov_base = extrabuf;
+    vec[1].iov_len = sizeof extrabuf;
+    int fds[sockets::kMaxFdsPerMessage];
+    int fds_num = 0;
+    ssize_t n = sockets::recvFds(channel_.fd(), vec, 2,
+                                 fds, sockets::kMaxFdsPerMessage, &fds_num);
+    if (n < 0)
+    {
+        *saved_errno = errno;
+        return n;
+    }
+    if (static_cast<size_t>(n) <= writable)
+    {
+        input_buffer_.hasWritten(static_cast<size_t>(n));
+    }
+    else
+    {
+        input_buffer_.hasWritten(writable);
+        input_buffer_.append(extrabuf, static_cast<size_t>(n) - writable);
+    }
+    if (fds_num > 0)
+    {
+        std::vector<int>& received_fds = ensureExtras()->received_fds;
+        received_fds.insert(received_fds.end(), fds, fds + fds_num);
+    }
+    return n;
+}
+
 void TcpConnection::handleWrite()
 {
-    loop_->assertInLoopThread();
-    if (channel_->isWriting())
+    loop()->assertInLoopThread();
+    Extras* extras = this->extras();
+    if (extras != NULL && extras->relay
+            && output_buffer_.readableBytes() == 0 && !zerocopy_writing_)
     {
-        ssize_t n = ::write(channel_->fd(),
-                            output_buffer_.peek(),
-                            output_buffer_.readableBytes());
-        if (n > 0)
+        extras->relay->handleWrite(this);
+        return;
+    }
+
+    if (channel_.isWriting())
+    {
+        // zero copy payload is queued before the output buffer
+        if (zerocopy_writing_)
         {
-            output_buffer_.retrieve(n);
-            //数据写完了就关闭连接
-            //如果想要长连接呢？
-            if (output_buffer_.readableBytes() == 0)
-            {
-                channel_->disableWriting();
-                //ShutdownInLoop()会判断当前连接是否还有未写数据
-                //写完了之后才会关闭连接
-                if (state_ == kDisconnecting)
+            if (!writeZeroCopy() || zerocopy_writing_)
+            {
+                return;
+            }
+        }
+
+        if (output_buffer_.readableBytes() > 0)
+        {
+            ssize_t n = writeOutputBuffer();
+            if (n > 0)
+            {
+                if (high_water_mark_timer_armed_
+                        && outputBytes() < high_water_mark_)
                 {
-                    shutdownInLoop();
+                    high_water_mark_timer_armed_ = false;
+                    loop()->cancel(high_water_mark_timer_);
                 }
             }
             else
             {
-                DLOG(INFO) << "I am going to write more data";
+                LOG(ERROR) << "TcpConnection::handleWrite";
+            }
+        }
+
+        //数据写完了就关闭连接
+        //如果想要长连接呢？
+        if (output_buffer_.readableBytes() == 0)
+        {
+            releaseGrown(&output_buffer_);
+            channel_.disableWriting();
+            if (extras != NULL && extras->relay)
+            {
+                // spliced data may wait behind the output buffer
+                extras->relay->handleWrite(this);
+            }
+            if (callbacks_->write_complete)
+            {
+                loop()->queueInLoop(std::bind(&TcpConnection::writeCompleteInLoop,
+                                              shared_from_this(), callbacks_->write_complete));
+            }
+            //ShutdownInLoop()会判断当前连接是否还有未写数据
+            //写完了之后才会关闭连接
+            if (state_ == kDisconnecting)
+            {
+                shutdownInLoop();
             }
         }
         else
         {
-            LOG(ERROR) << "TcpConnection::handleWrite";
+            DLOG(INFO) << "I am going to write more data";
         }
     }
     else
@@ -198,19 +1093,44 @@ void TcpConnection::handleWrite()
 
 void TcpConnection::handleClose()
 {
-    loop_->assertInLoopThread();
+    loop()->assertInLoopThread();
     DLOG(INFO) << "TcpConnection::handleClose state = " << state_;
     assert(state_ == kConnected || state_ == kDisconnecting);
     // we don't close fd, leave it to dtor, so we can find leaks easily.
-    channel_->disableAll();
+    setState(kDisconnected);
+    channel_.disableAll();
+
+    Extras* extras = this->extras();
+    if (extras != NULL && extras->relay)
+    {
+        std::shared_ptr<TcpRelay> relay;
+        relay.swap(extras->relay);
+        relay->handleClose(this);
+    }
+
+    TcpConnectionPtr guard_this(shared_from_this());
+    callbacks_->connection(guard_this);
     // must be the last line
-    close_callback_(shared_from_this());
+    close_callback_(guard_this);
 }
 
 void TcpConnection::handleError()
 {
-    int err = sockets::getSocketError(channel_->fd());
-    LOG(ERROR) << "TcpConnection::handleError [" << name_
+    // MSG_ZEROCOPY completions are reported as POLLERR
+    const Extras* extras = this->extras();
+    bool zerocopy = zerocopy_threshold_ > 0
+        || (extras != NULL && !extras->zerocopy_inflight.empty());
+    if (zerocopy)
+    {
+        handleZeroCopyCompletions();
+    }
+
+    int err = sockets::getSocketError(channel_.fd());
+    if (zerocopy && err == 0)
+    {
+        return;
+    }
+    LOG(ERROR) << "TcpConnection::handleError [" << name()
         << "] - SO_ERROR = " << err << " " << strerror(err);
 }
 
@@ -3,18 +3,39 @@
 
 #include "buffer.h"
 #include "callbacks.h"
+#include "channel.h"
+#include "event_loop_fwd.h"
 #include "inet_address.h"
+#include "socket.h"
+#include "timer_id.h"
 
+#include <atomic>
+#include <functional>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 namespace mouse
 {
 
-class Channel;
-class EventLoop;
-class Socket;
+class TcpRelay;
 
+///
+/// An idle connection, nothing buffered, costs the make_shared allocation
+/// of TcpConnection with its Socket, Channel and empty Buffers, plus a
+/// pollfd and a map node in Poller and a slot in the TcpServer slab.
+/// tests/scale_test measures about 480 bytes of RSS per idle connection
+/// on x86-64, 320 of them sizeof(TcpConnection): 64 for the Buffers, 48
+/// for the Channel, 32 each for the peer address and the close callback,
+/// 16 for the user callbacks, which the connections of a TcpServer share.
+/// Relaying, zero copy, fd passing and migration state is allocated on
+/// first use. Buffers get storage when bytes arrive or are queued. Once
+/// drained they keep the initial size for the next message and free
+/// anything larger, releaseBuffers() frees the rest, TcpServer calls it
+/// periodically.
+///
 class TcpConnection : public std::enable_shared_from_this<TcpConnection>
 {
     //nocopyable
@@ -22,33 +43,158 @@ class TcpConnection : public std::enable_shared_from_this<TcpConnection>
     TcpConnection& operator=(const TcpConnection&) = delete;
 
 public:
+    /// @c id identifies the connection, unique within its TcpServer.
     TcpConnection(EventLoop* loop,
-                  const std::string& name,
+                  uint64_t id,
                   int sockfd,
-                  const InetAddress& local_address,
                   const InetAddress& peer_address);
     ~TcpConnection();
 
-    EventLoop* loop() const { return loop_; }
-    const std::string& name() const { return name_; }
-    const InetAddress& localAddress() { return local_address_; }
-    const InetAddress& peerAddress() { return peer_address_; }
+    /// Changes when the connection migrates, see migrate().
+    EventLoop* loop() const { return loop_.load(std::memory_order_acquire); }
+    uint64_t id() const { return id_; }
+    /// "peer ip:port#id", formatted on every call, for logging.
+    std::string name() const;
+    /// Queried from the socket on every call.
+    InetAddress localAddress() const;
+    const InetAddress& peerAddress() const { return peer_address_; }
     bool connected() const { return state_ == kConnected; }
 
     //void send(const void* message, size_t len);
     // Thread safe.
     void send(const std::string& message);
+    // Thread safe. Messages above the zero copy threshold are sent with
+    // MSG_ZEROCOPY, the string is kept until the kernel releases it.
+    void send(std::string&& message);
+    /// Unix domain connections only: sends @c message, not empty, with
+    /// @c fds attached to its first byte (SCM_RIGHTS), in order with the
+    /// other sends. Takes the ownership of the fds, they are closed once
+    /// passed, or with the connection. At most sockets::kMaxFdsPerMessage.
+    /// Thread safe.
+    void sendWithFds(const std::string& message, const std::vector<int>& fds);
     // Thread safe.
     void shutdown();
+    // Thread safe.
+    void forceClose();
+
+    /// Resumes/suspends reading from the socket, the peer is throttled
+    /// by TCP flow control while reading is stopped.
+    /// Thread safe.
+    void startRead();
+    void stopRead();
+    bool isReading() const { return reading_; }
+
+    /// Coalesces sends of one loop iteration, the output is flushed once
+    /// per connection after pending functors are done.
+    /// Must be called in the loop thread.
+    void setDeferredFlush(bool on) { deferred_flush_ = on; }
+    void setTcpNoDelay(bool on);
+    /// Bulk transfers can be made low priority, so they do not delay
+    /// the other connections of the loop, see
+    /// EventLoop::setLowPriorityBudget().
+    /// Must be called in the loop thread.
+    void setPriority(Channel::Priority priority) { channel_.setPriority(priority); }
+
+    /// Sends messages of at least @c threshold bytes passed by rvalue
+    /// with MSG_ZEROCOPY, smaller ones are copied as usual. 0 disables.
+    /// Must be called in the loop thread.
+    void setZeroCopyThreshold(size_t threshold);
+
+    /// The user callbacks, immutable once shared, e.g. by all the
+    /// connections of a TcpServer.
+    struct Callbacks
+    {
+        ConnectionCallback connection;
+        MessageCallback message;
+        WriteCompleteCallback write_complete;
+        HighWaterMarkCallback high_water_mark;
+    };
+
+    void setCallbacks(const std::shared_ptr<const Callbacks>& callbacks)
+    { callbacks_ = callbacks; }
+
+    /// The setters below copy the shared callbacks for this connection.
+    void setConnectionCallback(const ConnectionCallback& cb);
+
+    void setMessageCallback(const MessageCallback& cb);
+
+    void setWriteCompleteCallback(const WriteCompleteCallback& cb);
+
+    /// Called once when the output buffer grows past @c high_water_mark.
+    void setHighWaterMarkCallback(const HighWaterMarkCallback& cb,
+                                  size_t high_water_mark);
+    /// 64 MiB by default.
+    void setHighWaterMark(size_t high_water_mark)
+    { high_water_mark_ = high_water_mark; }
+
+    /// Force close the connection if the output buffer stays above
+    /// the high water mark for more than @c seconds, 0 disables.
+    void setHighWaterMarkTimeout(double seconds)
+    { high_water_mark_timeout_ = seconds; }
+
+    /// Bytes queued and not written yet, the output buffer and the unsent
+    /// rest of a zero copy message, the high water mark applies to them.
+    size_t outputBytes() const
+    {
+        if (!zerocopy_writing_)
+        {
+            return output_buffer_.readableBytes();
+        }
+        const Extras* extras = this->extras();
+        return output_buffer_.readableBytes()
+            + extras->zerocopy_inflight.back().data->size() - extras->zerocopy_offset;
+    }
+    /// Bytes read and not retrieved yet, for readers outside the message
+    /// callback. Must be called in the loop thread.
+    Buffer* inputBuffer() { return &input_buffer_; }
 
-    void setConnectionCallback(const ConnectionCallback& cb)
-    { connection_callback_ = cb; }
+    /// Connected with nothing buffered or in flight in either direction,
+    /// the socket could be handed to another process as it is.
+    /// Must be called in the loop thread.
+    bool isIdle() const;
 
-    void setMessageCallback(const MessageCallback& cb)
-    { message_callback_ = cb; }
+    /// Frees the storage of empty buffers, they get it again when bytes
+    /// arrive or are queued.
+    /// Must be called in the loop thread.
+    void releaseBuffers();
 
-    void setWriteCompleteCallback(const WriteCompleteCallback& cb)
-    { write_complete_callback_ = cb; }
+    /// Unix domain connections only: accepts fds passed by the peer, see
+    /// takeReceivedFds(). Off by default, the kernel closes them then.
+    /// Must be called in the loop thread.
+    void setFdPassing(bool on) { fd_passing_ = on; }
+    /// Fds received with the bytes read so far, e.g. in the message
+    /// callback. They arrive with the first byte of the message they were
+    /// sent with. The caller owns them, the ones never taken are closed
+    /// with the connection.
+    /// Must be called in the loop thread.
+    std::vector<int> takeReceivedFds();
+
+    /// Bytes read from the socket so far.
+    /// Must be called in the loop thread.
+    uint64_t bytesReceived() const { return bytes_received_; }
+
+    /// Returns false to cancel the migration.
+    typedef std::function<bool (const TcpConnectionPtr&)> LeaveCallback;
+    typedef std::function<void (const TcpConnectionPtr&)> ArriveCallback;
+
+    /// Moves the connection with its socket, buffers and callbacks to
+    /// @c target, e.g. off a hot loop. Calls from other threads meanwhile
+    /// are held back and run in @c target afterwards, in order, and data
+    /// arriving meanwhile waits in the socket. @c leave_cb runs in the old
+    /// loop when the connection leaves it, @c arrive_cb in @c target before
+    /// the connection is served there. Nothing happens if the connection
+    /// closes first or is relaying or has zero copy sends in flight.
+    /// TcpServer connections move with TcpServer::migrateConnection().
+    /// Must be called in the loop thread.
+    void migrate(EventLoop* target,
+                 const LeaveCallback& leave_cb,
+                 const ArriveCallback& arrive_cb);
+
+    /// Hands the socket over to another owner, e.g. a successor process:
+    /// returns a close-on-exec duplicate of an idle socket and force closes
+    /// this connection, the TCP connection stays open through the duplicate.
+    /// Must be called in the loop thread.
+    int releaseSocket();
 
     /// Internal use only.
     void setCloseCallback(const CloseCallback& cb)
@@ -62,7 +208,11 @@ public:
   void connectDestroyed();  // should be called only once
 
 private:
+    friend class Channel;
+    friend class TcpRelay;
+
     enum StateE { kConnecting, kConnected, kDisconnecting, kDisconnected };
+    typedef std::function<void()> Functor;
 
     void setState(StateE s) { state_ = s; }
     void handleRead(Timestamp receive_time);
@@ -70,24 +220,102 @@ private:
     void handleClose();
     void handleError();
     void sendInLoop(const std::string& message);
+    void sendPayloadInLoop(const std::shared_ptr<std::string>& payload);
+    void sendWithFdsInLoop(const std::string& message, const std::vector<int>& fds);
+    ssize_t writeOutputBuffer();
+    ssize_t readWithFds(int* saved_errno);
+    // false on an error, the connection is closed then
+    bool writeZeroCopy();
+    void handleZeroCopyCompletions();
     void shutdownInLoop();
+    void forceCloseInLoop();
+    void flushInLoop();
+    void startReadInLoop();
+    void stopReadInLoop();
+    void checkHighWaterMark(size_t old_len);
+    // user callbacks queued by the loop, they follow a migration
+    void writeCompleteInLoop(const WriteCompleteCallback& cb);
+    void highWaterMarkInLoop(const HighWaterMarkCallback& cb, size_t len);
+    // from other threads, held back while migrating
+    void runInOwnLoop(const Functor& cb);
+    void queueInOwnLoop(const Functor& cb);
+    bool inOwnLoopThread() const;
+    bool movable() const;
+    void leaveLoop(EventLoop* target, const LeaveCallback& leave_cb,
+                   const ArriveCallback& arrive_cb);
+    void arriveInLoop(const ArriveCallback& arrive_cb, bool writing);
+    void releaseHeldBack();
+    Callbacks* copyCallbacks();
+    static void onHighWaterMarkTimeout(const std::weak_ptr<TcpConnection>& weak_conn);
 
-    EventLoop* loop_;
-    std::string name_;
+    std::atomic<EventLoop*> loop_;
+    const uint64_t id_;
     StateE state_;
-    // we don't expose those classes to client.
-    std::unique_ptr<Socket> socket_;
-    std::unique_ptr<Channel> channel_;
-    InetAddress local_address_;
+    bool reading_;
+    bool deferred_flush_;
+    bool flush_scheduled_;
+    // allocated along with the connection
+    Socket socket_;
+    Channel channel_;
     InetAddress peer_address_;
 
-    ConnectionCallback connection_callback_;
-    MessageCallback message_callback_;
-    WriteCompleteCallback write_complete_callback_;
+    // never null
+    std::shared_ptr<const Callbacks> callbacks_;
+    // bound to the slot of the connection in TcpServer, not shared
     CloseCallback close_callback_;
+    size_t high_water_mark_;
+    double high_water_mark_timeout_;
+    bool high_water_mark_timer_armed_;
+    TimerId high_water_mark_timer_;
 
     Buffer input_buffer_;
     Buffer output_buffer_;
+
+    struct ZeroCopyPayload
+    {
+        std::shared_ptr<std::string> data;
+        uint32_t last_id; // notification id of the last send of data
+    };
+
+    struct OutgoingFds
+    {
+        size_t offset;  // of the byte they go with in output_buffer_
+        std::vector<int> fds;
+    };
+
+    // What relaying, zero copy, fd passing and migration need, allocated
+    // by ensureExtras() on first use, an idle connection goes without.
+    struct Extras
+    {
+        Extras() : zerocopy_next_id(0), zerocopy_offset(0) {}
+
+        // not null while relaying with splice(2)
+        std::shared_ptr<TcpRelay> relay;
+        // kernel numbers every successful MSG_ZEROCOPY send from 0
+        uint32_t zerocopy_next_id;
+        // payload pending in the kernel, the front one was sent earliest
+        std::list<ZeroCopyPayload> zerocopy_inflight;
+        // the back payload of zerocopy_inflight is sent up to here
+        size_t zerocopy_offset;
+        // in the order of their bytes
+        std::list<OutgoingFds> outgoing_fds;
+        std::vector<int> received_fds;
+        std::mutex migrate_mutex;
+        std::vector<Functor> held_back; // @GuardedBy migrate_mutex
+    };
+
+    // Any thread, runInOwnLoop() takes the migration mutex.
+    Extras* ensureExtras();
+    // null until ensureExtras()
+    Extras* extras() const { return extras_.load(std::memory_order_acquire); }
+
+    size_t zerocopy_threshold_;
+    bool zerocopy_writing_;
+    bool fd_passing_;
+    uint64_t bytes_received_;
+    std::atomic<bool> migrating_;   // written with the migration mutex held
+    // owned, freed with the connection only, other threads may hold it
+    std::atomic<Extras*> extras_;
 };
 
 typedef std::shared_ptr<TcpConnection> TcpConnectionPtr;
@@ -0,0 +1,252 @@
+#include "tcp_relay.h"
+
+#include "channel.h"
+#include "event_loop.h"
+#include "socket.h"
+#include "sockets_ops.h"
+#include "tcp_connection.h"
+
+#include <glog/logging.h>
+
+#include <functional>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace mouse;
+
+namespace
+{
+
+const int kPipeSize = 1024 * 1024;
+// splices per event of one direction, then let other channels run
+const int kMaxRounds = 16;
+
+}//namespace
+
+TcpRelay::TcpRelay(const TcpConnectionPtr& first, const TcpConnectionPtr& second)
+    : loop_(first->loop()),
+      pipe_capacity_(0)
+{
+    assert(first->loop() == second->loop());
+    ends_[0] = first;
+    ends_[1] = second;
+
+    for (int i = 0; i < 2; ++i)
+    {
+        int fds[2];
+        if (::pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0)
+        {
+            LOG(FATAL) << "TcpRelay::TcpRelay pipe2";
+        }
+        // best effort, the default pipe holds 64KiB
+        ::fcntl(fds[1], F_SETPIPE_SZ, kPipeSize);
+        int size = ::fcntl(fds[1], F_GETPIPE_SZ);
+        pipe_capacity_ = static_cast<size_t>(size > 0 ? size : 65536);
+
+        Direction& d = directions_[i];
+        d.pipe_read = fds[0];
+        d.pipe_write = fds[1];
+        d.buffered = 0;
+        d.queued = 0;
+        d.bytes = 0;
+        d.eof = false;
+        d.shutdown = false;
+    }
+}
+
+TcpRelay::~TcpRelay()
+{
+    for (int i = 0; i < 2; ++i)
+    {
+        sockets::close(directions_[i].pipe_read);
+        sockets::close(directions_[i].pipe_write);
+    }
+}
+
+void TcpRelay::start()
+{
+    loop_->runInLoop(std::bind(&TcpRelay::startInLoop, shared_from_this()));
+}
+
+void TcpRelay::startInLoop()
+{
+    loop_->assertInLoopThread();
+    TcpConnectionPtr first(ends_[0].lock());
+    TcpConnectionPtr second(ends_[1].lock());
+    if (!first || !second || !first->connected() || !second->connected())
+    {
+        LOG(WARNING) << "TcpRelay::startInLoop - connection is down";
+        closeAll();
+        return;
+    }
+
+    TcpConnectionPtr conns[2] = { first, second };
+    for (int i = 0; i < 2; ++i)
+    {
+        TcpConnection::Extras* extras = conns[i]->ensureExtras();
+        assert(!extras->relay);
+        extras->relay = shared_from_this();
+        // what has been read goes first
+        Buffer* input = &conns[i]->input_buffer_;
+        if (input->readableBytes() > 0)
+        {
+            // counted once written, see pump()
+            directions_[i].queued += input->readableBytes();
+            conns[1 - i]->sendInLoop(input->retrieveAsString());
+        }
+        conns[i]->startReadInLoop();
+    }
+
+    pump(0);
+    pump(1);
+}
+
+void TcpRelay::pump(int direction)
+{
+    Direction& d = directions_[direction];
+    TcpConnectionPtr from(ends_[direction].lock());
+    TcpConnectionPtr to(ends_[1 - direction].lock());
+    if (!from || !to || from->extras() == NULL || from->extras()->relay.get() != this)
+    {
+        return;
+    }
+    const int from_fd = from->channel_.fd();
+    const int to_fd = to->channel_.fd();
+    if (d.queued > 0 && outputDrained(to.get()))
+    {
+        d.bytes += static_cast<int64_t>(d.queued);
+        d.queued = 0;
+    }
+
+    bool progress = true;
+    for (int round = 0; progress && round < kMaxRounds; ++round)
+    {
+        progress = false;
+        if (!d.eof && d.buffered < pipe_capacity_)
+        {
+            ssize_t n = ::splice(from_fd, NULL, d.pipe_write, NULL,
+                                 pipe_capacity_ - d.buffered,
+                                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0)
+            {
+                d.buffered += n;
+                progress = true;
+            }
+            else if (n == 0)
+            {
+                d.eof = true;
+            }
+            else if (errno != EAGAIN)
+            {
+                LOG(ERROR) << "TcpRelay::pump splice from socket";
+                closeAll();
+                return;
+            }
+        }
+
+        // the splice into 'to' must follow data queued in its output buffer
+        if (d.buffered > 0 && outputDrained(to.get()))
+        {
+            ssize_t n = ::splice(d.pipe_read, NULL, to_fd, NULL, d.buffered,
+                                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0)
+            {
+                d.buffered -= n;
+                d.bytes += n;
+                progress = true;
+            }
+            else if (n < 0 && errno != EAGAIN)
+            {
+                LOG(ERROR) << "TcpRelay::pump splice to socket";
+                closeAll();
+                return;
+            }
+        }
+    }
+
+    // 'to' is not writable, wait for its POLLOUT
+    if (d.buffered > 0 && !to->channel_.isWriting())
+    {
+        to->channel_.enableWriting();
+    }
+    else if (d.buffered == 0 && to->channel_.isWriting() && outputDrained(to.get()))
+    {
+        to->channel_.disableWriting();
+    }
+
+    // backpressure, stop reading while pipe is full
+    if (d.eof || d.buffered >= pipe_capacity_)
+    {
+        from->stopReadInLoop();
+    }
+    else
+    {
+        from->startReadInLoop();
+    }
+
+    if (d.eof && d.buffered == 0 && !d.shutdown && outputDrained(to.get()))
+    {
+        DLOG(INFO) << "TcpRelay::pump half close " << to->name()
+            << " after " << d.bytes << " bytes";
+        to->socket_.shutdownWrite();
+        d.shutdown = true;
+    }
+
+    if (directions_[0].shutdown && directions_[1].shutdown)
+    {
+        closeAll();
+    }
+}
+
+bool TcpRelay::outputDrained(const TcpConnection* conn)
+{
+    return conn->output_buffer_.readableBytes() == 0 && !conn->zerocopy_writing_;
+}
+
+void TcpRelay::closeAll()
+{
+    for (int i = 0; i < 2; ++i)
+    {
+        TcpConnectionPtr conn(ends_[i].lock());
+        if (conn)
+        {
+            conn->forceClose();
+        }
+    }
+}
+
+void TcpRelay::handleRead(TcpConnection* conn)
+{
+    pump(conn == ends_[0].lock().get() ? 0 : 1);
+}
+
+void TcpRelay::handleWrite(TcpConnection* conn)
+{
+    // conn is the destination
+    pump(conn == ends_[0].lock().get() ? 1 : 0);
+}
+
+void TcpRelay::handleClose(TcpConnection* conn)
+{
+    loop_->assertInLoopThread();
+    // keep alive until we return
+    TcpRelayPtr guard_this(shared_from_this());
+    for (int i = 0; i < 2; ++i)
+    {
+        TcpConnectionPtr end(ends_[i].lock());
+        if (end)
+        {
+            if (end->extras() != NULL)
+            {
+                end->extras()->relay.reset();
+            }
+            if (end.get() != conn)
+            {
+                end->forceClose();
+            }
+        }
+    }
+}
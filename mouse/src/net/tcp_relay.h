@@ -0,0 +1,76 @@
+#ifndef MOUSE_NET_TCP_RELAY_H
+#define MOUSE_NET_TCP_RELAY_H
+
+#include "callbacks.h"
+#include "event_loop_fwd.h"
+
+#include <memory>
+
+namespace mouse
+{
+
+///
+/// Joins two connections of the same loop, bytes are moved between
+/// the sockets with splice(2) through a pipe per direction, so the payload
+/// never enters user space.
+///
+/// A direction stops reading while its pipe is full and the other side is
+/// not writable. EOF of one side is forwarded as shutdown(SHUT_WR) to the
+/// other, both connections are closed when both directions are done.
+///
+class TcpRelay : public std::enable_shared_from_this<TcpRelay>
+{
+    //nocopyable
+    TcpRelay(const TcpRelay&) = delete;
+    TcpRelay& operator=(const TcpRelay&) = delete;
+
+public:
+    TcpRelay(const TcpConnectionPtr& first, const TcpConnectionPtr& second);
+    ~TcpRelay();
+
+    /// Message callbacks of both connections are not called any more,
+    /// the data left in their input buffers is forwarded first.
+    /// Thread safe.
+    void start();
+
+    /// Bytes delivered to the other side so far.
+    /// Must be called in the loop thread.
+    int64_t bytesFirstToSecond() const { return directions_[0].bytes; }
+    int64_t bytesSecondToFirst() const { return directions_[1].bytes; }
+
+private:
+    friend class TcpConnection;
+
+    struct Direction
+    {
+        int pipe_read;
+        int pipe_write;
+        size_t buffered; // bytes in pipe
+        size_t queued;   // read before the start, in the output buffer of 'to'
+        int64_t bytes;
+        bool eof;
+        bool shutdown;
+    };
+
+    void startInLoop();
+    void pump(int direction);
+    void closeAll();
+    static bool outputDrained(const TcpConnection* conn);
+
+    // called by TcpConnection
+    void handleRead(TcpConnection* conn);
+    void handleWrite(TcpConnection* conn);
+    void handleClose(TcpConnection* conn);
+
+    EventLoop* loop_;
+    // ends_[0] -> ends_[1] is directions_[0]
+    std::weak_ptr<TcpConnection> ends_[2];
+    Direction directions_[2];
+    size_t pipe_capacity_;
+};
+
+typedef std::shared_ptr<TcpRelay> TcpRelayPtr;
+
+}//namespace mouse
+
+#endif
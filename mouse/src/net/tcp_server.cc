@@ -7,28 +7,167 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <functional>
+#include <thread>
 using namespace std::placeholders;
-#include <stdio.h>
 #include <assert.h>
 
 
 using namespace mouse;
 
-TcpServer::TcpServer(EventLoop* loop, const InetAddress& listen_addr)
+namespace
+{
+
+InetAddress localAddress(int sockfd)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sockets::getLocalAddr(sockfd, &addr);
+    return InetAddress(addr, addrlen);
+}
+
+// a retiring loop retries the connections that cannot move yet this often
+const double kDrainRetrySeconds = 0.05;
+// and force closes the ones left after this long, e.g. stuck relays
+const double kDrainTimeoutSeconds = 10.0;
+
+}//namespace
+
+TcpServer::TcpServer(EventLoop* loop,
+                     const InetAddress& listen_addr,
+                     Option option)
+    : TcpServer(loop, listen_addr, std::vector<int>(), option)
+{
+}
+
+TcpServer::TcpServer(EventLoop* loop,
+                     const std::vector<int>& listen_fds,
+                     Option option)
+    : TcpServer(loop, localAddress(listen_fds.at(0)),
+                listen_fds, option)
+{
+}
+
+TcpServer::TcpServer(EventLoop* loop,
+                     const InetAddress& listen_addr,
+                     const std::vector<int>& listen_fds,
+                     Option option)
     : loop_(CHECK_NOTNULL(loop)),
+      listen_addr_(listen_addr),
       name_(listen_addr.toIpPort()),
-      acceptor_(new Acceptor(loop, listen_addr)),
+      reuseport_(option == kReusePort),
       thread_pool_(new EventLoopThreadPool(loop)),
+      callbacks_(std::make_shared<TcpConnection::Callbacks>()),
+      high_water_mark_(64*1024*1024),
+      high_water_mark_timeout_(0.0),
       started_(false),
-      next_conn_id_(1)
+      max_accepts_per_event_(0),
+      next_conn_id_(1),
+      rebalance_interval_(0.0),
+      rebalance_busy_ratio_gap_(0.0),
+      migrations_(0),
+      migrations_in_flight_(0),
+      buffer_release_interval_(10.0),
+      autoscale_min_threads_(0),
+      autoscale_max_threads_(0),
+      autoscale_interval_(0.0),
+      autoscale_grow_busy_ratio_(0.0),
+      autoscale_shrink_busy_ratio_(0.0),
+      retiring_loops_(0),
+      max_connections_(0),
+      accept_rate_(0.0),
+      accept_burst_(0.0),
+      overload_busy_ratio_(0.0),
+      overload_queue_size_(0),
+      connections_num_(0),
+      admitted_(0),
+      rejected_max_connections_(0),
+      rejected_rate_limited_(0),
+      rejected_overloaded_(0)
 {
-    acceptor_->setNewConnectionCallback(
-            std::bind(&TcpServer::newConnection, this, _1, _2));
+    if (reuseport_ && listen_addr.isUnix())
+    {
+        LOG(FATAL) << "TcpServer::TcpServer - no SO_REUSEPORT for " << name_;
+    }
+    if (!reuseport_)
+    {
+        assert(listen_fds.size() <= 1);
+        if (listen_fds.empty())
+        {
+            acceptor_.reset(new Acceptor(loop, listen_addr, false));
+        }
+        else
+        {
+            acceptor_.reset(new Acceptor(loop, listen_fds[0]));
+        }
+        acceptor_->setNewConnectionCallback(
+                std::bind(&TcpServer::newConnection, this,
+                          static_cast<LoopState*>(NULL), _1, _2));
+    }
+    else
+    {
+        inherited_fds_ = listen_fds;
+    }
 }
 
 TcpServer::~TcpServer()
 {
+    loop_->assertInLoopThread();
+    DLOG(INFO) << "TcpServer::~TcpServer [" << name_ << "] destructing";
+    if (started_ && rebalance_interval_ > 0.0)
+    {
+        loop_->cancel(rebalance_timer_);
+    }
+    if (started_ && autoscale_interval_ > 0.0)
+    {
+        loop_->cancel(autoscale_timer_);
+    }
+    if (started_ && buffer_release_interval_ > 0.0)
+    {
+        loop_->cancel(buffer_release_timer_);
+    }
+
+    for (size_t i = 0; i < loop_states_.size(); ++i)
+    {
+        // IO loops are still running, they are stopped by thread_pool_
+        std::promise<void> done;
+        LoopState* state = loop_states_[i].get();
+        state->loop->runInLoop(
+                std::bind(&TcpServer::destroyLoopStateInLoop, this, state, &done));
+        done.get_future().wait();
+    }
+    // they see their loop state destroyed and close
+    while (migrations_in_flight_.load() > 0)
+    {
+        std::this_thread::yield();
+    }
+}
+
+void TcpServer::destroyLoopStateInLoop(LoopState* state, std::promise<void>* done)
+{
+    state->loop->assertInLoopThread();
+    state->acceptors.clear();
+    if (state->draining)
+    {
+        state->draining = false;
+        state->loop->cancel(state->drain_timer);
+    }
+    for (size_t i = 0; i < state->connections.size(); ++i)
+    {
+        TcpConnectionPtr conn;
+        conn.swap(state->connections[i]);
+        if (conn)
+        {
+            connections_num_.fetch_sub(1, std::memory_order_relaxed);
+            conn->loop()->queueInLoop(
+                    std::bind(&TcpConnection::connectDestroyed, conn));
+        }
+    }
+    state->connections.clear();
+    state->free_slots.clear();
+    state->bytes_checked.clear();
+    state->destroyed = true;
+    done->set_value();
 }
 
 void TcpServer::setThreadsNum(int threads_num)
@@ -37,57 +176,811 @@ void TcpServer::setThreadsNum(int threads_num)
     thread_pool_->setThreadsNum(threads_num);
 }
 
+void TcpServer::setLoopSelectStrategy(EventLoopThreadPool::Strategy strategy)
+{
+    assert(!started_);
+    thread_pool_->setStrategy(strategy);
+}
+
+void TcpServer::setMaxAcceptsPerEvent(int n)
+{
+    assert(!started_ && n > 0);
+    max_accepts_per_event_ = n;
+    if (acceptor_)
+    {
+        acceptor_->setMaxAcceptsPerEvent(n);
+    }
+}
+
+AcceptorStats TcpServer::acceptorStats() const
+{
+    loop_->assertInLoopThread();
+    AcceptorStats total = AcceptorStats();
+    std::vector<const Acceptor*> acceptors;
+    if (acceptor_)
+    {
+        acceptors.push_back(acceptor_.get());
+    }
+    for (size_t i = 0; i < loop_states_.size(); ++i)
+    {
+        for (size_t j = 0; j < loop_states_[i]->acceptors.size(); ++j)
+        {
+            acceptors.push_back(loop_states_[i]->acceptors[j].get());
+        }
+    }
+
+    for (size_t i = 0; i < acceptors.size(); ++i)
+    {
+        AcceptorStats stats = acceptors[i]->stats();
+        total.events += stats.events;
+        total.accepted += stats.accepted;
+        total.rejected += stats.rejected;
+        total.max_batch = std::max(total.max_batch, stats.max_batch);
+    }
+    return total;
+}
+
+void TcpServer::setMaxAcceptRate(double per_second, double burst)
+{
+    assert(!started_ && per_second >= 0.0 && burst >= 1.0);
+    accept_rate_ = per_second;
+    accept_burst_ = burst;
+}
+
+void TcpServer::setOverloadThreshold(double busy_ratio, int queue_size)
+{
+    assert(!started_);
+    overload_busy_ratio_ = busy_ratio;
+    overload_queue_size_ = queue_size;
+}
+
+AdmissionStats TcpServer::admissionStats() const
+{
+    AdmissionStats stats;
+    stats.connections = connections_num_.load(std::memory_order_relaxed);
+    stats.admitted = admitted_.load(std::memory_order_relaxed);
+    stats.max_connections = rejected_max_connections_.load(std::memory_order_relaxed);
+    stats.rate_limited = rejected_rate_limited_.load(std::memory_order_relaxed);
+    stats.overloaded = rejected_overloaded_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+TcpConnection::Callbacks* TcpServer::copyCallbacks()
+{
+    std::shared_ptr<TcpConnection::Callbacks> callbacks(
+            std::make_shared<TcpConnection::Callbacks>(*callbacks_));
+    callbacks_ = callbacks;
+    return callbacks.get();
+}
+
+void TcpServer::setConnectionCallback(const ConnectionCallback& cb)
+{
+    copyCallbacks()->connection = cb;
+}
+
+void TcpServer::setMessageCallback(const MessageCallback& cb)
+{
+    copyCallbacks()->message = cb;
+}
+
+void TcpServer::setWriteCompleteCallback(const WriteCompleteCallback& cb)
+{
+    copyCallbacks()->write_complete = cb;
+}
+
+void TcpServer::setHighWaterMarkCallback(const HighWaterMarkCallback& cb,
+                                         size_t high_water_mark)
+{
+    copyCallbacks()->high_water_mark = cb;
+    high_water_mark_ = high_water_mark;
+}
+
+void TcpServer::initBucket(TokenBucket* bucket, int acceptors_num)
+{
+    bucket->rate = accept_rate_ / acceptors_num;
+    bucket->burst = std::max(1.0, accept_burst_ / acceptors_num);
+    bucket->tokens = bucket->burst;
+    bucket->last = Timestamp::now();
+}
+
 void TcpServer::start()
 {
+    loop_->assertInLoopThread();
     if (!started_)
     {
         started_ = true;
+        if (autoscale_interval_ > 0.0)
+        {
+            thread_pool_->setThreadsNum(std::min(autoscale_max_threads_,
+                    std::max(autoscale_min_threads_, thread_pool_->threadsNum())));
+        }
+        thread_pool_->start();
+
+        std::vector<EventLoop*> loops(thread_pool_->getAllLoops());
+        initBucket(&bucket_, 1);
+        for (size_t i = 0; i < loops.size(); ++i)
+        {
+            LoopState* state = addLoopState(loops[i]);
+            if (reuseport_ && i >= inherited_fds_.size())
+            {
+                addAcceptor(state, new Acceptor(state->loop, listen_addr_, true));
+            }
+        }
+
+        // every inherited socket needs an acceptor, or the connections
+        // the kernel hashes to it are never accepted
+        for (size_t i = 0; i < inherited_fds_.size(); ++i)
+        {
+            LoopState* state = loop_states_[i % loop_states_.size()].get();
+            addAcceptor(state, new Acceptor(state->loop, inherited_fds_[i]));
+        }
+        inherited_fds_.clear();
+
+        if (rebalance_interval_ > 0.0 && loop_states_.size() > 1)
+        {
+            rebalance_timer_ = loop_->runEvery(rebalance_interval_,
+                                               std::bind(&TcpServer::rebalance, this));
+        }
+        if (autoscale_interval_ > 0.0)
+        {
+            autoscale_timer_ = loop_->runEvery(autoscale_interval_,
+                                               std::bind(&TcpServer::autoscale, this));
+        }
+        if (buffer_release_interval_ > 0.0)
+        {
+            buffer_release_timer_ = loop_->runEvery(buffer_release_interval_,
+                    std::bind(&TcpServer::releaseBuffers, this));
+        }
     }
 
-    if (!acceptor_->listenning())
+    if (acceptor_ && !acceptor_->listenning())
     {
         loop_->runInLoop(
                 std::bind(&Acceptor::listen, acceptor_.get()));
     }
 }
 
-void TcpServer::newConnection(int sockfd, const InetAddress& peer_addr)
+TcpServer::LoopState* TcpServer::addLoopState(EventLoop* loop)
+{
+    LoopState* state = new LoopState;
+    state->server = this;
+    state->loop = loop;
+    state->destroyed = false;
+    state->retiring.store(false);
+    state->draining = false;
+    state->drain_deadline = Timestamp::invalid();
+    // kReusePort buckets are split by the loops at start()
+    initBucket(&state->bucket,
+               static_cast<int>(std::max<size_t>(1, thread_pool_->getAllLoops().size())));
+    std::lock_guard<std::mutex> lock(loop_states_mutex_);
+    loop_states_.push_back(std::unique_ptr<LoopState>(state));
+    loop_state_map_[loop] = state;
+    return state;
+}
+
+void TcpServer::addAcceptor(LoopState* state, Acceptor* acceptor)
+{
+    state->acceptors.push_back(std::unique_ptr<Acceptor>(acceptor));
+    if (max_accepts_per_event_ > 0)
+    {
+        acceptor->setMaxAcceptsPerEvent(max_accepts_per_event_);
+    }
+    acceptor->setNewConnectionCallback(
+            std::bind(&TcpServer::newConnection, this, state, _1, _2));
+    state->loop->runInLoop(std::bind(&Acceptor::listen, acceptor));
+}
+
+std::vector<int> TcpServer::listenFds() const
 {
     loop_->assertInLoopThread();
-    char buf[32];
-    snprintf(buf, sizeof buf, "#%d", next_conn_id_);
-    ++next_conn_id_;
-    std::string conn_name = name_ + buf;
-
-    LOG(INFO) << "TcpServer::NewConnection [" << name_
-        << "] - new connection [" << conn_name
-        << "] from " << peer_addr.toIpPort();
-    InetAddress local_addr(sockets::getLocalAddr(sockfd));
+    assert(started_);
+    std::vector<int> fds;
+    if (acceptor_)
+    {
+        fds.push_back(acceptor_->listenFd());
+    }
+    for (size_t i = 0; i < loop_states_.size(); ++i)
+    {
+        for (size_t j = 0; j < loop_states_[i]->acceptors.size(); ++j)
+        {
+            fds.push_back(loop_states_[i]->acceptors[j]->listenFd());
+        }
+    }
+    return fds;
+}
+
+void TcpServer::stopAccepting()
+{
+    assert(started_);
+    if (acceptor_)
+    {
+        loop_->runInLoop(std::bind(&Acceptor::stopListening, acceptor_.get()));
+    }
+    std::lock_guard<std::mutex> lock(loop_states_mutex_);
+    for (size_t i = 0; i < loop_states_.size(); ++i)
+    {
+        LoopState* state = loop_states_[i].get();
+        for (size_t j = 0; j < state->acceptors.size(); ++j)
+        {
+            state->loop->runInLoop(
+                    std::bind(&Acceptor::stopListening, state->acceptors[j].get()));
+        }
+    }
+}
+
+void TcpServer::releaseIdleConnections(const ReleaseCallback& cb)
+{
+    assert(started_);
+    std::lock_guard<std::mutex> lock(loop_states_mutex_);
+    for (size_t i = 0; i < loop_states_.size(); ++i)
+    {
+        LoopState* state = loop_states_[i].get();
+        state->loop->runInLoop(
+                std::bind(&TcpServer::releaseIdleConnectionsInLoop, this, state, cb));
+    }
+}
+
+void TcpServer::releaseIdleConnectionsInLoop(LoopState* state, const ReleaseCallback& cb)
+{
+    state->loop->assertInLoopThread();
+    std::vector<int> fds;
+    for (size_t i = 0; i < state->connections.size(); ++i)
+    {
+        const TcpConnectionPtr& conn = state->connections[i];
+        if (conn && conn->isIdle())
+        {
+            int fd = conn->releaseSocket();
+            if (fd >= 0)
+            {
+                fds.push_back(fd);
+            }
+        }
+    }
+
+    DLOG(INFO) << "TcpServer::releaseIdleConnections [" << name_
+        << "] - " << fds.size() << " connections";
+    cb(fds);
+    for (size_t i = 0; i < fds.size(); ++i)
+    {
+        sockets::close(fds[i]);
+    }
+}
+
+void TcpServer::adoptConnection(int sockfd)
+{
+    assert(started_);
+    sockets::setNonBlockAndCloseOnExec(sockfd);
+    struct sockaddr_storage addr;
+    InetAddress peer_addr(addr, sockets::getPeerAddr(sockfd, &addr));
+    loop_->runInLoop(std::bind(&TcpServer::newConnection, this,
+                               static_cast<LoopState*>(NULL), sockfd, peer_addr));
+}
+
+bool TcpServer::overloaded(EventLoop* loop) const
+{
+    return (overload_busy_ratio_ > 0.0 && loop->busyRatio() > overload_busy_ratio_)
+        || (overload_queue_size_ > 0 && loop->queueSize() > overload_queue_size_);
+}
+
+// The least busy loop in the rotation that is not overloaded, NULL if
+// they all are. Any thread, the accepting loop is a kReusePort one too.
+TcpServer::LoopState* TcpServer::findUnloadedLoopState() const
+{
+    std::lock_guard<std::mutex> lock(loop_states_mutex_);
+    LoopState* unloaded = NULL;
+    for (size_t i = 0; i < loop_states_.size(); ++i)
+    {
+        LoopState* state = loop_states_[i].get();
+        if (!state->retiring.load(std::memory_order_relaxed) && !overloaded(state->loop)
+                && (unloaded == NULL
+                    || state->loop->busyRatio() < unloaded->loop->busyRatio()))
+        {
+            unloaded = state;
+        }
+    }
+    return unloaded;
+}
+
+// Called in the accepting loop, before anything is allocated for sockfd.
+// An overloaded @c *state is replaced by another loop before a token is
+// taken, only if every loop is overloaded the connection is rejected.
+bool TcpServer::admit(TokenBucket* bucket, LoopState** state)
+{
+    if (max_connections_ > 0
+            && connections_num_.load(std::memory_order_relaxed) >= max_connections_)
+    {
+        count(&rejected_max_connections_);
+        return false;
+    }
+
+    if (overloaded((*state)->loop))
+    {
+        LoopState* unloaded = findUnloadedLoopState();
+        if (unloaded == NULL)
+        {
+            count(&rejected_overloaded_);
+            return false;
+        }
+        *state = unloaded;
+    }
+
+    if (bucket->rate > 0.0)
+    {
+        Timestamp now(Timestamp::now());
+        bucket->tokens = std::min(bucket->burst,
+                bucket->tokens + timeDifference(now, bucket->last) * bucket->rate);
+        bucket->last = now;
+        if (bucket->tokens < 1.0)
+        {
+            count(&rejected_rate_limited_);
+            return false;
+        }
+        bucket->tokens -= 1.0;
+    }
+
+    // kReusePort acceptors race here, the limit may be passed by
+    // a few connections
+    connections_num_.fetch_add(1, std::memory_order_relaxed);
+    count(&admitted_);
+    return true;
+}
+
+void TcpServer::newConnection(LoopState* state, int sockfd, const InetAddress& peer_addr)
+{
+    TokenBucket* bucket = state ? &state->bucket : &bucket_;
+    uint64_t id = next_conn_id_.fetch_add(1, std::memory_order_relaxed);
+    DLOG(INFO) << "TcpServer::NewConnection [" << name_
+        << "] - new connection #" << id
+        << " from " << peer_addr.toIpPort();
     // FIXME poll with zero timeout to double confirm the new connection
-    EventLoop* io_loop = thread_pool_->getNextLoop();
+    if (state == NULL)
+    {
+        // accepted by the base loop, hand over to an IO loop
+        loop_->assertInLoopThread();
+        EventLoop* next_loop = NULL;
+        // unix domain peers are unnamed, nothing to hash
+        if (thread_pool_->strategy() == EventLoopThreadPool::kHash && !peer_addr.isUnix())
+        {
+            // FNV-1a of the peer IP, the port changes every connection
+            in_addr_t ip = peer_addr.addr().sin_addr.s_addr;
+            size_t hash_code = 2166136261u;
+            for (size_t i = 0; i < sizeof ip; ++i)
+            {
+                hash_code = (hash_code ^ ((ip >> (8 * i)) & 0xff)) * 16777619u;
+            }
+            next_loop = thread_pool_->getLoopForHash(hash_code);
+        }
+        else
+        {
+            next_loop = thread_pool_->getNextLoop();
+        }
+        state = loop_state_map_[next_loop];
+        assert(state != NULL);
+    }
+    if (!admit(bucket, &state))
+    {
+        DLOG(INFO) << "TcpServer::NewConnection [" << name_
+            << "] - reject connection #" << id;
+        sockets::closeWithReset(sockfd);
+        return;
+    }
+    EventLoop* io_loop = state->loop;
+
     TcpConnectionPtr conn(
-            new TcpConnection(io_loop, conn_name, sockfd, local_addr, peer_addr));
-    connections_[conn_name] = conn;
-    conn->setConnectionCallback(connection_callback_);
-    conn->setMessageCallback(message_callback_);
-    conn->setCloseCallback(std::bind(&TcpServer::removeConnection, this, _1));
-    io_loop->runInLoop(std::bind(&TcpConnection::connectEstablished, conn));
+            std::make_shared<TcpConnection>(io_loop, id, sockfd, peer_addr));
+    conn->setCallbacks(callbacks_);
+    if (callbacks_->high_water_mark || high_water_mark_timeout_ > 0.0)
+    {
+        conn->setHighWaterMark(high_water_mark_);
+        conn->setHighWaterMarkTimeout(high_water_mark_timeout_);
+    }
+    io_loop->runInLoop(
+            std::bind(&TcpServer::connectEstablishedInLoop, this, state, conn));
 }
 
-void TcpServer::removeConnection(const TcpConnectionPtr& conn)
+void TcpServer::connectEstablishedInLoop(LoopState* state, const TcpConnectionPtr& conn)
 {
-    loop_->runInLoop(std::bind(&TcpServer::removeConnectionInLoop, this, conn));
+    state->loop->assertInLoopThread();
+    addToLoopState(state, conn);
+    conn->connectEstablished();
 }
 
-void TcpServer::removeConnectionInLoop(const TcpConnectionPtr& conn)
+void TcpServer::addToLoopState(LoopState* state, const TcpConnectionPtr& conn)
 {
-    loop_->assertInLoopThread();
-    LOG(INFO) << "TcpServer::removeConnectionInLoop [" << name_
-        << "] - connection " << conn->name();
-    size_t n = connections_.erase(conn->name());
-    assert(n == 1); (void)n;
-    EventLoop* io_loop = conn->loop();
-    io_loop->queueInLoop(
+    size_t slot = state->connections.size();
+    if (!state->free_slots.empty())
+    {
+        slot = state->free_slots.back();
+        state->free_slots.pop_back();
+        state->connections[slot] = conn;
+        state->bytes_checked[slot] = conn->bytesReceived();
+    }
+    else
+    {
+        state->connections.push_back(conn);
+        state->bytes_checked.push_back(conn->bytesReceived());
+    }
+    // two words, std::function stores them without allocating
+    conn->setCloseCallback([state, slot](const TcpConnectionPtr& closed) {
+        state->server->removeConnection(state, slot, closed);
+    });
+}
+
+void TcpServer::removeConnection(LoopState* state, size_t slot, const TcpConnectionPtr& conn)
+{
+    // called in the IO loop of conn, no need to bounce to the base loop
+    state->loop->assertInLoopThread();
+    DLOG(INFO) << "TcpServer::removeConnection [" << name_
+        << "] - connection #" << conn->id();
+    assert(state->connections[slot] == conn);
+    state->connections[slot].reset();
+    state->free_slots.push_back(slot);
+    connections_num_.fetch_sub(1, std::memory_order_relaxed);
+    state->loop->queueInLoop(
             std::bind(&TcpConnection::connectDestroyed, conn));
 }
 
+void TcpServer::setRebalancing(double interval, double busy_ratio_gap)
+{
+    assert(!started_ && interval >= 0.0);
+    rebalance_interval_ = interval;
+    rebalance_busy_ratio_gap_ = busy_ratio_gap;
+}
+
+void TcpServer::setBufferReleaseInterval(double interval)
+{
+    assert(!started_ && interval >= 0.0);
+    buffer_release_interval_ = interval;
+}
+
+void TcpServer::releaseBuffers()
+{
+    loop_->assertInLoopThread();
+    for (size_t i = 0; i < loop_states_.size(); ++i)
+    {
+        // a retiring state is freed once drained, a functor queued now
+        // could run after that, the others drain after it
+        LoopState* state = loop_states_[i].get();
+        if (!state->retiring.load())
+        {
+            state->loop->runInLoop(
+                    std::bind(&TcpServer::releaseBuffersInLoop, this, state));
+        }
+    }
+}
+
+void TcpServer::releaseBuffersInLoop(LoopState* state)
+{
+    state->loop->assertInLoopThread();
+    for (size_t i = 0; i < state->connections.size(); ++i)
+    {
+        if (state->connections[i])
+        {
+            state->connections[i]->releaseBuffers();
+        }
+    }
+}
+
+TcpServer::LoopState* TcpServer::findLoopState(EventLoop* loop) const
+{
+    std::lock_guard<std::mutex> lock(loop_states_mutex_);
+    std::map<EventLoop*, LoopState*>::const_iterator it = loop_state_map_.find(loop);
+    return it != loop_state_map_.end() ? it->second : NULL;
+}
+
+void TcpServer::migrateConnection(const TcpConnectionPtr& conn, EventLoop* target)
+{
+    assert(started_);
+    conn->loop()->runInLoop(
+            std::bind(&TcpServer::migrateConnectionInLoop, this, conn, target));
+}
+
+void TcpServer::migrateConnectionInLoop(const TcpConnectionPtr& conn, EventLoop* target)
+{
+    if (!conn->loop()->isInLoopThread())
+    {
+        // moved meanwhile
+        migrateConnection(conn, target);
+        return;
+    }
+    LoopState* from = findLoopState(conn->loop());
+    LoopState* to = findLoopState(target);
+    if (from == NULL || to == NULL)
+    {
+        LOG(ERROR) << "TcpServer::migrateConnection [" << name_
+            << "] - not an IO loop of the server";
+        return;
+    }
+    if (to->retiring.load())
+    {
+        LOG(WARNING) << "TcpServer::migrateConnection [" << name_
+            << "] - IO loop " << target << " is retiring";
+        return;
+    }
+    conn->migrate(target,
+                  std::bind(&TcpServer::leaveLoopState, this, from, _1),
+                  std::bind(&TcpServer::arriveLoopState, this, to, _1));
+}
+
+bool TcpServer::leaveLoopState(LoopState* state, const TcpConnectionPtr& conn)
+{
+    state->loop->assertInLoopThread();
+    std::vector<TcpConnectionPtr>::iterator it =
+        std::find(state->connections.begin(), state->connections.end(), conn);
+    if (it == state->connections.end())
+    {
+        // the server is going away
+        return false;
+    }
+    it->reset();
+    state->free_slots.push_back(static_cast<size_t>(it - state->connections.begin()));
+    migrations_in_flight_.fetch_add(1);
+    return true;
+}
+
+void TcpServer::arriveLoopState(LoopState* state, const TcpConnectionPtr& conn)
+{
+    state->loop->assertInLoopThread();
+    if (state->destroyed)
+    {
+        connections_num_.fetch_sub(1, std::memory_order_relaxed);
+        state->loop->queueInLoop(std::bind(&TcpConnection::connectDestroyed, conn));
+    }
+    else
+    {
+        addToLoopState(state, conn);
+        migrations_.fetch_add(1, std::memory_order_relaxed);
+    }
+    migrations_in_flight_.fetch_sub(1);
+}
+
+void TcpServer::rebalance()
+{
+    loop_->assertInLoopThread();
+    LoopState* busiest = NULL;
+    LoopState* idlest = NULL;
+    for (size_t i = 0; i < loop_states_.size(); ++i)
+    {
+        LoopState* state = loop_states_[i].get();
+        if (state->retiring.load())
+        {
+            continue;
+        }
+        if (busiest == NULL)
+        {
+            busiest = state;
+            idlest = state;
+        }
+        if (state->loop->busyRatio() > busiest->loop->busyRatio())
+        {
+            busiest = state;
+        }
+        if (state->loop->busyRatio() < idlest->loop->busyRatio())
+        {
+            idlest = state;
+        }
+    }
+    if (busiest != idlest
+            && busiest->loop->busyRatio() - idlest->loop->busyRatio() > rebalance_busy_ratio_gap_)
+    {
+        busiest->loop->runInLoop(
+                std::bind(&TcpServer::rebalanceInLoop, this, busiest, idlest->loop));
+    }
+}
+
+void TcpServer::rebalanceInLoop(LoopState* state, EventLoop* target)
+{
+    state->loop->assertInLoopThread();
+    TcpConnectionPtr hottest;
+    uint64_t hottest_bytes = 0;
+    int receiving = 0;
+    for (size_t i = 0; i < state->connections.size(); ++i)
+    {
+        const TcpConnectionPtr& conn = state->connections[i];
+        if (!conn)
+        {
+            continue;
+        }
+        uint64_t bytes = conn->bytesReceived() - state->bytes_checked[i];
+        state->bytes_checked[i] = conn->bytesReceived();
+        if (bytes > 0)
+        {
+            ++receiving;
+        }
+        if (bytes > hottest_bytes)
+        {
+            hottest = conn;
+            hottest_bytes = bytes;
+        }
+    }
+
+    // moving the only busy connection moves the problem
+    if (receiving >= 2)
+    {
+        LOG(INFO) << "TcpServer::rebalance [" << name_ << "] - move " << hottest->name()
+            << " with " << hottest_bytes << " bytes received to loop " << target;
+        migrateConnectionInLoop(hottest, target);
+    }
+}
+
+void TcpServer::setAutoscaling(int min_threads, int max_threads, double interval,
+                               double grow_busy_ratio, double shrink_busy_ratio)
+{
+    assert(!started_ && 0 < min_threads && min_threads <= max_threads);
+    assert(interval >= 0.0 && shrink_busy_ratio < grow_busy_ratio);
+    autoscale_min_threads_ = min_threads;
+    autoscale_max_threads_ = max_threads;
+    autoscale_interval_ = interval;
+    autoscale_grow_busy_ratio_ = grow_busy_ratio;
+    autoscale_shrink_busy_ratio_ = shrink_busy_ratio;
+}
+
+void TcpServer::resizeThreads(int threads_num)
+{
+    assert(started_);
+    loop_->runInLoop(std::bind(&TcpServer::resizeThreadsInLoop, this, threads_num));
+}
+
+void TcpServer::resizeThreadsInLoop(int threads_num)
+{
+    loop_->assertInLoopThread();
+    std::vector<EventLoop*> retired(thread_pool_->resize(threads_num));
+    std::vector<EventLoop*> loops(thread_pool_->getAllLoops());
+    for (size_t i = 0; i < loops.size(); ++i)
+    {
+        if (loop_state_map_.find(loops[i]) == loop_state_map_.end())
+        {
+            LoopState* state = addLoopState(loops[i]);
+            if (reuseport_)
+            {
+                addAcceptor(state, new Acceptor(state->loop, listen_addr_, true));
+            }
+        }
+    }
+
+    std::vector<LoopState*> retiring;
+    for (size_t i = 0; i < retired.size(); ++i)
+    {
+        LoopState* state = loop_state_map_[retired[i]];
+        state->retiring.store(true);
+        retiring.push_back(state);
+        ++retiring_loops_;
+    }
+    LOG(INFO) << "TcpServer::resizeThreads [" << name_ << "] - " << loops.size()
+        << " IO loops, " << retiring_loops_ << " retiring";
+    if (retiring.empty())
+    {
+        return;
+    }
+
+    // once every loop has run this, nothing moves to the retired ones
+    // any more, a migration started earlier has left its loop by then
+    std::function<int(EventLoop*)> barrier = [](EventLoop*) { return 0; };
+    std::function<void(const std::vector<int>&)> drain =
+        [this, retiring](const std::vector<int>&) {
+            for (size_t i = 0; i < retiring.size(); ++i)
+            {
+                retiring[i]->loop->runInLoop(std::bind(&TcpServer::drainLoopStateInLoop,
+                                                       this, retiring[i]));
+            }
+        };
+    thread_pool_->gather(barrier, loop_, drain);
+}
+
+// The loops in the rotation, they change while a loop drains, e.g. by
+// autoscale(). Any thread.
+std::vector<EventLoop*> TcpServer::activeLoops() const
+{
+    std::lock_guard<std::mutex> lock(loop_states_mutex_);
+    std::vector<EventLoop*> loops;
+    for (size_t i = 0; i < loop_states_.size(); ++i)
+    {
+        if (!loop_states_[i]->retiring.load(std::memory_order_relaxed))
+        {
+            loops.push_back(loop_states_[i]->loop);
+        }
+    }
+    return loops;
+}
+
+void TcpServer::drainLoopStateInLoop(LoopState* state)
+{
+    state->loop->assertInLoopThread();
+    if (state->destroyed)
+    {
+        return;
+    }
+    state->draining = false;
+    state->acceptors.clear();
+    Timestamp now(Timestamp::now());
+    if (!state->drain_deadline.valid())
+    {
+        state->drain_deadline = addTime(now, kDrainTimeoutSeconds);
+    }
+    bool timeout = state->drain_deadline < now;
+    std::vector<EventLoop*> targets(activeLoops());
+
+    bool empty = true;
+    for (size_t i = 0; i < state->connections.size(); ++i)
+    {
+        TcpConnectionPtr conn(state->connections[i]);
+        if (!conn)
+        {
+            continue;
+        }
+        // the ones that cannot move now are retried, or close meanwhile
+        empty = false;
+        if (timeout)
+        {
+            LOG(WARNING) << "TcpServer::resizeThreads [" << name_ << "] - "
+                << conn->name() << " did not move off IO loop " << state->loop
+                << " in " << kDrainTimeoutSeconds << " s, force close";
+            conn->forceClose();
+        }
+        else if (!targets.empty())
+        {
+            migrateConnectionInLoop(conn, targets[i % targets.size()]);
+        }
+    }
+
+    if (empty)
+    {
+        loop_->runInLoop(std::bind(&TcpServer::retireLoopState, this, state));
+    }
+    else
+    {
+        state->draining = true;
+        state->drain_timer = state->loop->runAfter(kDrainRetrySeconds,
+                std::bind(&TcpServer::drainLoopStateInLoop, this, state));
+    }
+}
+
+void TcpServer::retireLoopState(LoopState* state)
+{
+    loop_->assertInLoopThread();
+    EventLoop* loop = state->loop;
+    {
+        std::lock_guard<std::mutex> lock(loop_states_mutex_);
+        loop_state_map_.erase(loop);
+        for (size_t i = 0; i < loop_states_.size(); ++i)
+        {
+            if (loop_states_[i].get() == state)
+            {
+                loop_states_.erase(loop_states_.begin() + static_cast<ptrdiff_t>(i));
+                break;
+            }
+        }
+    }
+    --retiring_loops_;
+    // functors queued there before, e.g. TcpConnection::connectDestroyed(),
+    // still run
+    thread_pool_->releaseLoop(loop);
+    LOG(INFO) << "TcpServer::resizeThreads [" << name_ << "] - IO loop "
+        << loop << " retired";
+}
+
+// Runs while loops drain too, they are out of the rotation already.
+void TcpServer::autoscale()
+{
+    loop_->assertInLoopThread();
+    std::vector<EventLoop*> loops(thread_pool_->getAllLoops());
+    double busy_ratio = 0.0;
+    for (size_t i = 0; i < loops.size(); ++i)
+    {
+        busy_ratio += loops[i]->busyRatio();
+    }
+    busy_ratio /= static_cast<double>(loops.size());
+    // an idle loop publishes its busy ratio when poll(2) returns, wakes
+    // them for the next check
+    thread_pool_->broadcast([](EventLoop*) {});
+
+    int threads_num = thread_pool_->threadsNum();
+    if (busy_ratio > autoscale_grow_busy_ratio_ && threads_num < autoscale_max_threads_)
+    {
+        resizeThreadsInLoop(threads_num + 1);
+    }
+    else if (busy_ratio < autoscale_shrink_busy_ratio_ && threads_num > autoscale_min_threads_)
+    {
+        resizeThreadsInLoop(threads_num - 1);
+    }
+}
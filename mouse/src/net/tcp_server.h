@@ -2,17 +2,36 @@
 #define MOUSE_NET_TCP_SERVER_H
 
 #include "callbacks.h"
+#include "event_loop_fwd.h"
+#include "event_loop_thread_pool.h"
 #include "tcp_connection.h"
+#include "timer_id.h"
 
+#include <atomic>
+#include <future>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <vector>
+
+#include <stdint.h>
 
 namespace mouse
 {
 
 class Acceptor;
-class EventLoop;
-class EventLoopThreadPool;
+struct AcceptorStats;
+
+/// Admission decisions of a TcpServer, rejected connections are closed
+/// with RST right after accept(2).
+struct AdmissionStats
+{
+    int connections;            // currently open
+    int64_t admitted;
+    int64_t max_connections;    // rejected, at the connection limit
+    int64_t rate_limited;       // rejected, accept rate exceeded
+    int64_t overloaded;         // rejected, every loop busy or queued up
+};
 
 class TcpServer
 {
@@ -21,42 +40,268 @@ class TcpServer
     TcpServer& operator=(const TcpServer&) = delete;
 
 public:
-    TcpServer(EventLoop* loop, const InetAddress& listen_addr);
+    enum Option
+    {
+        kNoReusePort,
+        // every IO loop owns a SO_REUSEPORT listening socket and accepts
+        // its own connections, the kernel spreads them
+        kReusePort,
+    };
+
+    /// @c listen_addr may be a unix domain one, InetAddress::unixPath()
+    /// or unixAbstract(), with kNoReusePort.
+    TcpServer(EventLoop* loop,
+              const InetAddress& listen_addr,
+              Option option = kNoReusePort);
+    /// Adopts listening sockets inherited from the process we replace,
+    /// see listenFds(), nothing is bound. kNoReusePort takes exactly one.
+    /// Takes the ownership of the fds.
+    TcpServer(EventLoop* loop,
+              const std::vector<int>& listen_fds,
+              Option option = kNoReusePort);
     ~TcpServer();
 
     void setThreadsNum(int threads_num);
 
+    /// Changes the number of IO loops at runtime, see
+    /// EventLoopThreadPool::resize(). New loops get new connections at
+    /// once. Retired loops get no new connections, their connections move
+    /// to the remaining loops, the ones that cannot move yet, see
+    /// TcpConnection::migrate(), are retried until they move or close,
+    /// for 10 seconds at most, then they are force closed and the loop
+    /// stops. In kReusePort mode the acceptor of a retired
+    /// loop is closed, connections the kernel queued on it are reset.
+    /// Thread safe, after start() with threads.
+    void resizeThreads(int threads_num);
+
+    /// Every @c interval seconds, adds an IO loop while the average busy
+    /// ratio of the IO loops is above @c grow_busy_ratio and retires one
+    /// while it is below @c shrink_busy_ratio, within [@c min_threads,
+    /// @c max_threads], see EventLoop::busyRatio(). Off by default.
+    /// Must be called before start().
+    void setAutoscaling(int min_threads, int max_threads, double interval,
+                        double grow_busy_ratio, double shrink_busy_ratio);
+
+    /// The IO loops, valid after start().
+    EventLoopThreadPool* threadPool() const { return thread_pool_.get(); }
+
+    /// How new connections are spread over IO loops, kHash hashes
+    /// the peer IP so a client stays on one loop.
+    /// Ignored in kReusePort mode, the kernel picks the loop.
+    /// Must be called before start().
+    void setLoopSelectStrategy(EventLoopThreadPool::Strategy strategy);
+
+    /// Accepts up to @c n connections per readiness event.
+    /// Must be called before start().
+    void setMaxAcceptsPerEvent(int n);
+
+    /// Counters summed over all acceptors, include acceptor.h to use.
+    /// Must be called in the loop thread after start().
+    AcceptorStats acceptorStats() const;
+
+    /// Admission control, every limit is off by default.
+    /// Must be called before start().
+
+    /// Rejects new connections while @c n are open.
+    void setMaxConnections(int n) { max_connections_ = n; }
+    /// Token bucket, allows bursts of @c burst connections and
+    /// @c per_second on average. Split evenly among kReusePort acceptors.
+    void setMaxAcceptRate(double per_second, double burst);
+    /// An IO loop is overloaded while it is busier than @c busy_ratio or
+    /// has more than @c queue_size queued functors, see
+    /// EventLoop::busyRatio(). A new connection for an overloaded loop goes
+    /// to the least busy other one instead, kHash affinity is lost then,
+    /// and is rejected only if every loop is overloaded. 0 disables either
+    /// check.
+    void setOverloadThreshold(double busy_ratio, int queue_size);
+
+    /// Thread safe.
+    AdmissionStats admissionStats() const;
+
+    /// Hot restart hands the server over to a successor process:
+    ///   old: sockets::sendFds() with listenFds(), stopAccepting(),
+    ///        releaseIdleConnections() and let the busy ones drain
+    ///   new: TcpServer(loop, listen_fds), adoptConnection() per released fd
+    /// Both processes accept from the same sockets for a while, so no
+    /// connection is refused.
+
+    /// Listening sockets, to pass with sockets::sendFds().
+    /// Must be called in the loop thread after start().
+    std::vector<int> listenFds() const;
+
+    /// Stops all acceptors, open connections are served until they close.
+    /// Thread safe, after start().
+    void stopAccepting();
+
+    typedef std::function<void (const std::vector<int>& fds)> ReleaseCallback;
+
+    /// Detaches idle connections, see TcpConnection::releaseSocket().
+    /// @c cb is called once in every IO loop thread with the sockets to pass
+    /// on, they are closed after it returns.
+    /// Thread safe, after start().
+    void releaseIdleConnections(const ReleaseCallback& cb);
+
+    /// Serves an established connection, e.g. released by the process we
+    /// replace. Takes the ownership of @c sockfd.
+    /// Thread safe, after start().
+    void adoptConnection(int sockfd);
+
+    /// Moves @c conn to the IO loop @c target, see TcpConnection::migrate().
+    /// Thread safe, after start().
+    void migrateConnection(const TcpConnectionPtr& conn, EventLoop* target);
+
+    /// Every @c interval seconds, if the busy ratios of the busiest and the
+    /// idlest IO loop differ by more than @c busy_ratio_gap, moves the
+    /// connection that received the most bytes since the last check off
+    /// the busiest loop to the idlest, unless it is the only connection
+    /// receiving there, see EventLoop::busyRatio(). Off by default.
+    /// Must be called before start().
+    void setRebalancing(double interval, double busy_ratio_gap);
+
+    /// Every @c interval seconds, every IO loop frees the buffer storage of
+    /// its connections with nothing buffered, see
+    /// TcpConnection::releaseBuffers(). 10 by default, 0 disables.
+    /// Must be called before start().
+    void setBufferReleaseInterval(double interval);
+
+    /// Connections moved by migrateConnection() and rebalancing.
+    /// Thread safe.
+    int64_t migrations() const { return migrations_.load(std::memory_order_relaxed); }
+
     void start();
 
-    void setConnectionCallback(const ConnectionCallback& cb)
-    { connection_callback_ = cb; }
+    /// The callbacks are shared by the new connections, see
+    /// TcpConnection::setCallbacks(), the ones before keep theirs.
+    void setConnectionCallback(const ConnectionCallback& cb);
 
-    void setMessageCallback(const MessageCallback& cb)
-    { message_callback_ = cb; }
+    void setMessageCallback(const MessageCallback& cb);
 
     /// Set write complete callback.
     /// Not thread safe.
-    void setWriteCompleteCallback(const WriteCompleteCallback& cb)
-    { write_complete_callback_ = cb; }
+    void setWriteCompleteCallback(const WriteCompleteCallback& cb);
 
+    /// Set high water mark callback for every new connection.
+    /// Not thread safe.
+    void setHighWaterMarkCallback(const HighWaterMarkCallback& cb,
+                                  size_t high_water_mark);
+
+    /// Force close connections whose output stays above the high water
+    /// mark for more than @c seconds, 0 disables.
+    /// Not thread safe.
+    void setHighWaterMarkTimeout(double seconds)
+    { high_water_mark_timeout_ = seconds; }
 
 private:
-    void newConnection(int sockfd, const InetAddress& peer_addr);
-    void removeConnection(const TcpConnectionPtr& conn);
-    void removeConnectionInLoop(const TcpConnectionPtr& conn);
+    struct TokenBucket
+    {
+        double rate;    // tokens per second, 0 means unlimited
+        double burst;
+        double tokens;
+        Timestamp last;
+    };
+
+    // Per IO loop bookkeeping, only touched in that loop thread.
+    struct LoopState
+    {
+        TcpServer* server;
+        EventLoop* loop;
+        std::vector<std::unique_ptr<Acceptor>> acceptors; // kReusePort only
+        TokenBucket bucket;                 // kReusePort only
+        // slab of connections, the slot is bound to the close callback
+        // and reused after removal
+        std::vector<TcpConnectionPtr> connections;
+        std::vector<size_t> free_slots;
+        // TcpConnection::bytesReceived() at the last rebalancing check,
+        // by slot
+        std::vector<uint64_t> bytes_checked;
+        bool destroyed;
+        // written in the base loop thread, out of the rotation
+        std::atomic<bool> retiring;
+        TimerId drain_timer;                // while draining
+        bool draining;
+        Timestamp drain_deadline;           // force close after it
+    };
 
-    typedef std::map<std::string, TcpConnectionPtr> ConnectionMap;
+    TcpServer(EventLoop* loop,
+              const InetAddress& listen_addr,
+              const std::vector<int>& listen_fds,
+              Option option);
+    void addAcceptor(LoopState* state, Acceptor* acceptor);
+    void newConnection(LoopState* state, int sockfd, const InetAddress& peer_addr);
+    void releaseIdleConnectionsInLoop(LoopState* state, const ReleaseCallback& cb);
+    TcpConnection::Callbacks* copyCallbacks();
+    void initBucket(TokenBucket* bucket, int acceptors_num);
+    bool overloaded(EventLoop* loop) const;
+    LoopState* findUnloadedLoopState() const;
+    bool admit(TokenBucket* bucket, LoopState** state);
+    static void count(std::atomic<int64_t>* counter)
+    { counter->fetch_add(1, std::memory_order_relaxed); }
+    void connectEstablishedInLoop(LoopState* state, const TcpConnectionPtr& conn);
+    void addToLoopState(LoopState* state, const TcpConnectionPtr& conn);
+    void removeConnection(LoopState* state, size_t slot, const TcpConnectionPtr& conn);
+    LoopState* findLoopState(EventLoop* loop) const;
+    void migrateConnectionInLoop(const TcpConnectionPtr& conn, EventLoop* target);
+    bool leaveLoopState(LoopState* state, const TcpConnectionPtr& conn);
+    void arriveLoopState(LoopState* state, const TcpConnectionPtr& conn);
+    void rebalance();
+    void rebalanceInLoop(LoopState* state, EventLoop* target);
+    void releaseBuffers();
+    void releaseBuffersInLoop(LoopState* state);
+    LoopState* addLoopState(EventLoop* loop);
+    void resizeThreadsInLoop(int threads_num);
+    std::vector<EventLoop*> activeLoops() const;
+    void drainLoopStateInLoop(LoopState* state);
+    void retireLoopState(LoopState* state);
+    void autoscale();
+    void destroyLoopStateInLoop(LoopState* state, std::promise<void>* done);
 
     EventLoop* loop_;  // the acceptor loop
+    const InetAddress listen_addr_;
     const std::string name_;
-    std::unique_ptr<Acceptor> acceptor_; // avoid revealing Acceptor
+    const bool reuseport_;
+    std::unique_ptr<Acceptor> acceptor_; // avoid revealing Acceptor, kNoReusePort only
+    std::vector<int> inherited_fds_; // kReusePort only, until start()
     std::unique_ptr<EventLoopThreadPool> thread_pool_; // avoid revealing Acceptor
-    ConnectionCallback connection_callback_;
-    MessageCallback message_callback_;
-    WriteCompleteCallback write_complete_callback_;
+    // replaced, not changed, by the setters
+    std::shared_ptr<const TcpConnection::Callbacks> callbacks_;
+    size_t high_water_mark_;
+    double high_water_mark_timeout_;
     bool started_;
-    int next_conn_id_;  // always in loop thread
-    ConnectionMap connections_;
+    int max_accepts_per_event_;
+    std::atomic<uint64_t> next_conn_id_;
+    double rebalance_interval_;
+    double rebalance_busy_ratio_gap_;
+    std::atomic<int64_t> migrations_;
+    // left a loop and not arrived yet
+    std::atomic<int> migrations_in_flight_;
+    TimerId rebalance_timer_;
+    double buffer_release_interval_;
+    TimerId buffer_release_timer_;
+    int autoscale_min_threads_;
+    int autoscale_max_threads_;
+    double autoscale_interval_;
+    double autoscale_grow_busy_ratio_;
+    double autoscale_shrink_busy_ratio_;
+    TimerId autoscale_timer_;
+    int retiring_loops_;    // always in loop thread
+
+    // admission control
+    int max_connections_;
+    double accept_rate_;
+    double accept_burst_;
+    double overload_busy_ratio_;
+    int overload_queue_size_;
+    TokenBucket bucket_;    // kNoReusePort only
+    std::atomic<int> connections_num_;
+    std::atomic<int64_t> admitted_;
+    std::atomic<int64_t> rejected_max_connections_;
+    std::atomic<int64_t> rejected_rate_limited_;
+    std::atomic<int64_t> rejected_overloaded_;
+    // written in the base loop thread with loop_states_mutex_ held,
+    // read there without it
+    std::vector<std::unique_ptr<LoopState>> loop_states_;
+    std::map<EventLoop*, LoopState*> loop_state_map_;
+    mutable std::mutex loop_states_mutex_;
 };
 
 }//namespace mouse
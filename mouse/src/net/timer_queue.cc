@@ -73,7 +73,7 @@ TimerQueue::TimerQueue(EventLoop* loop)
       timers_(),
       calling_expired_timers_(false)
 {
-    timerfd_channel_.setReadCallback(std::bind(&TimerQueue::handleRead, this));
+    timerfd_channel_.setOwner(this);
     // we are always reading the timerfd, we disarm it with timerfd_settime.
     timerfd_channel_.enableReading();
 }
@@ -95,7 +95,7 @@ TimerId TimerQueue::addTimer(const TimerCallback& cb,
 {
     Timer* timer = new Timer(cb, when, interval);
     loop_->runInLoop(std::bind(&TimerQueue::addTimerInLoop, this, timer));
-    return TimerId(timer);
+    return TimerId(timer, timer->sequence());
 }
 
 void TimerQueue::cancel(TimerId timer_id)
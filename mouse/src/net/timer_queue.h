@@ -8,11 +8,11 @@
 #include "../base/timestamp.h"
 #include "callbacks.h"
 #include "channel.h"
+#include "event_loop_fwd.h"
 
 namespace mouse
 {
 
-class EventLoop;
 class Timer;
 class TimerId;
 
@@ -34,6 +34,8 @@ public:
     void cancel(TimerId timer_id);
 
 private:
+    friend class Channel;
+
     typedef std::pair<Timestamp, Timer*> Entry;
     typedef std::set<Entry> TimerList;
     typedef std::pair<Timer*, int64_t> ActiveTimer;
@@ -0,0 +1,119 @@
+#include "udp_server.h"
+
+#include "event_loop.h"
+
+#include <glog/logging.h>
+
+#include <functional>
+
+#include <assert.h>
+
+using namespace mouse;
+
+namespace
+{
+
+const size_t kDefaultReceiveBatch = 64;
+const size_t kDefaultSlotSize = 2048;
+
+}//namespace
+
+UdpServer::UdpServer(EventLoop* loop, const InetAddress& bind_addr)
+    : loop_(CHECK_NOTNULL(loop)),
+      bind_addr_(bind_addr),
+      thread_pool_(new EventLoopThreadPool(loop)),
+      batch_(kDefaultReceiveBatch),
+      slot_size_(kDefaultSlotSize),
+      gro_(false),
+      started_(false)
+{
+}
+
+UdpServer::~UdpServer()
+{
+    loop_->assertInLoopThread();
+    for (size_t i = 0; i < sockets_.size(); ++i)
+    {
+        // IO loops are still running, they are stopped by thread_pool_
+        std::promise<void> done;
+        UdpSocket* socket = sockets_[i].get();
+        socket->loop()->runInLoop(
+                std::bind(&UdpServer::destroySocketInLoop, this, socket, &done));
+        done.get_future().wait();
+    }
+}
+
+void UdpServer::setThreadsNum(int threads_num)
+{
+    assert(threads_num >= 0);
+    thread_pool_->setThreadsNum(threads_num);
+}
+
+void UdpServer::start()
+{
+    loop_->assertInLoopThread();
+    if (started_)
+    {
+        return;
+    }
+    started_ = true;
+    thread_pool_->start();
+
+    std::vector<EventLoop*> loops(thread_pool_->getAllLoops());
+    for (size_t i = 0; i < loops.size(); ++i)
+    {
+        UdpSocket* socket = new UdpSocket(loops[i], bind_addr_, true);
+        sockets_.push_back(std::unique_ptr<UdpSocket>(socket));
+        socket->setReceiveBatch(batch_, slot_size_);
+        if (gro_ && !socket->setGro(true))
+        {
+            LOG(WARNING) << "UdpServer::start - UDP_GRO not supported";
+        }
+        socket->setDatagramCallback(datagram_callback_);
+    }
+    // every socket is bound before any receives, the kernel spreads the
+    // flows among the sockets bound so far
+    for (size_t i = 0; i < sockets_.size(); ++i)
+    {
+        UdpSocket* socket = sockets_[i].get();
+        socket->loop()->runInLoop(std::bind(&UdpServer::startSocketInLoop, this, socket));
+    }
+}
+
+void UdpServer::startSocketInLoop(UdpSocket* socket)
+{
+    socket->start();
+}
+
+void UdpServer::destroySocketInLoop(UdpSocket* socket, std::promise<void>* done)
+{
+    socket->loop()->assertInLoopThread();
+    for (size_t i = 0; i < sockets_.size(); ++i)
+    {
+        if (sockets_[i].get() == socket)
+        {
+            sockets_[i].reset();
+        }
+    }
+    done->set_value();
+}
+
+UdpSocketStats UdpServer::stats() const
+{
+    UdpSocketStats total = UdpSocketStats();
+    for (size_t i = 0; i < sockets_.size(); ++i)
+    {
+        if (!sockets_[i])
+        {
+            continue;
+        }
+        UdpSocketStats stats = sockets_[i]->stats();
+        total.received += stats.received;
+        total.receive_calls += stats.receive_calls;
+        total.sent += stats.sent;
+        total.send_calls += stats.send_calls;
+        total.dropped += stats.dropped;
+        total.truncated += stats.truncated;
+    }
+    return total;
+}
@@ -0,0 +1,79 @@
+#ifndef MOUSE_NET_UDP_SERVER_H
+#define MOUSE_NET_UDP_SERVER_H
+
+#include "callbacks.h"
+#include "event_loop_fwd.h"
+#include "event_loop_thread_pool.h"
+#include "inet_address.h"
+#include "udp_socket.h"
+
+#include <future>
+#include <memory>
+#include <vector>
+
+namespace mouse
+{
+
+///
+/// UDP server sharded over IO loops: every loop owns a SO_REUSEPORT
+/// UdpSocket bound to the address, the kernel hashes the flows among them,
+/// so a flow stays on one loop and the loops share nothing.
+///
+class UdpServer
+{
+    //nocopyable
+    UdpServer(const UdpServer&) = delete;
+    UdpServer& operator=(const UdpServer&) = delete;
+
+public:
+    UdpServer(EventLoop* loop, const InetAddress& bind_addr);
+    /// Must be called in the loop thread.
+    ~UdpServer();
+
+    /// Number of IO loops, 0 receives in the loop of the server.
+    /// Must be called before start().
+    void setThreadsNum(int threads_num);
+
+    /// Called in the loop of the socket, replies go out with
+    /// UdpSocket::send() on it.
+    /// Must be called before start().
+    void setDatagramCallback(const DatagramCallback& cb)
+    { datagram_callback_ = cb; }
+
+    /// See UdpSocket::setReceiveBatch().
+    /// Must be called before start().
+    void setReceiveBatch(size_t batch, size_t slot_size)
+    { batch_ = batch; slot_size_ = slot_size; }
+
+    /// See UdpSocket::setGro().
+    /// Must be called before start().
+    void setGro(bool on) { gro_ = on; }
+
+    /// The IO loops, valid after start().
+    EventLoopThreadPool* threadPool() const { return thread_pool_.get(); }
+
+    /// Must be called in the loop thread.
+    void start();
+
+    /// Sum of the sockets.
+    /// Thread safe, after start().
+    UdpSocketStats stats() const;
+
+private:
+    void startSocketInLoop(UdpSocket* socket);
+    void destroySocketInLoop(UdpSocket* socket, std::promise<void>* done);
+
+    EventLoop* loop_;
+    const InetAddress bind_addr_;
+    std::unique_ptr<EventLoopThreadPool> thread_pool_;
+    DatagramCallback datagram_callback_;
+    size_t batch_;
+    size_t slot_size_;
+    bool gro_;
+    bool started_;
+    std::vector<std::unique_ptr<UdpSocket>> sockets_;
+};
+
+}//namespace mouse
+
+#endif
@@ -0,0 +1,407 @@
+#include "udp_socket.h"
+
+#include "event_loop.h"
+#include "inet_address.h"
+#include "sockets_ops.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+
+#include <assert.h>
+#include <errno.h>
+#include <netinet/udp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+using namespace mouse;
+
+namespace
+{
+
+const size_t kDefaultReceiveBatch = 64;
+const size_t kDefaultSlotSize = 2048;
+const size_t kGroSlotSize = 65536;
+const size_t kDefaultMaxPending = 1024;
+// a busy socket is left after this many full batches, for the others
+const int kMaxBatchesPerEvent = 8;
+const size_t kSendBatch = 64;
+// kernel limits of one UDP_SEGMENT send
+const size_t kMaxGsoSegments = 64;
+const size_t kMaxGsoBytes = 65000;
+
+void add(std::atomic<int64_t>* counter, int64_t n)
+{
+    counter->store(counter->load(std::memory_order_relaxed) + n,
+                   std::memory_order_relaxed);
+}
+
+}//namespace
+
+UdpSocket::UdpSocket(EventLoop* loop, const InetAddress& bind_addr, bool reuseport)
+  : loop_(loop),
+    socket_(sockets::createNonblockingUdp()),
+    channel_(loop, socket_.fd()),
+    started_(false),
+    gro_(false),
+    gso_(false),
+    batch_(kDefaultReceiveBatch),
+    slot_size_(kDefaultSlotSize),
+    max_pending_(kDefaultMaxPending),
+    received_(0),
+    receive_calls_(0),
+    sent_(0),
+    send_calls_(0),
+    dropped_(0),
+    truncated_(0)
+{
+    socket_.setReuseAddr(true);
+    socket_.setReusePort(reuseport);
+    socket_.bindAddress(bind_addr);
+    gso_ = socket_.probeUdpGso();
+    channel_.setOwner(this);
+
+    send_control_.resize(kSendBatch * CMSG_SPACE(sizeof(uint16_t)));
+    send_iovecs_.resize(kSendBatch);
+    send_headers_.resize(kSendBatch);
+}
+
+UdpSocket::~UdpSocket()
+{
+    if (started_)
+    {
+        loop_->assertInLoopThread();
+        channel_.disableAll();
+        loop_->removeChannel(&channel_);
+    }
+}
+
+void UdpSocket::setReceiveBatch(size_t batch, size_t slot_size)
+{
+    assert(!started_);
+    assert(batch > 0 && slot_size > 0);
+    batch_ = batch;
+    slot_size_ = gro_ ? std::max(slot_size, kGroSlotSize) : slot_size;
+}
+
+bool UdpSocket::setGro(bool on)
+{
+    assert(!started_);
+    if (!socket_.setUdpGro(on))
+    {
+        return false;
+    }
+    gro_ = on;
+    if (gro_)
+    {
+        slot_size_ = std::max(slot_size_, kGroSlotSize);
+    }
+    return true;
+}
+
+UdpSocketStats UdpSocket::stats() const
+{
+    UdpSocketStats stats;
+    stats.received = received_.load(std::memory_order_relaxed);
+    stats.receive_calls = receive_calls_.load(std::memory_order_relaxed);
+    stats.sent = sent_.load(std::memory_order_relaxed);
+    stats.send_calls = send_calls_.load(std::memory_order_relaxed);
+    stats.dropped = dropped_.load(std::memory_order_relaxed);
+    stats.truncated = truncated_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void UdpSocket::start()
+{
+    loop_->assertInLoopThread();
+    assert(!started_);
+    started_ = true;
+    allocateSlots();
+    channel_.enableReading();
+}
+
+// The slots and message headers are set up once and reused by every
+// recvmmsg(2), only the fields it overwrites are reset per call.
+void UdpSocket::allocateSlots()
+{
+    size_t control_size = gro_ ? CMSG_SPACE(sizeof(int)) : 0;
+    slots_.resize(batch_ * slot_size_);
+    peers_.resize(batch_);
+    receive_control_.resize(batch_ * control_size);
+    receive_iovecs_.resize(batch_);
+    receive_headers_.resize(batch_);
+    datagrams_.reserve(batch_);
+
+    for (size_t i = 0; i < batch_; ++i)
+    {
+        receive_iovecs_[i].iov_base = &slots_[i * slot_size_];
+        receive_iovecs_[i].iov_len = slot_size_;
+
+        struct msghdr& header = receive_headers_[i].msg_hdr;
+        bzero(&header, sizeof header);
+        header.msg_name = &peers_[i];
+        header.msg_iov = &receive_iovecs_[i];
+        header.msg_iovlen = 1;
+        header.msg_control = control_size > 0 ? &receive_control_[i * control_size] : NULL;
+    }
+}
+
+void UdpSocket::handleRead(Timestamp receive_time)
+{
+    loop_->assertInLoopThread();
+    size_t control_size = gro_ ? CMSG_SPACE(sizeof(int)) : 0;
+
+    for (int round = 0; round < kMaxBatchesPerEvent; ++round)
+    {
+        for (size_t i = 0; i < batch_; ++i)
+        {
+            struct msghdr& header = receive_headers_[i].msg_hdr;
+            header.msg_namelen = sizeof peers_[i];
+            header.msg_controllen = control_size;
+            header.msg_flags = 0;
+        }
+
+        int n = ::recvmmsg(socket_.fd(), receive_headers_.data(),
+                           static_cast<unsigned int>(batch_), 0, NULL);
+        if (n < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                LOG(ERROR) << "UdpSocket::handleRead recvmmsg fd = " << socket_.fd();
+            }
+            break;
+        }
+        add(&receive_calls_, 1);
+
+        datagrams_.clear();
+        for (size_t i = 0; i < static_cast<size_t>(n); ++i)
+        {
+            const struct msghdr& header = receive_headers_[i].msg_hdr;
+            if (header.msg_flags & MSG_TRUNC)
+            {
+                add(&truncated_, 1);
+                continue;
+            }
+
+            // a coalesced buffer carries the size of its datagrams,
+            // all but the last are of that size
+            size_t len = receive_headers_[i].msg_len;
+            size_t segment_size = len;
+            if (gro_)
+            {
+                struct msghdr* mutable_header = &receive_headers_[i].msg_hdr;
+                for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(mutable_header);
+                     cmsg != NULL;
+                     cmsg = CMSG_NXTHDR(mutable_header, cmsg))
+                {
+                    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+                    {
+                        int gso_size;
+                        memcpy(&gso_size, CMSG_DATA(cmsg), sizeof gso_size);
+                        if (gso_size > 0)
+                        {
+                            segment_size = static_cast<size_t>(gso_size);
+                        }
+                    }
+                }
+            }
+
+            const char* data = &slots_[i * slot_size_];
+            for (size_t offset = 0; offset < len; offset += segment_size)
+            {
+                Datagram datagram;
+                datagram.data = data + offset;
+                datagram.len = std::min(segment_size, len - offset);
+                datagram.peer = &peers_[i];
+                datagrams_.push_back(datagram);
+            }
+            if (len == 0)
+            {
+                Datagram datagram = { data, 0, &peers_[i] };
+                datagrams_.push_back(datagram);
+            }
+        }
+
+        add(&received_, static_cast<int64_t>(datagrams_.size()));
+        if (datagram_callback_ && !datagrams_.empty())
+        {
+            datagram_callback_(this, datagrams_.data(), datagrams_.size(), receive_time);
+        }
+        // replies to the batch go out together
+        flush();
+
+        if (static_cast<size_t>(n) < batch_)
+        {
+            break;
+        }
+    }
+}
+
+bool UdpSocket::send(const InetAddress& peer, const void* data, size_t len)
+{
+    return enqueue(peer, data, len, 0);
+}
+
+bool UdpSocket::sendSegments(const InetAddress& peer, const void* data, size_t len,
+                             size_t segment_size)
+{
+    assert(segment_size > 0);
+    const char* bytes = static_cast<const char*>(data);
+    if (!gso_ || len <= segment_size)
+    {
+        for (size_t offset = 0; offset < len; offset += segment_size)
+        {
+            if (!enqueue(peer, bytes + offset, std::min(segment_size, len - offset), 0))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t chunk = segment_size * std::max<size_t>(1,
+            std::min(kMaxGsoSegments, kMaxGsoBytes / segment_size));
+    for (size_t offset = 0; offset < len; offset += chunk)
+    {
+        if (!enqueue(peer, bytes + offset, std::min(chunk, len - offset), segment_size))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool UdpSocket::enqueue(const InetAddress& peer, const void* data, size_t len,
+                        size_t segment_size)
+{
+    loop_->assertInLoopThread();
+    if (pending_.size() >= max_pending_)
+    {
+        // a large batch of replies, make room before dropping
+        flush();
+    }
+    if (pending_.size() >= max_pending_)
+    {
+        add(&dropped_, 1);
+        return false;
+    }
+
+    Pending pending;
+    pending.offset = send_buffer_.size();
+    pending.len = len;
+    pending.segment_size = len > segment_size ? segment_size : 0;
+    pending.peer = peer.addr();
+    send_buffer_.insert(send_buffer_.end(),
+                        static_cast<const char*>(data),
+                        static_cast<const char*>(data) + len);
+    pending_.push_back(pending);
+    return true;
+}
+
+void UdpSocket::flush()
+{
+    loop_->assertInLoopThread();
+    size_t done = 0;
+    bool blocked = false;
+    while (done < pending_.size() && !blocked)
+    {
+        size_t count = std::min(kSendBatch, pending_.size() - done);
+        for (size_t i = 0; i < count; ++i)
+        {
+            Pending& pending = pending_[done + i];
+            send_iovecs_[i].iov_base = send_buffer_.data() + pending.offset;
+            send_iovecs_[i].iov_len = pending.len;
+
+            struct msghdr& header = send_headers_[i].msg_hdr;
+            bzero(&header, sizeof header);
+            header.msg_name = &pending.peer;
+            header.msg_namelen = sizeof pending.peer;
+            header.msg_iov = &send_iovecs_[i];
+            header.msg_iovlen = 1;
+            if (pending.segment_size > 0)
+            {
+                char* control = &send_control_[i * CMSG_SPACE(sizeof(uint16_t))];
+                header.msg_control = control;
+                header.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+                struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t segment_size = static_cast<uint16_t>(pending.segment_size);
+                memcpy(CMSG_DATA(cmsg), &segment_size, sizeof segment_size);
+            }
+        }
+
+        int n = ::sendmmsg(socket_.fd(), send_headers_.data(),
+                           static_cast<unsigned int>(count), 0);
+        add(&send_calls_, 1);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                blocked = true;
+            }
+            else
+            {
+                // e.g. ECONNREFUSED of an earlier datagram, or offload
+                // not supported by the device, skip the first one
+                LOG(ERROR) << "UdpSocket::flush sendmmsg fd = " << socket_.fd()
+                    << " " << strerror(errno);
+                add(&dropped_, 1);
+                ++done;
+            }
+            continue;
+        }
+
+        int64_t datagrams = 0;
+        for (size_t i = 0; i < static_cast<size_t>(n); ++i)
+        {
+            const Pending& pending = pending_[done + i];
+            datagrams += pending.segment_size > 0
+                ? static_cast<int64_t>((pending.len + pending.segment_size - 1)
+                                       / pending.segment_size)
+                : 1;
+        }
+        add(&sent_, datagrams);
+        done += static_cast<size_t>(n);
+    }
+
+    if (done == pending_.size())
+    {
+        pending_.clear();
+        send_buffer_.clear();
+        if (channel_.isWriting())
+        {
+            channel_.disableWriting();
+        }
+        return;
+    }
+
+    // keep the rest, until writable
+    size_t offset = pending_[done].offset;
+    send_buffer_.erase(send_buffer_.begin(),
+                       send_buffer_.begin() + static_cast<ptrdiff_t>(offset));
+    pending_.erase(pending_.begin(), pending_.begin() + static_cast<ptrdiff_t>(done));
+    for (size_t i = 0; i < pending_.size(); ++i)
+    {
+        pending_[i].offset -= offset;
+    }
+    if (!channel_.isWriting())
+    {
+        channel_.enableWriting();
+    }
+}
+
+void UdpSocket::handleWrite()
+{
+    flush();
+}
+
+void UdpSocket::handleError()
+{
+    // ICMP errors of earlier datagrams, the socket stays usable
+    int err = sockets::getSocketError(socket_.fd());
+    LOG(ERROR) << "UdpSocket::handleError fd = " << socket_.fd()
+        << " - SO_ERROR = " << err << " " << strerror(err);
+}
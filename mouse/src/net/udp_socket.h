@@ -0,0 +1,163 @@
+#ifndef MOUSE_NET_UDP_SOCKET_H
+#define MOUSE_NET_UDP_SOCKET_H
+
+#include "callbacks.h"
+#include "channel.h"
+#include "event_loop_fwd.h"
+#include "socket.h"
+
+#include <atomic>
+#include <vector>
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct iovec;
+struct mmsghdr;
+
+namespace mouse
+{
+
+class InetAddress;
+
+/// A received datagram, points into the receive slots of its UdpSocket.
+struct Datagram
+{
+    const char* data;
+    size_t len;
+    const struct sockaddr_in* peer;
+};
+
+struct UdpSocketStats
+{
+    int64_t received;       // datagrams
+    int64_t receive_calls;  // recvmmsg(2) calls
+    int64_t sent;           // datagrams, GSO segments counted
+    int64_t send_calls;     // sendmmsg(2) calls
+    int64_t dropped;        // send queue full or send failed
+    int64_t truncated;      // larger than a receive slot, dropped
+};
+
+///
+/// Non-blocking UDP socket on a Channel. Datagrams are received in
+/// batches with recvmmsg(2) into slots allocated once, and the callback
+/// gets a whole batch. Sends are queued and go out in batches with
+/// sendmmsg(2) on flush(), which runs after every datagram callback, so
+/// replies to a batch take one system call. A full socket buffer keeps
+/// them queued until writable.
+///
+class UdpSocket
+{
+    //nocopyable
+    UdpSocket(const UdpSocket&) = delete;
+    UdpSocket& operator=(const UdpSocket&) = delete;
+
+public:
+    /// Binds @c bind_addr, with SO_REUSEPORT several sockets of a process
+    /// share the port and the kernel spreads the flows among them.
+    UdpSocket(EventLoop* loop, const InetAddress& bind_addr, bool reuseport);
+    /// Must be called in the loop thread if started.
+    ~UdpSocket();
+
+    EventLoop* loop() const { return loop_; }
+    int fd() const { return socket_.fd(); }
+
+    void setDatagramCallback(const DatagramCallback& cb)
+    { datagram_callback_ = cb; }
+
+    /// Receives up to @c batch datagrams of up to @c slot_size bytes per
+    /// recvmmsg(2), 64 of 2048 by default. Larger ones are dropped.
+    /// Must be called before start().
+    void setReceiveBatch(size_t batch, size_t slot_size);
+
+    /// Lets the kernel coalesce datagrams of a flow (UDP_GRO), they are
+    /// split again before the callback. Receive slots grow to 64KiB.
+    /// Returns false if not supported by kernel.
+    /// Must be called before start().
+    bool setGro(bool on);
+
+    /// Queued datagrams beyond @c n are dropped, 1024 by default. A full
+    /// queue is flushed first.
+    void setMaxPendingDatagrams(size_t n) { max_pending_ = n; }
+
+    /// Starts receiving.
+    /// Must be called in the loop thread.
+    void start();
+
+    /// Queues a datagram to @c peer, false if dropped.
+    /// Must be called in the loop thread.
+    bool send(const InetAddress& peer, const void* data, size_t len);
+
+    /// Queues @c len bytes to @c peer as datagrams of @c segment_size bytes,
+    /// the last may be shorter. They are handed to the kernel as one
+    /// (UDP_SEGMENT) if it supports send offload, false if dropped.
+    /// Must be called in the loop thread.
+    bool sendSegments(const InetAddress& peer, const void* data, size_t len,
+                      size_t segment_size);
+
+    /// Sends what is queued, as much as the socket buffer takes.
+    /// Must be called in the loop thread.
+    void flush();
+
+    size_t pendingDatagrams() const { return pending_.size(); }
+
+    /// Thread safe.
+    UdpSocketStats stats() const;
+
+private:
+    friend class Channel;
+
+    struct Pending
+    {
+        size_t offset;          // in send_buffer_
+        size_t len;
+        size_t segment_size;    // 0 without GSO
+        struct sockaddr_in peer;
+    };
+
+    void handleRead(Timestamp receive_time);
+    void handleWrite();
+    void handleError();
+    void allocateSlots();
+    bool enqueue(const InetAddress& peer, const void* data, size_t len,
+                 size_t segment_size);
+
+    EventLoop* loop_;
+    Socket socket_;
+    Channel channel_;
+    DatagramCallback datagram_callback_;
+    bool started_;
+    bool gro_;
+    bool gso_;  // kernel supports UDP_SEGMENT
+
+    // receive slots, allocated by start()
+    size_t batch_;
+    size_t slot_size_;
+    std::vector<char> slots_;
+    std::vector<struct sockaddr_in> peers_;
+    std::vector<char> receive_control_;
+    std::vector<struct iovec> receive_iovecs_;
+    std::vector<struct mmsghdr> receive_headers_;
+    std::vector<Datagram> datagrams_;
+
+    // send queue
+    size_t max_pending_;
+    std::vector<char> send_buffer_;
+    std::vector<Pending> pending_;
+    std::vector<char> send_control_;
+    std::vector<struct iovec> send_iovecs_;
+    std::vector<struct mmsghdr> send_headers_;
+
+    // written in loop thread only
+    std::atomic<int64_t> received_;
+    std::atomic<int64_t> receive_calls_;
+    std::atomic<int64_t> sent_;
+    std::atomic<int64_t> send_calls_;
+    std::atomic<int64_t> dropped_;
+    std::atomic<int64_t> truncated_;
+};
+
+}//namespace mouse
+
+#endif
@@ -0,0 +1,133 @@
+// Connection accept rate benchmark.
+//
+// Forked clients connect to the server and close at once, in a loop.
+// The server counts established connections, and
+// reports connections per second and CPU time of the server per connection.
+//
+// Usage: accept_bench [seconds] [clients] [io threads]
+
+#include "../net/event_loop.h"
+#include "../net/tcp_server.h"
+
+#include <glog/logging.h>
+
+#include <atomic>
+#include <functional>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace mouse;
+
+namespace
+{
+
+const uint16_t kPort = 2032;
+
+std::atomic<int64_t> g_established(0);
+
+double cpuSeconds()
+{
+    struct rusage usage;
+    ::getrusage(RUSAGE_SELF, &usage);
+    return static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+        + static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+void runClient()
+{
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    // killed by the parent
+    while (true)
+    {
+        int sockfd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (::connect(sockfd, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) < 0)
+        {
+            ::usleep(1000);
+        }
+        // RST instead of FIN, so the client does not run out of ports
+        // with sockets in TIME_WAIT
+        struct linger opt = { 1, 0 };
+        ::setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &opt, sizeof opt);
+        ::close(sockfd);
+    }
+}
+
+void onConnection(const TcpConnectionPtr& conn)
+{
+    if (conn->connected())
+    {
+        g_established.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void onMessage(const TcpConnectionPtr& conn, Buffer* buf, Timestamp)
+{
+    buf->retrieveAll();
+}
+
+void report(EventLoop* loop, std::vector<pid_t>* clients,
+            Timestamp start, double cpu_start, int64_t established_start)
+{
+    double elapsed = timeDifference(Timestamp::now(), start);
+    double cpu = cpuSeconds() - cpu_start;
+    double established = static_cast<double>(g_established - established_start);
+    printf("%.0f connections in %.3f s  %.0f connections/s  server cpu %.2f us/connection\n",
+           established, elapsed, established / elapsed, cpu * 1e6 / established);
+    for (size_t i = 0; i < clients->size(); ++i)
+    {
+        ::kill((*clients)[i], SIGKILL);
+        ::waitpid((*clients)[i], NULL, 0);
+    }
+    loop->quit();
+}
+
+}//namespace
+
+int main(int argc, char* argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    double seconds = argc > 1 ? atof(argv[1]) : 3.0;
+    int clients_num = argc > 2 ? atoi(argv[2]) : 1;
+    int threads_num = argc > 3 ? atoi(argv[3]) : 0;
+
+    // fork before IO threads are started
+    std::vector<pid_t> clients;
+    for (int i = 0; i < clients_num; ++i)
+    {
+        pid_t pid = ::fork();
+        if (pid == 0)
+        {
+            ::usleep(100 * 1000);
+            runClient();
+        }
+        clients.push_back(pid);
+    }
+
+    EventLoop loop;
+    TcpServer server(&loop, InetAddress(kPort));
+    server.setThreadsNum(threads_num);
+    server.setConnectionCallback(onConnection);
+    server.setMessageCallback(onMessage);
+    server.start();
+
+    // skip the warm up
+    loop.runAfter(0.5, [&] {
+        loop.runAfter(seconds, std::bind(report, &loop, &clients,
+                                         Timestamp::now(), cpuSeconds(),
+                                         g_established.load()));
+    });
+    loop.startLoop();
+}
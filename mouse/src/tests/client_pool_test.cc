@@ -0,0 +1,135 @@
+// ClientPool test with a line echo server in the same loop.
+//
+// First a burst of requests is pipelined over two connections, every
+// response must match its own request. Then the server is restarted,
+// requests made while it is down wait for the connections to come back,
+// and must all be answered by the new server.
+
+#include "../net/client_pool.h"
+#include "../net/event_loop.h"
+#include "../net/tcp_server.h"
+
+#include <glog/logging.h>
+
+#include <memory>
+#include <string>
+
+#include <stdio.h>
+#include <string.h>
+
+using namespace mouse;
+
+namespace
+{
+
+const uint16_t kPort = 2034;
+const int kRequests = 1000;
+// within the waiting queue bound, 2 connections * depth 16
+const int kRequestsWhileDown = 20;
+
+EventLoop* g_loop;
+std::unique_ptr<TcpServer> g_server;
+std::unique_ptr<ClientPool> g_pool;
+int g_sent = 0;
+int g_answered = 0;
+int g_failed = 0;
+int g_mismatched = 0;
+
+void onServerMessage(const TcpConnectionPtr& conn, Buffer* buf, Timestamp)
+{
+    conn->send(buf->retrieveAsString());
+}
+
+void startServer()
+{
+    g_server.reset(new TcpServer(g_loop, InetAddress(kPort)));
+    g_server->setConnectionCallback([](const TcpConnectionPtr&) {});
+    g_server->setMessageCallback(onServerMessage);
+    g_server->start();
+}
+
+ssize_t parseLine(const Buffer* buf)
+{
+    const char* eol = static_cast<const char*>(
+            memchr(buf->peek(), '\n', buf->readableBytes()));
+    return eol ? eol - buf->peek() + 1 : 0;
+}
+
+void sendRequest();
+
+void onResponse(const std::string& request, bool ok, const char* data, size_t len)
+{
+    if (!ok)
+    {
+        ++g_failed;
+    }
+    else if (request != std::string(data, len))
+    {
+        ++g_mismatched;
+    }
+    ++g_answered;
+    // keeps the pipelines full until the burst is sent
+    if (g_sent < kRequests)
+    {
+        sendRequest();
+    }
+}
+
+void sendRequest()
+{
+    char request[32];
+    snprintf(request, sizeof request, "request %d\n", g_sent++);
+    std::string r(request);
+    g_pool->request(InetAddress("127.0.0.1", kPort), r,
+            [r](bool ok, const char* data, size_t len) {
+                onResponse(r, ok, data, len);
+            });
+}
+
+void restartServer()
+{
+    printf("pipelined: answered %d failed %d mismatched %d\n",
+           g_answered, g_failed, g_mismatched);
+    g_server.reset();
+    // once the pool has seen the connections closed, they are answered
+    // after it reconnects
+    g_loop->runAfter(0.1, [] {
+        for (int i = 0; i < kRequestsWhileDown; ++i)
+        {
+            sendRequest();
+        }
+    });
+    g_loop->runAfter(0.2, startServer);
+}
+
+}//namespace
+
+int main(int argc, char* argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    EventLoop loop;
+    g_loop = &loop;
+    startServer();
+
+    g_pool.reset(new ClientPool(&loop, parseLine));
+    g_pool->setConnectionsPerServer(2);
+    g_pool->setMaxPipelineDepth(16);
+    g_pool->setHealthCheck(1.0, "ping\n");
+
+    // fill the 2 pipelines of 16, they wait for the connections first
+    for (int i = 0; i < 32; ++i)
+    {
+        sendRequest();
+    }
+    loop.runAfter(0.5, restartServer);
+    loop.runAfter(2.5, [] { g_loop->quit(); });
+    loop.startLoop();
+
+    bool ok = g_answered == kRequests + kRequestsWhileDown
+        && g_failed == 0 && g_mismatched == 0;
+    printf("after restart: answered %d failed %d mismatched %d: %s\n",
+           g_answered, g_failed, g_mismatched, ok ? "PASS" : "FAIL");
+    g_pool.reset();
+    g_server.reset();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,138 @@
+// Echo server as coroutines against the same server with callbacks.
+//
+// One loop runs the server and ping-pong clients made with TcpClient,
+// so both servers are measured with the same client cost, in the same
+// thread. Reports round trips per second of each.
+//
+// Usage: coro_bench [seconds] [connections] [message size]
+
+#include "../net/coroutine.h"
+#include "../net/event_loop.h"
+#include "../net/tcp_client.h"
+#include "../net/tcp_server.h"
+
+#include <glog/logging.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace mouse;
+
+namespace
+{
+
+const uint16_t kPort = 2037;
+
+double g_seconds = 3.0;
+int g_connections = 16;
+size_t g_message_size = 64;
+
+int64_t g_round_trips = 0;
+int g_connected = 0;
+bool g_counting = false;
+
+void onServerMessage(const TcpConnectionPtr& conn, Buffer* buf, Timestamp)
+{
+    conn->send(buf->retrieveAsString());
+}
+
+coro::Task<> echoSession(coro::Connection conn)
+{
+    while (true)
+    {
+        std::string data = co_await conn.readSome();
+        if (data.empty() || !co_await conn.write(std::move(data)))
+        {
+            break;
+        }
+    }
+}
+
+void onClientMessage(const TcpConnectionPtr& conn, Buffer* buf, Timestamp)
+{
+    while (buf->readableBytes() >= g_message_size)
+    {
+        buf->retrieve(g_message_size);
+        if (g_counting)
+        {
+            ++g_round_trips;
+        }
+        conn->send(std::string(g_message_size, 'x'));
+    }
+}
+
+double runRound(bool coroutine)
+{
+    EventLoop loop;
+    TcpServer server(&loop, InetAddress(kPort));
+    if (coroutine)
+    {
+        server.setConnectionCallback([](const TcpConnectionPtr& conn) {
+            if (conn->connected())
+            {
+                coro::spawn(echoSession(coro::Connection(conn)));
+            }
+        });
+    }
+    else
+    {
+        server.setConnectionCallback([](const TcpConnectionPtr&) {});
+        server.setMessageCallback(onServerMessage);
+    }
+    server.start();
+
+    g_round_trips = 0;
+    g_connected = 0;
+    g_counting = false;
+    std::vector<std::unique_ptr<TcpClient>> clients;
+    for (int i = 0; i < g_connections; ++i)
+    {
+        clients.push_back(std::unique_ptr<TcpClient>(
+                new TcpClient(&loop, InetAddress("127.0.0.1", kPort))));
+        clients.back()->setConnectionCallback([](const TcpConnectionPtr& conn) {
+            if (conn->connected())
+            {
+                conn->setTcpNoDelay(true);
+                ++g_connected;
+                conn->send(std::string(g_message_size, 'x'));
+            }
+        });
+        clients.back()->setMessageCallback(onClientMessage);
+        clients.back()->connect();
+    }
+
+    // warm up, then count
+    Timestamp start;
+    loop.runAfter(0.5, [&] {
+        g_counting = true;
+        start = Timestamp::now();
+        loop.runAfter(g_seconds, [&] { loop.quit(); });
+    });
+    loop.startLoop();
+    double elapsed = timeDifference(Timestamp::now(), start);
+    if (g_connected != g_connections)
+    {
+        fprintf(stderr, "only %d of %d connections up\n", g_connected, g_connections);
+    }
+    return static_cast<double>(g_round_trips) / elapsed;
+}
+
+}//namespace
+
+int main(int argc, char* argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    g_seconds = argc > 1 ? atof(argv[1]) : g_seconds;
+    g_connections = argc > 2 ? atoi(argv[2]) : g_connections;
+    g_message_size = argc > 3 ? static_cast<size_t>(atol(argv[3])) : g_message_size;
+
+    double callbacks = runRound(false);
+    double coroutines = runRound(true);
+    printf("callbacks   %.0f round trips/s\n", callbacks);
+    printf("coroutines  %.0f round trips/s  (%+.1f%%)\n",
+           coroutines, (coroutines / callbacks - 1) * 100);
+}
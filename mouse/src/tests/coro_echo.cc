@@ -0,0 +1,91 @@
+// Echo server and client written as coroutines, see net/coroutine.h.
+//
+// The server runs a session coroutine per connection. In the same loop
+// a client coroutine connects, sends a few lines, reads every echo with
+// readUntil() and sleeps between them, then quits the loop.
+
+#include "../net/coroutine.h"
+#include "../net/event_loop.h"
+#include "../net/tcp_server.h"
+
+#include <glog/logging.h>
+
+#include <string>
+
+#include <stdio.h>
+
+using namespace mouse;
+
+namespace
+{
+
+const uint16_t kPort = 2036;
+
+coro::Task<> echoSession(coro::Connection conn)
+{
+    while (true)
+    {
+        std::string data = co_await conn.readSome();
+        if (data.empty() || !co_await conn.write(std::move(data)))
+        {
+            break;
+        }
+    }
+}
+
+void onConnection(const TcpConnectionPtr& conn)
+{
+    if (conn->connected())
+    {
+        coro::spawn(echoSession(coro::Connection(conn)));
+    }
+}
+
+coro::Task<int> sendLines(coro::Connection* conn, int lines)
+{
+    int echoed = 0;
+    for (int i = 0; i < lines; ++i)
+    {
+        std::string line = "line " + std::to_string(i) + "\r\n";
+        if (!co_await conn->write(line))
+        {
+            break;
+        }
+        std::string echo = co_await conn->readUntil("\r\n");
+        printf("echo: %s", echo.c_str());
+        if (echo == line)
+        {
+            ++echoed;
+        }
+        co_await coro::sleep(conn->tcpConnection()->loop(), 0.1);
+    }
+    co_return echoed;
+}
+
+coro::Task<> runClient(EventLoop* loop, int* result)
+{
+    coro::Connection conn = co_await coro::Connection::connect(
+            loop, InetAddress("127.0.0.1", kPort));
+    const int kLines = 5;
+    int echoed = co_await sendLines(&conn, kLines);
+    *result = echoed == kLines ? 0 : 1;
+    printf("%d of %d lines echoed: %s\n", echoed, kLines, *result == 0 ? "PASS" : "FAIL");
+    loop->quit();
+}
+
+}//namespace
+
+int main(int argc, char* argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    EventLoop loop;
+    TcpServer server(&loop, InetAddress(kPort));
+    server.setConnectionCallback(onConnection);
+    server.setMessageCallback([](const TcpConnectionPtr&, Buffer*, Timestamp) {});
+    server.start();
+
+    int result = 1;
+    coro::spawn(runClient(&loop, &result));
+    loop.startLoop();
+    return result;
+}
@@ -9,10 +9,10 @@
 
 using namespace mouse;
 
-/* void onHighWaterMark(const TcpConnectionPtr& conn, size_t len) */
-/* { */
-/*     LOG(INFO) << "HighWaterMark " << len; */
-/* } */
+void onHighWaterMark(const TcpConnectionPtr& conn, size_t len)
+{
+    LOG(INFO) << "HighWaterMark " << len;
+}
 
 const int kBufSize = 64*1024;
 const char* g_file = NULL;
@@ -27,7 +27,7 @@ void onConnection(const TcpConnectionPtr& conn)
     {
         LOG(INFO) << "FileServer - Sending file " << g_file
             << " to " << conn->peerAddress().toIpPort();
-        /* conn->setHighWaterMarkCallback(onHighWaterMark, kBufSize+1); */
+        conn->setHighWaterMarkCallback(onHighWaterMark, kBufSize+1);
 
         FILE* fp = ::fopen(g_file, "rb");
         if (fp)
@@ -0,0 +1,75 @@
+#ifndef MOUSE_TEST_FORK_CLIENT_H
+#define MOUSE_TEST_FORK_CLIENT_H
+
+#include "../base/timestamp.h"
+#include "../net/event_loop.h"
+#include "../net/inet_address.h"
+
+#include <functional>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Helpers of the tests that fork a client process and run the server in
+// the parent. The client starts first, it connects with retries until
+// the server listens.
+
+// Connects to @c server, retrying for a second, exits the client if that
+// fails.
+inline int connectServer(const mouse::InetAddress& server)
+{
+    for (int retry = 0; retry < 100; ++retry)
+    {
+        int sockfd = ::socket(server.family(), SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (::connect(sockfd, server.sockAddr(), server.sockLen()) == 0)
+        {
+            return sockfd;
+        }
+        ::close(sockfd);
+        ::usleep(10 * 1000);
+    }
+    ::perror("connect");
+    ::_exit(1);
+}
+
+inline int connectServer(uint16_t port)
+{
+    return connectServer(mouse::InetAddress("127.0.0.1", port));
+}
+
+// Spins for @c us microseconds, the cost of a message.
+inline void burn(int64_t us)
+{
+    mouse::Timestamp end(mouse::addTime(mouse::Timestamp::now(),
+                                        static_cast<double>(us) / 1e6));
+    while (mouse::Timestamp::now() < end)
+    {
+    }
+}
+
+// Waits for the client, true if it exited with 0.
+inline bool waitClient(pid_t client)
+{
+    int status = -1;
+    ::waitpid(client, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Quits @c loop once the client has exited, @c status may be NULL.
+inline void quitWithClient(mouse::EventLoop* loop, pid_t client, int* status)
+{
+    if (::waitpid(client, status, WNOHANG) == client)
+    {
+        loop->quit();
+    }
+    else
+    {
+        loop->runAfter(0.1, std::bind(quitWithClient, loop, client, status));
+    }
+}
+
+#endif
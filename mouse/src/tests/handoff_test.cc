@@ -0,0 +1,231 @@
+// Hot restart test, hands the listening socket and idle connections over
+// to a successor process with SCM_RIGHTS.
+//
+// A forked client keeps one idle connection and opens short echo
+// connections back to back. The old server passes its sockets to the
+// forked successor over a SOCK_SEQPACKET socketpair and stops accepting.
+// Every reply carries the name of the process which served it, the client
+// checks that the idle connection moved to the successor and no
+// connection was refused or reset across the handoff.
+
+#include "../net/event_loop.h"
+#include "../net/sockets_ops.h"
+#include "../net/tcp_server.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <signal.h>
+#include <stdio.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace mouse;
+
+namespace
+{
+
+const uint16_t kPort = 2033;
+const double kHandoffDelay = 0.5;
+const double kClientSeconds = 1.5;
+
+// first byte of handoff messages
+const char kListenFds = 'L';
+const char kConnectionFds = 'C';
+const char kDone = 'D';
+
+char g_generation = 'o';
+
+int connectServer()
+{
+    int sockfd = ::socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::connect(sockfd, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) < 0)
+    {
+        ::close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// returns the generation of the server, 0 on failure
+char echo(int sockfd)
+{
+    char c = 'x';
+    if (::write(sockfd, &c, 1) != 1 || ::read(sockfd, &c, 1) != 1)
+    {
+        return 0;
+    }
+    return c;
+}
+
+void runClient()
+{
+    int idle = -1;
+    for (int retry = 0; idle < 0 && retry < 100; ++retry)
+    {
+        ::usleep(10 * 1000);
+        idle = connectServer();
+    }
+    char before = echo(idle);
+
+    int served[2] = { 0, 0 };
+    int failed = 0;
+    Timestamp start(Timestamp::now());
+    while (timeDifference(Timestamp::now(), start) < kClientSeconds)
+    {
+        int sockfd = connectServer();
+        char generation = sockfd < 0 ? 0 : echo(sockfd);
+        if (generation == 'o' || generation == 'n')
+        {
+            ++served[generation == 'o' ? 0 : 1];
+        }
+        else
+        {
+            ++failed;
+        }
+        if (sockfd >= 0)
+        {
+            ::close(sockfd);
+        }
+    }
+
+    char after = echo(idle);
+    bool ok = before == 'o' && after == 'n' && failed == 0
+        && served[0] > 0 && served[1] > 0;
+    printf("idle connection served by %c then %c, short connections "
+           "old %d new %d failed %d: %s\n",
+           before, after, served[0], served[1], failed, ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    ::_exit(ok ? 0 : 1);
+}
+
+void onConnection(const TcpConnectionPtr& conn)
+{
+}
+
+void onMessage(const TcpConnectionPtr& conn, Buffer* buf, Timestamp)
+{
+    std::string reply(buf->readableBytes(), g_generation);
+    buf->retrieveAll();
+    conn->send(reply);
+}
+
+void sendFds(int channel, char type, const std::vector<int>& fds)
+{
+    size_t sent = 0;
+    do
+    {
+        int n = static_cast<int>(std::min<size_t>(fds.size() - sent,
+                                                   sockets::kMaxFdsPerMessage));
+        if (sockets::sendFds(channel, &type, 1, fds.data() + sent, n) < 0)
+        {
+            LOG(FATAL) << "sendFds";
+        }
+        sent += n;
+    } while (sent < fds.size());
+}
+
+void handOff(EventLoop* loop, TcpServer* server, int channel)
+{
+    sendFds(channel, kListenFds, server->listenFds());
+    // the successor accepts from now on, connections queued on the
+    // sockets are not lost
+    server->stopAccepting();
+    server->releaseIdleConnections(
+            std::bind(sendFds, channel, kConnectionFds, std::placeholders::_1));
+    loop->runAfter(0.1, [channel] {
+        sendFds(channel, kDone, std::vector<int>());
+    });
+    // served connections drain in time
+    loop->runAfter(0.5, std::bind(&EventLoop::quit, loop));
+}
+
+void runSuccessor(int channel)
+{
+    g_generation = 'n';
+    std::vector<int> listen_fds;
+    std::vector<int> connection_fds;
+    while (true)
+    {
+        char type = 0;
+        int fds[sockets::kMaxFdsPerMessage];
+        int fds_num = 0;
+        if (sockets::recvFds(channel, &type, 1, fds, sockets::kMaxFdsPerMessage, &fds_num) <= 0
+                || type == kDone)
+        {
+            break;
+        }
+        std::vector<int>* to = type == kListenFds ? &listen_fds : &connection_fds;
+        to->insert(to->end(), fds, fds + fds_num);
+    }
+    LOG(INFO) << "successor got " << listen_fds.size() << " listening sockets and "
+        << connection_fds.size() << " connections";
+
+    EventLoop loop;
+    TcpServer server(&loop, listen_fds);
+    server.setConnectionCallback(onConnection);
+    server.setMessageCallback(onMessage);
+    server.start();
+    for (size_t i = 0; i < connection_fds.size(); ++i)
+    {
+        server.adoptConnection(connection_fds[i]);
+    }
+    // killed by the test
+    loop.startLoop();
+}
+
+}//namespace
+
+int main(int argc, char* argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    int channels[2];
+    if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, channels) < 0)
+    {
+        LOG(FATAL) << "socketpair";
+    }
+
+    // fork before any EventLoop exists
+    pid_t successor = ::fork();
+    if (successor == 0)
+    {
+        ::close(channels[0]);
+        runSuccessor(channels[1]);
+        ::_exit(0);
+    }
+    ::close(channels[1]);
+    pid_t client = ::fork();
+    if (client == 0)
+    {
+        runClient();
+    }
+
+    {
+        EventLoop loop;
+        TcpServer server(&loop, InetAddress(kPort));
+        server.setConnectionCallback(onConnection);
+        server.setMessageCallback(onMessage);
+        server.start();
+        loop.runAfter(kHandoffDelay,
+                      std::bind(handOff, &loop, &server, channels[0]));
+        loop.startLoop();
+    }
+
+    int status = 0;
+    ::waitpid(client, &status, 0);
+    ::kill(successor, SIGTERM);
+    ::waitpid(successor, NULL, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,116 @@
+#ifndef MOUSE_TEST_HISTOGRAM_H
+#define MOUSE_TEST_HISTOGRAM_H
+
+#include <algorithm>
+#include <vector>
+
+#include <stdint.h>
+
+// Log-linear histogram in the way of HdrHistogram: values below 128 are
+// exact, above that every power of two is split into 64 buckets, so a
+// recorded value is off by less than 1.6%. Record costs a few
+// instructions and no allocation, histograms of different threads are
+// merged with add().
+class Histogram
+{
+public:
+    Histogram()
+      : counts_(kBucketsNum, 0),
+        count_(0),
+        sum_(0),
+        min_(INT64_MAX),
+        max_(0)
+    {
+    }
+
+    void record(int64_t value)
+    {
+        if (value < 0)
+        {
+            value = 0;
+        }
+        ++counts_[bucketOf(static_cast<uint64_t>(value))];
+        ++count_;
+        sum_ += value;
+        min_ = std::min(min_, value);
+        max_ = std::max(max_, value);
+    }
+
+    void add(const Histogram& other)
+    {
+        for (size_t i = 0; i < counts_.size(); ++i)
+        {
+            counts_[i] += other.counts_[i];
+        }
+        count_ += other.count_;
+        sum_ += other.sum_;
+        min_ = std::min(min_, other.min_);
+        max_ = std::max(max_, other.max_);
+    }
+
+    int64_t count() const { return count_; }
+    int64_t min() const { return count_ ? min_ : 0; }
+    int64_t max() const { return max_; }
+    double mean() const
+    { return count_ ? static_cast<double>(sum_) / static_cast<double>(count_) : 0.0; }
+
+    // the highest value of the bucket where @c percentile of the values
+    // are at or below, never above max()
+    int64_t percentile(double percentile) const
+    {
+        if (count_ == 0)
+        {
+            return 0;
+        }
+        int64_t rank = static_cast<int64_t>(
+                percentile / 100.0 * static_cast<double>(count_) + 0.5);
+        rank = std::max<int64_t>(1, std::min(rank, count_));
+        int64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); ++i)
+        {
+            seen += counts_[i];
+            if (seen >= rank)
+            {
+                return std::min(highestOf(i), max_);
+            }
+        }
+        return max_;
+    }
+
+private:
+    static const int kSubBits = 7;
+    static const uint64_t kSubBuckets = 1 << kSubBits;
+    static const uint64_t kHalf = kSubBuckets / 2;
+    static const size_t kBucketsNum = (64 - kSubBits + 2) * kHalf;
+
+    static size_t bucketOf(uint64_t value)
+    {
+        if (value < kSubBuckets)
+        {
+            return static_cast<size_t>(value);
+        }
+        // value >> shift is in [kHalf, kSubBuckets)
+        int shift = 63 - __builtin_clzll(value) - (kSubBits - 1);
+        return static_cast<size_t>(static_cast<uint64_t>(shift + 1) * kHalf
+                                   + (value >> shift) - kHalf);
+    }
+
+    static int64_t highestOf(size_t bucket)
+    {
+        if (bucket < kSubBuckets)
+        {
+            return static_cast<int64_t>(bucket);
+        }
+        int shift = static_cast<int>(bucket / kHalf) - 1;
+        uint64_t sub = bucket % kHalf + kHalf;
+        return static_cast<int64_t>(((sub + 1) << shift) - 1);
+    }
+
+    std::vector<int64_t> counts_;
+    int64_t count_;
+    int64_t sum_;
+    int64_t min_;
+    int64_t max_;
+};
+
+#endif  // MOUSE_TEST_HISTOGRAM_H
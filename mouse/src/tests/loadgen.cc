@@ -0,0 +1,365 @@
+// Load generator for echo servers, prints the result as one JSON object.
+//
+// Connections are spread over client loops, each loop runs in its own
+// thread. Two modes:
+//   ping-pong   every connection sends the next message as soon as the
+//               echo of the last one came back, latency is the round trip.
+//   open-loop   messages are sent at a fixed total rate whatever the
+//               server does, latency is counted from the time a message
+//               was due, so a stalled server is not hidden by a stalled
+//               client (coordinated omission). Messages are sent from a
+//               0.5 ms tick, which bounds the resolution of the schedule.
+// The first seconds of warm up are not measured.
+//
+// Without -a it forks an echo server on loopback with -S IO threads,
+// which logs nothing, so the numbers do not depend on glog settings.
+//
+// Usage: loadgen [-a server ip] [-p port] [-c connections] [-t client loops]
+//                [-s message size] [-d seconds] [-w warm up seconds]
+//                [-r total messages per second, open-loop] [-S server threads]
+
+#include "histogram.h"
+
+#include "../net/event_loop.h"
+#include "../net/event_loop_thread.h"
+#include "../net/tcp_client.h"
+#include "../net/tcp_server.h"
+
+#include <glog/logging.h>
+
+#include <atomic>
+#include <deque>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace mouse;
+
+namespace
+{
+
+struct Options
+{
+    std::string ip = "127.0.0.1";
+    bool embedded_server = true;
+    uint16_t port = 2007;
+    int connections = 16;
+    int loops = 1;
+    size_t message_size = 64;
+    double seconds = 5.0;
+    double warmup = 1.0;
+    double rate = 0.0;   // open-loop if > 0
+    int server_threads = 0;
+};
+
+Options g_options;
+std::atomic<int> g_connected(0);
+
+struct ClientLoop;
+
+struct Session
+{
+    ClientLoop* owner;
+    std::unique_ptr<TcpClient> client;
+    TcpConnectionPtr conn;
+    // due time of every message whose echo has not come back
+    std::deque<Timestamp> sent;
+    Timestamp next_due;
+};
+
+struct ClientLoop
+{
+    EventLoop* loop;
+    std::vector<std::unique_ptr<Session>> sessions;
+    std::string message;
+    double interval;   // between messages of a session, open-loop
+    Timestamp measure_start;
+    Timestamp measure_end;
+    bool running = false;
+    Histogram histogram;
+    int64_t errors = 0;
+};
+
+void sendMessage(Session* session, Timestamp due)
+{
+    session->sent.push_back(due);
+    session->conn->send(session->owner->message);
+}
+
+void onConnection(Session* session, const TcpConnectionPtr& conn)
+{
+    if (conn->connected())
+    {
+        conn->setTcpNoDelay(true);
+        session->conn = conn;
+        g_connected.fetch_add(1);
+    }
+    else
+    {
+        if (session->owner->running)
+        {
+            ++session->owner->errors;
+        }
+        session->conn.reset();
+        session->sent.clear();
+    }
+}
+
+void onMessage(Session* session, const TcpConnectionPtr& conn, Buffer* buf,
+               Timestamp receive_time)
+{
+    ClientLoop* owner = session->owner;
+    size_t size = owner->message.size();
+    while (buf->readableBytes() >= size && !session->sent.empty())
+    {
+        buf->retrieve(size);
+        Timestamp due = session->sent.front();
+        session->sent.pop_front();
+        // a message counts if it was due within the window
+        if (owner->running && owner->measure_start < due && due < owner->measure_end)
+        {
+            owner->histogram.record(receive_time.microsecondsSinceEpoch()
+                                    - due.microsecondsSinceEpoch());
+        }
+        if (owner->running && g_options.rate <= 0.0)
+        {
+            sendMessage(session, Timestamp::now());
+        }
+    }
+}
+
+// sends every message due by now, a late tick sends a burst to catch up
+void onTick(ClientLoop* client_loop)
+{
+    if (!client_loop->running)
+    {
+        return;
+    }
+    Timestamp now(Timestamp::now());
+    for (size_t i = 0; i < client_loop->sessions.size(); ++i)
+    {
+        Session* session = client_loop->sessions[i].get();
+        while (session->conn && !(now < session->next_due))
+        {
+            sendMessage(session, session->next_due);
+            session->next_due = addTime(session->next_due, client_loop->interval);
+        }
+    }
+}
+
+void connectInLoop(ClientLoop* client_loop, const InetAddress& server_addr, int num)
+{
+    for (int i = 0; i < num; ++i)
+    {
+        Session* session = new Session;
+        client_loop->sessions.push_back(std::unique_ptr<Session>(session));
+        session->owner = client_loop;
+        session->client.reset(new TcpClient(client_loop->loop, server_addr));
+        session->client->setConnectionCallback(
+                std::bind(onConnection, session, std::placeholders::_1));
+        session->client->setMessageCallback(
+                std::bind(onMessage, session, std::placeholders::_1,
+                          std::placeholders::_2, std::placeholders::_3));
+        session->client->connect();
+    }
+}
+
+void startInLoop(ClientLoop* client_loop, Timestamp start)
+{
+    client_loop->running = true;
+    client_loop->measure_start = addTime(start, g_options.warmup);
+    client_loop->measure_end = addTime(client_loop->measure_start, g_options.seconds);
+    size_t sessions_num = client_loop->sessions.size();
+    for (size_t i = 0; i < sessions_num; ++i)
+    {
+        Session* session = client_loop->sessions[i].get();
+        if (g_options.rate > 0.0)
+        {
+            // spread the sessions over the first interval
+            session->next_due = addTime(start, client_loop->interval
+                    * static_cast<double>(i) / static_cast<double>(sessions_num));
+        }
+        else if (session->conn)
+        {
+            sendMessage(session, Timestamp::now());
+        }
+    }
+    if (g_options.rate > 0.0)
+    {
+        client_loop->loop->runEvery(0.0005, std::bind(onTick, client_loop));
+    }
+}
+
+void stopInLoop(ClientLoop* client_loop, std::promise<void>* done)
+{
+    client_loop->running = false;
+    // TcpClient is destroyed in its loop thread
+    client_loop->sessions.clear();
+    done->set_value();
+}
+
+void onServerMessage(const TcpConnectionPtr& conn, Buffer* buf, Timestamp)
+{
+    conn->send(buf->retrieveAsString());
+}
+
+void runServer()
+{
+    EventLoop loop;
+    TcpServer server(&loop, InetAddress(g_options.port));
+    server.setThreadsNum(g_options.server_threads);
+    server.setConnectionCallback([](const TcpConnectionPtr&) {});
+    server.setMessageCallback(onServerMessage);
+    server.start();
+    // killed by the parent
+    loop.startLoop();
+}
+
+bool parseOptions(int argc, char* argv[])
+{
+    int opt;
+    while ((opt = ::getopt(argc, argv, "a:p:c:t:s:d:w:r:S:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'a': g_options.ip = optarg; g_options.embedded_server = false; break;
+            case 'p': g_options.port = static_cast<uint16_t>(atoi(optarg)); break;
+            case 'c': g_options.connections = atoi(optarg); break;
+            case 't': g_options.loops = atoi(optarg); break;
+            case 's': g_options.message_size = static_cast<size_t>(atol(optarg)); break;
+            case 'd': g_options.seconds = atof(optarg); break;
+            case 'w': g_options.warmup = atof(optarg); break;
+            case 'r': g_options.rate = atof(optarg); break;
+            case 'S': g_options.server_threads = atoi(optarg); break;
+            default: return false;
+        }
+    }
+    return g_options.connections > 0 && g_options.loops > 0
+        && g_options.message_size > 0 && g_options.seconds > 0.0;
+}
+
+void printResult(const Histogram& histogram, int64_t errors)
+{
+    double messages_per_second = static_cast<double>(histogram.count()) / g_options.seconds;
+    printf("{\n");
+    printf("  \"mode\": \"%s\",\n", g_options.rate > 0.0 ? "open-loop" : "ping-pong");
+    printf("  \"server\": \"%s:%u\",\n", g_options.ip.c_str(), g_options.port);
+    printf("  \"connections\": %d,\n", g_options.connections);
+    printf("  \"client_loops\": %d,\n", g_options.loops);
+    printf("  \"message_size\": %zu,\n", g_options.message_size);
+    printf("  \"seconds\": %.3f,\n", g_options.seconds);
+    printf("  \"target_rate\": %.0f,\n", g_options.rate);
+    printf("  \"messages\": %lld,\n", static_cast<long long>(histogram.count()));
+    printf("  \"errors\": %lld,\n", static_cast<long long>(errors));
+    printf("  \"messages_per_second\": %.1f,\n", messages_per_second);
+    printf("  \"mib_per_second\": %.3f,\n",
+           messages_per_second * static_cast<double>(g_options.message_size) / (1024 * 1024));
+    printf("  \"latency_us\": {\n");
+    printf("    \"min\": %lld,\n", static_cast<long long>(histogram.min()));
+    printf("    \"mean\": %.1f,\n", histogram.mean());
+    static const struct { const char* name; double percentile; } percentiles[] = {
+        { "p50", 50.0 }, { "p90", 90.0 }, { "p99", 99.0 },
+        { "p99.9", 99.9 }, { "p99.99", 99.99 },
+    };
+    for (size_t i = 0; i < sizeof percentiles / sizeof percentiles[0]; ++i)
+    {
+        printf("    \"%s\": %lld,\n", percentiles[i].name,
+               static_cast<long long>(histogram.percentile(percentiles[i].percentile)));
+    }
+    printf("    \"max\": %lld\n", static_cast<long long>(histogram.max()));
+    printf("  }\n");
+    printf("}\n");
+    fflush(stdout);
+}
+
+}//namespace
+
+int main(int argc, char* argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    if (!parseOptions(argc, argv))
+    {
+        fprintf(stderr, "Usage: %s [-a server ip] [-p port] [-c connections] "
+                "[-t client loops] [-s message size] [-d seconds] [-w warm up seconds] "
+                "[-r total messages per second] [-S server threads]\n", argv[0]);
+        return 1;
+    }
+
+    // fork before any thread is started
+    pid_t server = -1;
+    if (g_options.embedded_server)
+    {
+        server = ::fork();
+        if (server == 0)
+        {
+            runServer();
+            ::_exit(0);
+        }
+    }
+
+    InetAddress server_addr(g_options.ip, g_options.port);
+    std::vector<std::unique_ptr<EventLoopThread>> threads;
+    std::vector<std::unique_ptr<ClientLoop>> client_loops;
+    for (int i = 0; i < g_options.loops; ++i)
+    {
+        threads.push_back(std::unique_ptr<EventLoopThread>(new EventLoopThread));
+        ClientLoop* client_loop = new ClientLoop;
+        client_loops.push_back(std::unique_ptr<ClientLoop>(client_loop));
+        client_loop->loop = threads.back()->startLoop();
+        client_loop->message.assign(g_options.message_size, 'x');
+        int num = g_options.connections / g_options.loops
+            + (i < g_options.connections % g_options.loops ? 1 : 0);
+        client_loop->interval = g_options.rate > 0.0
+            ? static_cast<double>(g_options.connections) / g_options.rate : 0.0;
+        client_loop->loop->runInLoop(
+                std::bind(connectInLoop, client_loop, server_addr, num));
+    }
+
+    // Connector retries until the embedded server listens
+    for (int retry = 0; g_connected.load() < g_options.connections; ++retry)
+    {
+        if (retry == 1000)
+        {
+            fprintf(stderr, "only %d of %d connections up\n",
+                    g_connected.load(), g_options.connections);
+            break;
+        }
+        ::usleep(10 * 1000);
+    }
+
+    Timestamp start(Timestamp::now());
+    for (size_t i = 0; i < client_loops.size(); ++i)
+    {
+        client_loops[i]->loop->runInLoop(
+                std::bind(startInLoop, client_loops[i].get(), start));
+    }
+    ::usleep(static_cast<useconds_t>((g_options.warmup + g_options.seconds) * 1e6));
+
+    Histogram histogram;
+    int64_t errors = 0;
+    for (size_t i = 0; i < client_loops.size(); ++i)
+    {
+        std::promise<void> done;
+        client_loops[i]->loop->runInLoop(
+                std::bind(stopInLoop, client_loops[i].get(), &done));
+        done.get_future().wait();
+        // the loop does not touch the histogram any more
+        histogram.add(client_loops[i]->histogram);
+        errors += client_loops[i]->errors;
+    }
+    threads.clear();
+    printResult(histogram, errors);
+
+    if (server > 0)
+    {
+        ::kill(server, SIGTERM);
+        ::waitpid(server, NULL, 0);
+    }
+}
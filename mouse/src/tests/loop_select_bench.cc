@@ -0,0 +1,230 @@
+// Skewed workload benchmark of IO loop selection strategies.
+//
+// A forked client opens connections in groups of kLoopsNum, the first
+// connection of every group is heavy (every request burns kHeavyCostUs of
+// server CPU and it sends them back to back), the others are light
+// ping-pong connections. Round-robin and least connections put all heavy
+// connections on the same loop, least loaded sees that loop is busy.
+// Reports round trip latency of the light connections and how heavy
+// connections were spread for every strategy. Needs more CPU cores than
+// kLoopsNum, otherwise the loops compete for the same core anyway.
+//
+// Usage: loop_select_bench [seconds]
+
+#include "../net/event_loop.h"
+#include "../net/tcp_server.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace mouse;
+
+namespace
+{
+
+const uint16_t kPort = 2031;
+const int kLoopsNum = 4;
+const int kGroupsNum = 6;
+const int64_t kHeavyCostUs = 300;
+// lets the loop metrics catch up before the next group connects
+const useconds_t kGroupIntervalUs = 100 * 1000;
+const useconds_t kLightThinkUs = 1000;
+
+double g_seconds = 3.0;
+std::mutex g_mutex;
+std::map<EventLoop*, std::set<uint64_t>> g_heavy; // @GuardedBy g_mutex
+
+int connectServer()
+{
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int retry = 0; retry < 100; ++retry)
+    {
+        int sockfd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (::connect(sockfd, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) == 0)
+        {
+            return sockfd;
+        }
+        ::close(sockfd);
+        ::usleep(10 * 1000);
+    }
+    ::perror("connect");
+    ::_exit(1);
+}
+
+bool roundTrip(int sockfd, char request)
+{
+    char buf[2] = { request, '\n' };
+    if (::write(sockfd, buf, sizeof buf) != sizeof buf)
+    {
+        return false;
+    }
+    return ::read(sockfd, buf, sizeof buf) == sizeof buf;
+}
+
+void runClient(const char* strategy_name)
+{
+    std::atomic<bool> stop(false);
+    std::vector<std::vector<int64_t>> latencies(kGroupsNum * (kLoopsNum - 1));
+    std::vector<std::thread> threads;
+
+    for (int group = 0; group < kGroupsNum; ++group)
+    {
+        for (int i = 0; i < kLoopsNum; ++i)
+        {
+            int sockfd = connectServer();
+            if (i == 0)
+            {
+                threads.push_back(std::thread([sockfd, &stop] {
+                    while (!stop && roundTrip(sockfd, 'H'))
+                    {
+                    }
+                    ::close(sockfd);
+                }));
+            }
+            else
+            {
+                std::vector<int64_t>* result = &latencies[group * (kLoopsNum - 1) + i - 1];
+                threads.push_back(std::thread([sockfd, result, &stop] {
+                    while (!stop)
+                    {
+                        Timestamp start(Timestamp::now());
+                        if (!roundTrip(sockfd, 'L'))
+                        {
+                            break;
+                        }
+                        result->push_back(Timestamp::now().microsecondsSinceEpoch()
+                                          - start.microsecondsSinceEpoch());
+                        ::usleep(kLightThinkUs);
+                    }
+                    ::close(sockfd);
+                }));
+            }
+        }
+        ::usleep(kGroupIntervalUs);
+    }
+
+    ::usleep(static_cast<useconds_t>(g_seconds * 1000 * 1000));
+    stop = true;
+    for (size_t i = 0; i < threads.size(); ++i)
+    {
+        threads[i].join();
+    }
+
+    std::vector<int64_t> all;
+    for (size_t i = 0; i < latencies.size(); ++i)
+    {
+        all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+    }
+    std::sort(all.begin(), all.end());
+    if (all.empty())
+    {
+        ::_exit(1);
+    }
+    printf("%-18s requests %zu  p50 %lld us  p99 %lld us  max %lld us\n",
+           strategy_name, all.size(),
+           static_cast<long long>(all[all.size() / 2]),
+           static_cast<long long>(all[all.size() * 99 / 100]),
+           static_cast<long long>(all.back()));
+    fflush(stdout);
+    ::_exit(0);
+}
+
+void onConnection(const TcpConnectionPtr& conn)
+{
+}
+
+void onMessage(const TcpConnectionPtr& conn, Buffer* buf, Timestamp)
+{
+    while (buf->readableBytes() >= 2)
+    {
+        if (*buf->peek() == 'H')
+        {
+            {
+                std::lock_guard<std::mutex> lock(g_mutex);
+                g_heavy[conn->loop()].insert(conn->id());
+            }
+            Timestamp start(Timestamp::now());
+            while (Timestamp::now().microsecondsSinceEpoch()
+                   - start.microsecondsSinceEpoch() < kHeavyCostUs)
+            {
+            }
+        }
+        conn->send(std::string(buf->peek(), 2));
+        buf->retrieve(2);
+    }
+}
+
+void checkClient(EventLoop* loop, pid_t client)
+{
+    if (::waitpid(client, NULL, WNOHANG) == client)
+    {
+        loop->quit();
+    }
+}
+
+void runRound(EventLoopThreadPool::Strategy strategy, const char* strategy_name)
+{
+    // fork before IO threads are started
+    pid_t client = ::fork();
+    if (client == 0)
+    {
+        runClient(strategy_name);
+    }
+
+    EventLoop loop;
+    TcpServer server(&loop, InetAddress(kPort));
+    server.setThreadsNum(kLoopsNum);
+    server.setLoopSelectStrategy(strategy);
+    server.setConnectionCallback(onConnection);
+    server.setMessageCallback(onMessage);
+    server.start();
+    loop.runEvery(0.1, std::bind(checkClient, &loop, client));
+    loop.startLoop();
+
+    std::lock_guard<std::mutex> lock(g_mutex);
+    printf("%-18s heavy connections per loop:", "");
+    for (std::map<EventLoop*, std::set<uint64_t>>::iterator it = g_heavy.begin();
+            it != g_heavy.end(); ++it)
+    {
+        printf(" %zu", it->second.size());
+    }
+    printf("\n");
+    fflush(stdout);
+    g_heavy.clear();
+}
+
+}//namespace
+
+int main(int argc, char* argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    if (argc > 1)
+    {
+        g_seconds = atof(argv[1]);
+    }
+
+    runRound(EventLoopThreadPool::kRoundRobin, "round-robin");
+    runRound(EventLoopThreadPool::kLeastConnections, "least-connections");
+    runRound(EventLoopThreadPool::kLeastLoaded, "least-loaded");
+}
@@ -0,0 +1,173 @@
+// Loop to loop messaging benchmark, every one of N loops sends to every
+// other one, through EventLoop::sendToLoop() mailboxes and through
+// runInLoop(). Every loop sends a batch to each peer per iteration,
+// a full mailbox is retried the next iteration. Reports messages per
+// second over all pairs and the wakeups (eventfd writes) it took.
+// With fewer cores than loops a producer that finds a small mailbox full
+// spins until the consumer gets the CPU, hence the large default.
+//
+// Usage: mailbox_bench [loops] [messages per pair] [mailbox capacity]
+
+#include "../net/event_loop.h"
+#include "../net/event_loop_thread.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace mouse;
+
+namespace
+{
+
+const int64_t kBatch = 64;
+
+int g_loops_num = 4;
+int64_t g_messages = 200000;
+size_t g_capacity = 16384;
+
+struct Shard
+{
+    EventLoop* loop;
+    std::vector<int64_t> sent;  // per peer
+    int64_t received;
+};
+
+struct Run
+{
+    bool mailbox;
+    std::vector<Shard> shards;
+    std::atomic<int> remaining;
+    std::promise<void> done;
+};
+
+void receive(Run* run, Shard* shard)
+{
+    if (++shard->received == g_messages * (g_loops_num - 1))
+    {
+        if (run->remaining.fetch_sub(1) == 1)
+        {
+            run->done.set_value();
+        }
+    }
+}
+
+void step(Run* run, Shard* shard)
+{
+    bool more = false;
+    for (size_t i = 0; i < run->shards.size(); ++i)
+    {
+        Shard* peer = &run->shards[i];
+        if (peer == shard)
+        {
+            continue;
+        }
+        int64_t batch_end = std::min(g_messages, shard->sent[i] + kBatch);
+        while (shard->sent[i] < batch_end)
+        {
+            EventLoop::Functor message = std::bind(receive, run, peer);
+            if (run->mailbox)
+            {
+                if (!shard->loop->sendToLoop(peer->loop, message))
+                {
+                    break;
+                }
+            }
+            else
+            {
+                peer->loop->runInLoop(message);
+            }
+            ++shard->sent[i];
+        }
+        more = more || shard->sent[i] < g_messages;
+    }
+    if (more)
+    {
+        shard->loop->queueAtIterationEnd(std::bind(step, run, shard));
+    }
+}
+
+long long wakeupWrites()
+{
+    // every wakeup is an 8 byte write(2) to an eventfd
+    long long syscw = -1;
+    FILE* fp = ::fopen("/proc/self/io", "r");
+    if (fp)
+    {
+        char line[128];
+        while (::fgets(line, sizeof line, fp))
+        {
+            if (::sscanf(line, "syscw: %lld", &syscw) == 1)
+            {
+                break;
+            }
+        }
+        ::fclose(fp);
+    }
+    return syscw;
+}
+
+void bench(const std::vector<EventLoop*>& loops, bool mailbox)
+{
+    Run run;
+    run.mailbox = mailbox;
+    run.remaining.store(g_loops_num);
+    for (size_t i = 0; i < loops.size(); ++i)
+    {
+        Shard shard;
+        shard.loop = loops[i];
+        shard.sent.assign(loops.size(), 0);
+        shard.received = 0;
+        run.shards.push_back(shard);
+    }
+
+    long long writes_start = wakeupWrites();
+    Timestamp start(Timestamp::now());
+    for (size_t i = 0; i < loops.size(); ++i)
+    {
+        loops[i]->runInLoop(std::bind(step, &run, &run.shards[i]));
+    }
+    run.done.get_future().wait();
+    double elapsed = timeDifference(Timestamp::now(), start);
+    long long writes = wakeupWrites() - writes_start;
+
+    double total = static_cast<double>(g_messages) * g_loops_num * (g_loops_num - 1);
+    printf("%-10s %d loops  %12.0f messages/s  %8.3f wakeups per message\n",
+           mailbox ? "mailbox" : "runInLoop", g_loops_num, total / elapsed,
+           static_cast<double>(writes) / total);
+}
+
+}//namespace
+
+int main(int argc, char* argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    g_loops_num = argc > 1 ? atoi(argv[1]) : g_loops_num;
+    g_messages = argc > 2 ? atoll(argv[2]) : g_messages;
+    g_capacity = argc > 3 ? static_cast<size_t>(atoll(argv[3])) : g_capacity;
+    if (g_loops_num < 2)
+    {
+        printf("needs at least 2 loops\n");
+        return 1;
+    }
+
+    std::vector<std::unique_ptr<EventLoopThread>> threads;
+    std::vector<EventLoop*> loops;
+    for (int i = 0; i < g_loops_num; ++i)
+    {
+        threads.push_back(std::unique_ptr<EventLoopThread>(new EventLoopThread));
+        loops.push_back(threads.back()->startLoop());
+        loops.back()->setMailboxCapacity(g_capacity);
+    }
+
+    bench(loops, false);
+    bench(loops, true);
+}
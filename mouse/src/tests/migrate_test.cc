@@ -0,0 +1,254 @@
+// Live connection migration between IO loops.
+//
+// Round 1: a forked client sends kClientLines lines while a server side
+// thread sends kServerLines numbered lines over the same connection and
+// the base loop moves the connection between the IO loops every
+// millisecond. The client checks the numbered lines arrive complete and
+// in order, the server checks every byte of the client arrived.
+//
+// Round 2: kBusyConnections busy connections all start on one IO loop,
+// every message costs the server kMessageCostUs of CPU. The rebalancer
+// has to spread them over the IO loops.
+
+#include "fork_client.h"
+
+#include "../net/buffer.h"
+#include "../net/event_loop.h"
+#include "../net/event_loop_thread_pool.h"
+#include "../net/tcp_server.h"
+
+#include <glog/logging.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace mouse;
+
+namespace
+{
+
+const uint16_t kPort = 2040;
+const int kThreads = 2;
+const int kClientLines = 20000;
+const int kServerLines = 100000;
+const char kClientLine[] = "client line\n";
+const int kBusyConnections = 4;
+const int64_t kMessageCostUs = 100;
+
+std::atomic<int64_t> g_bytes_received(0);
+std::unique_ptr<std::thread> g_sender;
+
+void runOrderClient()
+{
+    int sockfd = connectServer(kPort);
+    for (int i = 0; i < kClientLines; ++i)
+    {
+        if (::write(sockfd, kClientLine, sizeof kClientLine - 1) != sizeof kClientLine - 1)
+        {
+            ::_exit(1);
+        }
+    }
+
+    std::string pending;
+    int expected = 0;
+    char buf[65536];
+    while (expected < kServerLines)
+    {
+        ssize_t n = ::read(sockfd, buf, sizeof buf);
+        if (n <= 0)
+        {
+            printf("connection lost at line %d\n", expected);
+            ::_exit(1);
+        }
+        pending.append(buf, static_cast<size_t>(n));
+        size_t start = 0;
+        size_t eol;
+        while ((eol = pending.find('\n', start)) != std::string::npos)
+        {
+            int line = atoi(pending.c_str() + start);
+            if (line != expected)
+            {
+                printf("line %d where %d is expected\n", line, expected);
+                ::_exit(1);
+            }
+            ++expected;
+            start = eol + 1;
+        }
+        pending.erase(0, start);
+    }
+    ::_exit(0);
+}
+
+void runBusyClient()
+{
+    std::vector<int> sockfds;
+    for (int i = 0; i < kBusyConnections; ++i)
+    {
+        sockfds.push_back(connectServer(kPort));
+    }
+    // until the server closes
+    for (;;)
+    {
+        for (size_t i = 0; i < sockfds.size(); ++i)
+        {
+            if (::write(sockfds[i], kClientLine, sizeof kClientLine - 1) <= 0)
+            {
+                ::_exit(0);
+            }
+        }
+        ::usleep(100);
+    }
+}
+
+void sendLines(const TcpConnectionPtr& conn)
+{
+    // from a thread of its own, the connection moves underneath
+    for (int i = 0; i < kServerLines; ++i)
+    {
+        conn->send(std::to_string(i) + "\n");
+    }
+}
+
+void onOrderConnection(const TcpConnectionPtr& conn)
+{
+    if (conn->connected())
+    {
+        g_sender.reset(new std::thread(sendLines, conn));
+    }
+}
+
+void onOrderMessage(const TcpConnectionPtr&, Buffer* buf, Timestamp)
+{
+    g_bytes_received.fetch_add(static_cast<int64_t>(buf->readableBytes()));
+    buf->retrieveAll();
+}
+
+void moveConnection(TcpServer* server, const std::weak_ptr<TcpConnection>& weak_conn)
+{
+    TcpConnectionPtr conn(weak_conn.lock());
+    if (!conn)
+    {
+        return;
+    }
+    std::vector<EventLoop*> loops(server->threadPool()->getAllLoops());
+    EventLoop* target = conn->loop() == loops[0] ? loops[1] : loops[0];
+    server->migrateConnection(conn, target);
+}
+
+void onBusyMessage(const TcpConnectionPtr&, Buffer* buf, Timestamp)
+{
+    buf->retrieveAll();
+    burn(kMessageCostUs);
+}
+
+bool orderRound()
+{
+    pid_t client = ::fork();
+    if (client == 0)
+    {
+        runOrderClient();
+    }
+
+    int status = -1;
+    int64_t migrations = 0;
+    {
+        EventLoop loop;
+        TcpServer server(&loop, InetAddress(kPort));
+        server.setThreadsNum(kThreads);
+        std::weak_ptr<TcpConnection> weak_conn;
+        server.setConnectionCallback([&weak_conn](const TcpConnectionPtr& conn) {
+            weak_conn = conn;
+            onOrderConnection(conn);
+        });
+        server.setMessageCallback(onOrderMessage);
+        server.start();
+        loop.runEvery(0.001, [&server, &weak_conn] { moveConnection(&server, weak_conn); });
+        loop.runEvery(0.01, [&loop, &status, client] {
+            if (::waitpid(client, &status, WNOHANG) == client)
+            {
+                loop.quit();
+            }
+        });
+        loop.startLoop();
+        g_sender->join();
+        migrations = server.migrations();
+    }
+
+    int64_t expected_bytes = static_cast<int64_t>(kClientLines * (sizeof kClientLine - 1));
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0
+              && g_bytes_received.load() == expected_bytes && migrations > 0;
+    printf("%d lines in order over %lld migrations, %lld of %lld bytes received: %s\n",
+           kServerLines, static_cast<long long>(migrations),
+           static_cast<long long>(g_bytes_received.load()),
+           static_cast<long long>(expected_bytes), ok ? "PASS" : "FAIL");
+    return ok;
+}
+
+bool rebalanceRound()
+{
+    pid_t client = ::fork();
+    if (client == 0)
+    {
+        runBusyClient();
+    }
+
+    std::map<EventLoop*, int> spread;
+    {
+        EventLoop loop;
+        TcpServer server(&loop, InetAddress(kPort));
+        server.setThreadsNum(kThreads);
+        server.setRebalancing(0.2, 0.2);
+        std::vector<TcpConnectionPtr> conns;
+        // set before the first connection is accepted, read in IO threads
+        EventLoop* first = NULL;
+        server.setConnectionCallback([&server, &loop, &conns, &first](
+                    const TcpConnectionPtr& conn) {
+            if (conn->connected())
+            {
+                // all on the first IO loop
+                server.migrateConnection(conn, first);
+                loop.runInLoop([&conns, conn] { conns.push_back(conn); });
+            }
+        });
+        server.setMessageCallback(onBusyMessage);
+        server.start();
+        first = server.threadPool()->getAllLoops()[0];
+        loop.runAfter(3.0, [&loop, &conns, &spread] {
+            for (size_t i = 0; i < conns.size(); ++i)
+            {
+                ++spread[conns[i]->loop()];
+                conns[i]->forceClose();
+            }
+            loop.quit();
+        });
+        loop.startLoop();
+    }
+    ::waitpid(client, NULL, 0);
+
+    bool ok = spread.size() == static_cast<size_t>(kThreads);
+    printf("%d busy connections spread over %zu of %d loops: %s\n",
+           kBusyConnections, spread.size(), kThreads, ok ? "PASS" : "FAIL");
+    return ok;
+}
+
+}//namespace
+
+int main(int argc, char* argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    bool ok = orderRound();
+    ok = rebalanceRound() && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,464 @@
+// Microbenchmarks of Buffer, Poller, TimerQueue, queueInLoop and
+// Timestamp::now.
+//
+// Every benchmark is calibrated to run about kRunSeconds, then run
+// several times, the median time per operation is reported with the
+// spread of the runs, max minus min over median. Setup like creating
+// fds is not timed. Pin the process (taskset) for numbers stable enough
+// to compare builds, the cross thread benchmarks need 2 cores.
+//
+// Usage: mouse_bench [-j] [-r runs] [name filter]
+//   -j prints one JSON object instead of a table
+
+#include "../net/buffer.h"
+#include "../net/channel.h"
+#include "../net/event_loop.h"
+#include "../net/event_loop_thread.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace mouse;
+
+namespace
+{
+
+const double kRunSeconds = 0.1;
+
+// Runs the benchmark @c iterations times, returns the nanoseconds
+// the timed part took.
+typedef std::function<int64_t (int64_t iterations)> BenchmarkFunc;
+
+struct Benchmark
+{
+    std::string name;
+    BenchmarkFunc func;
+};
+
+struct Result
+{
+    std::string name;
+    int64_t iterations;
+    double ns_per_op;
+    double spread;
+};
+
+int64_t nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// an optimizer barrier for results of benchmarked code
+template <typename T>
+void doNotOptimize(const T& value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+Result runBenchmark(const Benchmark& benchmark, int runs)
+{
+    int64_t iterations = 1;
+    int64_t ns = benchmark.func(iterations);
+    while (static_cast<double>(ns) < kRunSeconds * 1e9 / 10 && iterations < (1LL << 40))
+    {
+        iterations *= 2;
+        ns = benchmark.func(iterations);
+    }
+    iterations = std::max<int64_t>(1, static_cast<int64_t>(
+            static_cast<double>(iterations) * kRunSeconds * 1e9 / static_cast<double>(ns)));
+
+    std::vector<double> ns_per_op;
+    for (int i = 0; i < runs; ++i)
+    {
+        ns_per_op.push_back(static_cast<double>(benchmark.func(iterations))
+                            / static_cast<double>(iterations));
+    }
+    std::sort(ns_per_op.begin(), ns_per_op.end());
+    Result result;
+    result.name = benchmark.name;
+    result.iterations = iterations;
+    result.ns_per_op = ns_per_op[ns_per_op.size() / 2];
+    result.spread = (ns_per_op.back() - ns_per_op.front()) / result.ns_per_op;
+    return result;
+}
+
+int64_t timestampNow(int64_t iterations)
+{
+    int64_t start = nowNs();
+    for (int64_t i = 0; i < iterations; ++i)
+    {
+        doNotOptimize(Timestamp::now());
+    }
+    return nowNs() - start;
+}
+
+// steady state, the buffer is emptied every time, no memory is moved
+int64_t bufferAppendRetrieve(size_t size, int64_t iterations)
+{
+    std::string data(size, 'x');
+    Buffer buf;
+    buf.append(data);
+    buf.retrieveAll();
+    int64_t start = nowNs();
+    for (int64_t i = 0; i < iterations; ++i)
+    {
+        buf.append(data);
+        doNotOptimize(buf.peek());
+        buf.retrieve(size);
+    }
+    return nowNs() - start;
+}
+
+// one byte is always left unread, so the reader index moves on and
+// makeSpace() moves the data to the front once the end is reached
+int64_t bufferAppendCompact(size_t size, int64_t iterations)
+{
+    std::string data(size, 'x');
+    Buffer buf;
+    buf.append("x", 1);
+    int64_t start = nowNs();
+    for (int64_t i = 0; i < iterations; ++i)
+    {
+        buf.append(data);
+        doNotOptimize(buf.peek());
+        buf.retrieve(size);
+    }
+    return nowNs() - start;
+}
+
+// a new buffer grows to 1 MiB, makeSpace() resizes it
+int64_t bufferGrow(size_t size, int64_t iterations)
+{
+    std::string data(size, 'x');
+    const int64_t appends_per_buffer = (1 << 20) / static_cast<int64_t>(size);
+    Buffer buf;
+    int64_t start = nowNs();
+    for (int64_t i = 0; i < iterations; ++i)
+    {
+        if (i % appends_per_buffer == 0)
+        {
+            Buffer fresh;
+            buf.swap(fresh);
+        }
+        buf.append(data);
+        doNotOptimize(buf.peek());
+    }
+    return nowNs() - start;
+}
+
+// the write to the socket pair is timed too
+int64_t bufferReadFd(size_t size, int64_t iterations)
+{
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        LOG(FATAL) << "socketpair";
+    }
+    std::string data(size, 'x');
+    Buffer buf;
+    int saved_errno = 0;
+    int64_t start = nowNs();
+    for (int64_t i = 0; i < iterations; ++i)
+    {
+        if (::write(fds[0], data.data(), size) != static_cast<ssize_t>(size))
+        {
+            LOG(FATAL) << "write";
+        }
+        size_t got = 0;
+        while (got < size)
+        {
+            got += static_cast<size_t>(buf.readFd(fds[1], &saved_errno));
+        }
+        buf.retrieveAll();
+    }
+    int64_t ns = nowNs() - start;
+    ::close(fds[0]);
+    ::close(fds[1]);
+    return ns;
+}
+
+struct EventFds
+{
+    EventFds(EventLoop* loop, int num)
+    {
+        for (int i = 0; i < num; ++i)
+        {
+            int fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (fd < 0)
+            {
+                LOG(FATAL) << "eventfd";
+            }
+            channels.push_back(std::unique_ptr<Channel>(new Channel(loop, fd)));
+            channels.back()->enableReading();
+        }
+    }
+
+    ~EventFds()
+    {
+        for (size_t i = 0; i < channels.size(); ++i)
+        {
+            channels[i]->disableAll();
+            channels[i]->loop()->removeChannel(channels[i].get());
+            ::close(channels[i]->fd());
+        }
+    }
+
+    std::vector<std::unique_ptr<Channel>> channels;
+};
+
+// an interest change of one channel among @c fds_num
+int64_t pollerUpdate(int fds_num, int64_t iterations)
+{
+    EventLoop loop;
+    EventFds fds(&loop, fds_num);
+    Channel* channel = fds.channels[fds_num / 2].get();
+    int64_t start = nowNs();
+    for (int64_t i = 0; i < iterations; ++i)
+    {
+        channel->enableWriting();
+        channel->disableWriting();
+    }
+    return (nowNs() - start) / 2;
+}
+
+// a loop iteration with one ready channel among @c fds_num, poll(2)
+// scans all of them
+int64_t pollDispatch(int fds_num, int64_t iterations)
+{
+    EventLoop loop;
+    EventFds fds(&loop, fds_num);
+    Channel* ready = fds.channels.back().get();
+    uint64_t one = 1;
+    if (::write(ready->fd(), &one, sizeof one) != sizeof one)
+    {
+        LOG(FATAL) << "write";
+    }
+    int64_t events = 0;
+    // never read, it stays ready
+    ready->setReadCallback([&](Timestamp) {
+        if (++events == iterations)
+        {
+            loop.quit();
+        }
+    });
+    int64_t start = nowNs();
+    loop.startLoop();
+    return nowNs() - start;
+}
+
+int64_t timerAdd(int64_t iterations)
+{
+    EventLoop loop;
+    std::vector<TimerId> timers;
+    timers.reserve(static_cast<size_t>(iterations));
+    int64_t start = nowNs();
+    for (int64_t i = 0; i < iterations; ++i)
+    {
+        // spread over the next hour, insertion is not always at the end
+        timers.push_back(loop.runAfter(3600.0 * static_cast<double>(i % 1024) / 1024,
+                                       [] {}));
+    }
+    int64_t ns = nowNs() - start;
+    for (size_t i = 0; i < timers.size(); ++i)
+    {
+        loop.cancel(timers[i]);
+    }
+    return ns;
+}
+
+int64_t timerCancel(int64_t iterations)
+{
+    EventLoop loop;
+    std::vector<TimerId> timers;
+    timers.reserve(static_cast<size_t>(iterations));
+    for (int64_t i = 0; i < iterations; ++i)
+    {
+        timers.push_back(loop.runAfter(3600.0 * static_cast<double>(i % 1024) / 1024,
+                                       [] {}));
+    }
+    int64_t start = nowNs();
+    for (size_t i = 0; i < timers.size(); ++i)
+    {
+        loop.cancel(timers[i]);
+    }
+    return nowNs() - start;
+}
+
+// timers expired together by one timerfd event
+int64_t timerExpire(int64_t iterations)
+{
+    EventLoop loop;
+    int64_t expired = 0;
+    for (int64_t i = 0; i < iterations; ++i)
+    {
+        loop.runAfter(0.0, [&] {
+            if (++expired == iterations)
+            {
+                loop.quit();
+            }
+        });
+    }
+    int64_t start = nowNs();
+    loop.startLoop();
+    return nowNs() - start;
+}
+
+// from another thread to the loop and back, including the eventfd wakeup
+int64_t queueInLoopLatency(int64_t iterations)
+{
+    EventLoopThread thread;
+    EventLoop* loop = thread.startLoop();
+    std::atomic<bool> done(false);
+    int64_t start = nowNs();
+    for (int64_t i = 0; i < iterations; ++i)
+    {
+        done.store(false, std::memory_order_relaxed);
+        loop->queueInLoop([&done] { done.store(true, std::memory_order_release); });
+        while (!done.load(std::memory_order_acquire))
+        {
+            // lets the loop thread run on a single core
+            ::sched_yield();
+        }
+    }
+    return nowNs() - start;
+}
+
+// functors queued back to back from another thread
+int64_t queueInLoopThroughput(int64_t iterations)
+{
+    EventLoopThread thread;
+    EventLoop* loop = thread.startLoop();
+    std::atomic<int64_t> run(0);
+    int64_t start = nowNs();
+    for (int64_t i = 0; i < iterations; ++i)
+    {
+        loop->queueInLoop([&run] { run.fetch_add(1, std::memory_order_relaxed); });
+    }
+    while (run.load(std::memory_order_relaxed) < iterations)
+    {
+        ::sched_yield();
+    }
+    return nowNs() - start;
+}
+
+std::vector<Benchmark> allBenchmarks()
+{
+    std::vector<Benchmark> benchmarks;
+    using std::placeholders::_1;
+    benchmarks.push_back({ "timestamp/now", timestampNow });
+
+    const size_t sizes[] = { 16, 256, 4096, 65536 };
+    for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; ++i)
+    {
+        std::string size = std::to_string(sizes[i]);
+        benchmarks.push_back({ "buffer/append_retrieve/" + size,
+                               std::bind(bufferAppendRetrieve, sizes[i], _1) });
+        benchmarks.push_back({ "buffer/append_compact/" + size,
+                               std::bind(bufferAppendCompact, sizes[i], _1) });
+        benchmarks.push_back({ "buffer/grow/" + size,
+                               std::bind(bufferGrow, sizes[i], _1) });
+        benchmarks.push_back({ "buffer/read_fd/" + size,
+                               std::bind(bufferReadFd, sizes[i], _1) });
+    }
+
+    struct rlimit limit;
+    ::getrlimit(RLIMIT_NOFILE, &limit);
+    const int fds_nums[] = { 16, 1024, 10000 };
+    for (size_t i = 0; i < sizeof fds_nums / sizeof fds_nums[0]; ++i)
+    {
+        if (static_cast<rlim_t>(fds_nums[i]) + 64 > limit.rlim_cur)
+        {
+            fprintf(stderr, "skipped poller benchmarks of %d fds, "
+                    "open files are limited to %lu\n",
+                    fds_nums[i], static_cast<unsigned long>(limit.rlim_cur));
+            continue;
+        }
+        std::string num = std::to_string(fds_nums[i]);
+        benchmarks.push_back({ "poller/update/" + num,
+                               std::bind(pollerUpdate, fds_nums[i], _1) });
+        benchmarks.push_back({ "poller/dispatch/" + num,
+                               std::bind(pollDispatch, fds_nums[i], _1) });
+    }
+
+    benchmarks.push_back({ "timer/add", timerAdd });
+    benchmarks.push_back({ "timer/cancel", timerCancel });
+    benchmarks.push_back({ "timer/expire", timerExpire });
+    benchmarks.push_back({ "loop/queue_in_loop_latency", queueInLoopLatency });
+    benchmarks.push_back({ "loop/queue_in_loop_throughput", queueInLoopThroughput });
+    return benchmarks;
+}
+
+}//namespace
+
+int main(int argc, char* argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    bool json = false;
+    int runs = 5;
+    int opt;
+    while ((opt = ::getopt(argc, argv, "jr:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'j': json = true; break;
+            case 'r': runs = std::max(1, atoi(optarg)); break;
+            default:
+                fprintf(stderr, "Usage: %s [-j] [-r runs] [name filter]\n", argv[0]);
+                return 1;
+        }
+    }
+    const char* filter = optind < argc ? argv[optind] : "";
+
+    std::vector<Benchmark> benchmarks(allBenchmarks());
+    std::vector<Result> results;
+    if (!json)
+    {
+        printf("%-34s %12s %12s %8s\n", "benchmark", "iterations", "ns/op", "spread");
+    }
+    for (size_t i = 0; i < benchmarks.size(); ++i)
+    {
+        if (benchmarks[i].name.find(filter) == std::string::npos)
+        {
+            continue;
+        }
+        Result result(runBenchmark(benchmarks[i], runs));
+        results.push_back(result);
+        if (!json)
+        {
+            printf("%-34s %12lld %12.1f %7.1f%%\n", result.name.c_str(),
+                   static_cast<long long>(result.iterations), result.ns_per_op,
+                   result.spread * 100);
+            fflush(stdout);
+        }
+    }
+
+    if (json)
+    {
+        printf("{\n  \"runs\": %d,\n  \"benchmarks\": [\n", runs);
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            printf("    { \"name\": \"%s\", \"iterations\": %lld, \"ns_per_op\": %.2f, "
+                   "\"spread\": %.4f }%s\n",
+                   results[i].name.c_str(), static_cast<long long>(results[i].iterations),
+                   results[i].ns_per_op, results[i].spread,
+                   i + 1 < results.size() ? "," : "");
+        }
+        printf("  ]\n}\n");
+    }
+}
@@ -0,0 +1,197 @@
+// Pipelined request/response benchmark.
+//
+// The server answers every request with three separate sends (header, body,
+// trailer), a forked client writes requests in pipelined batches.
+// For both immediate and deferred flush it reports write syscalls of the
+// server process (from /proc/self/io) and data segments the client received
+// (from TCP_INFO) per request.
+
+#include "../net/event_loop.h"
+#include "../net/tcp_server.h"
+
+#include <glog/logging.h>
+
+#include <functional>
+#include <string>
+
+#include <arpa/inet.h>
+#include <linux/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace mouse;
+
+namespace
+{
+
+const uint16_t kPort = 2027;
+const size_t kRequestSize = 16;
+const int kPipelineDepth = 16;
+const int kBatches = 2000;
+
+EventLoop* g_loop = NULL;
+bool g_deferred = false;
+int g_result_fd = -1;
+pid_t g_client = -1;
+long long g_syscw_start = 0;
+
+long long writeSyscalls()
+{
+    long long syscw = -1;
+    FILE* fp = ::fopen("/proc/self/io", "r");
+    if (fp)
+    {
+        char line[128];
+        while (::fgets(line, sizeof line, fp))
+        {
+            if (::sscanf(line, "syscw: %lld", &syscw) == 1)
+            {
+                break;
+            }
+        }
+        ::fclose(fp);
+    }
+    return syscw;
+}
+
+void runClient(int result_fd)
+{
+    int sockfd = ::socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::connect(sockfd, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) < 0)
+    {
+        ::perror("connect");
+        ::_exit(1);
+    }
+
+    std::string batch;
+    for (int i = 0; i < kPipelineDepth; ++i)
+    {
+        batch += std::string(kRequestSize - 1, 'q') + "\n";
+    }
+    char buf[65536];
+    for (int i = 0; i < kBatches; ++i)
+    {
+        if (::write(sockfd, batch.data(), batch.size()) != static_cast<ssize_t>(batch.size()))
+        {
+            ::_exit(1);
+        }
+        int responses = 0;
+        while (responses < kPipelineDepth)
+        {
+            ssize_t n = ::read(sockfd, buf, sizeof buf);
+            if (n <= 0)
+            {
+                ::_exit(1);
+            }
+            for (ssize_t j = 0; j < n; ++j)
+            {
+                // every response ends with the only '!' of the stream
+                if (buf[j] == '!')
+                {
+                    ++responses;
+                }
+            }
+        }
+    }
+
+    struct tcp_info info;
+    socklen_t len = sizeof info;
+    bzero(&info, sizeof info);
+    ::getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &len);
+    long long segs = info.tcpi_data_segs_in;
+    ssize_t n = ::write(result_fd, &segs, sizeof segs);
+    (void)n;
+    ::close(sockfd);
+    ::_exit(0);
+}
+
+void startClient()
+{
+    int fds[2];
+    if (::pipe(fds) < 0)
+    {
+        LOG(FATAL) << "pipe";
+    }
+    g_client = ::fork();
+    if (g_client == 0)
+    {
+        ::close(fds[0]);
+        runClient(fds[1]);
+    }
+    ::close(fds[1]);
+    g_result_fd = fds[0];
+}
+
+void onConnection(const TcpConnectionPtr& conn)
+{
+    if (conn->connected())
+    {
+        conn->setDeferredFlush(g_deferred);
+        conn->setTcpNoDelay(true);
+        g_syscw_start = writeSyscalls();
+        return;
+    }
+
+    long long syscw = writeSyscalls() - g_syscw_start;
+    long long segs = 0;
+    if (::read(g_result_fd, &segs, sizeof segs) != sizeof segs)
+    {
+        LOG(ERROR) << "client failed";
+    }
+    ::close(g_result_fd);
+    ::waitpid(g_client, NULL, 0);
+
+    double requests = static_cast<double>(kBatches) * kPipelineDepth;
+    printf("%-10s requests %.0f  write syscalls/request %.3f  packets/request %.3f\n",
+           g_deferred ? "deferred" : "immediate", requests,
+           static_cast<double>(syscw) / requests,
+           static_cast<double>(segs) / requests);
+
+    if (!g_deferred)
+    {
+        g_deferred = true;
+        // start next round when this connection is gone
+        g_loop->queueInLoop(startClient);
+    }
+    else
+    {
+        g_loop->quit();
+    }
+}
+
+void onMessage(const TcpConnectionPtr& conn, Buffer* buf, Timestamp)
+{
+    const std::string body(64, 'b');
+    while (buf->readableBytes() >= kRequestSize)
+    {
+        buf->retrieve(kRequestSize);
+        conn->send("HTTP/1.1 200 OK\r\nContent-Length: 64\r\n\r\n");
+        conn->send(body);
+        conn->send("!END\n");
+    }
+}
+
+}//namespace
+
+int main(int argc, char* argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    EventLoop loop;
+    g_loop = &loop;
+    TcpServer server(&loop, InetAddress(kPort));
+    server.setConnectionCallback(onConnection);
+    server.setMessageCallback(onMessage);
+    server.start();
+    loop.runInLoop(startClient);
+    loop.startLoop();
+}
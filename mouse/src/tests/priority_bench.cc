@@ -0,0 +1,175 @@
+// Priority lanes benchmark, a control connection next to bulk uploads
+// on one loop.
+//
+// A forked client opens kBulkConnections that write as fast as they can,
+// every message callback of them costs the server kBulkCostUs of CPU,
+// and one control connection that sends a small request every
+// millisecond and waits for the echo. The round trip latency of the
+// control connection is reported
+//   - with every connection at normal priority,
+//   - with the bulk connections at low priority and a budget of
+//     kBudgetUs per iteration for them.
+//
+// Usage: priority_bench [seconds]
+
+#include "fork_client.h"
+#include "histogram.h"
+
+#include "../net/buffer.h"
+#include "../net/event_loop.h"
+#include "../net/tcp_server.h"
+
+#include <glog/logging.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace mouse;
+
+namespace
+{
+
+const uint16_t kPort = 2038;
+const int kBulkConnections = 8;
+const int64_t kBulkCostUs = 200;
+const double kBudgetUs = 200;
+const size_t kBulkWriteSize = 64 * 1024;
+const size_t kRequestSize = 16;
+const useconds_t kControlThinkUs = 1000;
+
+double g_seconds = 3.0;
+bool g_prioritize = false;
+std::map<uint64_t, bool> g_bulk; // by connection id
+
+void runBulk(int sockfd, const std::atomic<bool>* stop)
+{
+    std::string data(kBulkWriteSize, 'b');
+    data[0] = 'B';
+    while (!stop->load() && ::write(sockfd, data.data(), data.size()) > 0)
+    {
+        data[0] = 'b';
+    }
+}
+
+void runClient()
+{
+    std::atomic<bool> stop(false);
+    std::vector<std::unique_ptr<std::thread>> bulks;
+    std::vector<int> bulk_fds;
+    for (int i = 0; i < kBulkConnections; ++i)
+    {
+        bulk_fds.push_back(connectServer(kPort));
+        bulks.push_back(std::unique_ptr<std::thread>(
+                new std::thread(runBulk, bulk_fds.back(), &stop)));
+    }
+
+    int sockfd = connectServer(kPort);
+    std::string request(kRequestSize, 'c');
+    request[0] = 'C';
+    char response[kRequestSize];
+    Histogram latency;
+    Timestamp end(addTime(Timestamp::now(), g_seconds));
+    while (Timestamp::now() < end)
+    {
+        Timestamp start(Timestamp::now());
+        size_t received = 0;
+        if (::write(sockfd, request.data(), request.size()) != static_cast<ssize_t>(request.size()))
+        {
+            ::_exit(1);
+        }
+        while (received < kRequestSize)
+        {
+            ssize_t n = ::read(sockfd, response + received, kRequestSize - received);
+            if (n <= 0)
+            {
+                ::_exit(1);
+            }
+            received += static_cast<size_t>(n);
+        }
+        latency.record(Timestamp::now().microsecondsSinceEpoch() - start.microsecondsSinceEpoch());
+        ::usleep(kControlThinkUs);
+    }
+
+    printf("%-28s round trips %6lld  p50 %6lld us  p99 %6lld us  max %6lld us\n",
+           g_prioritize ? "bulk low priority, budget" : "all normal priority",
+           static_cast<long long>(latency.count()),
+           static_cast<long long>(latency.percentile(50)),
+           static_cast<long long>(latency.percentile(99)),
+           static_cast<long long>(latency.max()));
+    fflush(stdout);
+    ::_exit(0);
+}
+
+void onConnection(const TcpConnectionPtr& conn)
+{
+    if (!conn->connected())
+    {
+        g_bulk.erase(conn->id());
+    }
+}
+
+void onMessage(const TcpConnectionPtr& conn, Buffer* buf, Timestamp)
+{
+    // the first byte of a connection tells what it is
+    std::map<uint64_t, bool>::iterator it = g_bulk.find(conn->id());
+    if (it == g_bulk.end())
+    {
+        it = g_bulk.insert(std::make_pair(conn->id(), *buf->peek() == 'B')).first;
+        if (it->second && g_prioritize)
+        {
+            conn->setPriority(Channel::kLowPriority);
+        }
+    }
+
+    if (it->second)
+    {
+        buf->retrieveAll();
+        burn(kBulkCostUs);
+    }
+    else
+    {
+        conn->send(buf->retrieveAsString());
+    }
+}
+
+}//namespace
+
+int main(int argc, char* argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    g_seconds = argc > 1 ? atof(argv[1]) : g_seconds;
+
+    for (int round = 0; round < 2; ++round)
+    {
+        g_prioritize = round == 1;
+        g_bulk.clear();
+        pid_t client = ::fork();
+        if (client == 0)
+        {
+            runClient();
+        }
+
+        EventLoop loop;
+        if (g_prioritize)
+        {
+            loop.setLowPriorityBudget(kBudgetUs / 1e6);
+        }
+        TcpServer server(&loop, InetAddress(kPort));
+        server.setConnectionCallback(onConnection);
+        server.setMessageCallback(onMessage);
+        server.start();
+        quitWithClient(&loop, client, NULL);
+        loop.startLoop();
+    }
+}
@@ -0,0 +1,244 @@
+// TCP relay benchmark on loopback.
+//
+// A forked source writes N MiB to the proxy, which forwards them to a forked
+// sink, first through user space buffers (message callback + send with high
+// water mark backpressure), then with TcpRelay and splice(2).
+// Reports throughput and CPU seconds of the proxy process per GiB.
+//
+// Usage: relay_bench [MiB]
+
+#include "../net/event_loop.h"
+#include "../net/tcp_relay.h"
+#include "../net/tcp_server.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace mouse;
+
+namespace
+{
+
+const uint16_t kSourcePort = 2029;
+const uint16_t kSinkPort = 2030;
+const size_t kHighWaterMark = 4 * 1024 * 1024;
+
+int64_t g_total_bytes = 1024LL * 1024 * 1024;
+EventLoop* g_loop = NULL;
+bool g_splice = false;
+pid_t g_source_pid = -1;
+pid_t g_sink_pid = -1;
+TcpConnectionPtr g_source;
+TcpConnectionPtr g_sink;
+TcpRelayPtr g_relay;
+Timestamp g_start;
+double g_cpu_start = 0.0;
+
+double cpuSeconds()
+{
+    struct rusage usage;
+    ::getrusage(RUSAGE_SELF, &usage);
+    return static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+        + static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+int connectTo(uint16_t port)
+{
+    int sockfd = ::socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::connect(sockfd, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) < 0)
+    {
+        ::perror("connect");
+        ::_exit(1);
+    }
+    return sockfd;
+}
+
+pid_t forkSource()
+{
+    pid_t pid = ::fork();
+    if (pid == 0)
+    {
+        int sockfd = connectTo(kSourcePort);
+        std::string chunk(64 * 1024, 's');
+        int64_t left = g_total_bytes;
+        while (left > 0)
+        {
+            size_t len = static_cast<size_t>(std::min<int64_t>(left, chunk.size()));
+            ssize_t n = ::write(sockfd, chunk.data(), len);
+            if (n <= 0)
+            {
+                ::_exit(1);
+            }
+            left -= n;
+        }
+        ::close(sockfd);
+        ::_exit(0);
+    }
+    return pid;
+}
+
+pid_t forkSink()
+{
+    pid_t pid = ::fork();
+    if (pid == 0)
+    {
+        int sockfd = connectTo(kSinkPort);
+        char buf[64 * 1024];
+        int64_t received = 0;
+        ssize_t n = 0;
+        while ((n = ::read(sockfd, buf, sizeof buf)) > 0)
+        {
+            received += n;
+        }
+        ::close(sockfd);
+        ::_exit(received == g_total_bytes ? 0 : 1);
+    }
+    return pid;
+}
+
+void finishRound()
+{
+    double seconds = timeDifference(Timestamp::now(), g_start);
+    double cpu = cpuSeconds() - g_cpu_start;
+    int source_status = 0;
+    int sink_status = 0;
+    ::waitpid(g_source_pid, &source_status, 0);
+    ::waitpid(g_sink_pid, &sink_status, 0);
+
+    double gib = static_cast<double>(g_total_bytes) / (1024.0 * 1024 * 1024);
+    printf("%-8s %.0f MiB in %.3f s  %.1f MiB/s  proxy cpu %.3f s/GiB%s\n",
+           g_splice ? "splice" : "buffered", gib * 1024, seconds,
+           gib * 1024 / seconds, cpu / gib,
+           (source_status == 0 && sink_status == 0) ? "" : "  (data lost!)");
+    g_relay.reset();
+
+    if (!g_splice)
+    {
+        g_splice = true;
+        g_sink_pid = forkSink();
+    }
+    else
+    {
+        g_loop->quit();
+    }
+}
+
+void onHighWaterMark(const TcpConnectionPtr& conn, size_t len)
+{
+    // the other side is faster than conn, throttle it
+    TcpConnectionPtr other = (conn == g_sink) ? g_source : g_sink;
+    if (other)
+    {
+        other->stopRead();
+    }
+}
+
+void onWriteComplete(const TcpConnectionPtr& conn)
+{
+    TcpConnectionPtr other = (conn == g_sink) ? g_source : g_sink;
+    if (other && !other->isReading())
+    {
+        other->startRead();
+    }
+}
+
+void onSinkConnection(const TcpConnectionPtr& conn)
+{
+    if (conn->connected())
+    {
+        g_sink = conn;
+        g_source_pid = forkSource();
+    }
+    else
+    {
+        g_sink.reset();
+        if (!g_source)
+        {
+            finishRound();
+        }
+    }
+}
+
+void onSourceConnection(const TcpConnectionPtr& conn)
+{
+    if (conn->connected())
+    {
+        g_source = conn;
+        g_start = Timestamp::now();
+        g_cpu_start = cpuSeconds();
+        if (g_splice)
+        {
+            g_relay.reset(new TcpRelay(g_source, g_sink));
+            g_relay->start();
+        }
+    }
+    else
+    {
+        g_source.reset();
+        if (g_sink)
+        {
+            // after the output buffer drains
+            g_sink->shutdown();
+        }
+        else
+        {
+            finishRound();
+        }
+    }
+}
+
+void onMessage(const TcpConnectionPtr& conn, Buffer* buf, Timestamp)
+{
+    TcpConnectionPtr other = (conn == g_sink) ? g_source : g_sink;
+    if (other)
+    {
+        other->send(std::string(buf->peek(), buf->readableBytes()));
+    }
+    buf->retrieveAll();
+}
+
+}//namespace
+
+int main(int argc, char* argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    if (argc > 1)
+    {
+        g_total_bytes = atoll(argv[1]) * 1024 * 1024;
+    }
+
+    EventLoop loop;
+    g_loop = &loop;
+    TcpServer source_server(&loop, InetAddress(kSourcePort));
+    TcpServer sink_server(&loop, InetAddress(kSinkPort));
+    source_server.setConnectionCallback(onSourceConnection);
+    sink_server.setConnectionCallback(onSinkConnection);
+    TcpServer* servers[] = { &source_server, &sink_server };
+    for (int i = 0; i < 2; ++i)
+    {
+        servers[i]->setMessageCallback(onMessage);
+        servers[i]->setHighWaterMarkCallback(onHighWaterMark, kHighWaterMark);
+        servers[i]->setWriteCompleteCallback(onWriteComplete);
+        servers[i]->start();
+    }
+
+    g_sink_pid = forkSink();
+    loop.startLoop();
+}
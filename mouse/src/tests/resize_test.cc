@@ -0,0 +1,211 @@
+// Resizing the IO loops of a running TcpServer.
+//
+// Round 1: a forked client keeps kConnections echo connections busy
+// while the server grows from 2 IO loops to 4, shrinks to 1 and grows
+// to 3. The client checks every echo, the server checks the pool size
+// and that no connection was lost.
+//
+// Round 2: with autoscaling, busy connections that cost the server
+// kMessageCostUs of CPU per message have to add IO loops, and the pool
+// has to shrink back to one loop once they are gone.
+
+#include "fork_client.h"
+
+#include "../net/buffer.h"
+#include "../net/event_loop.h"
+#include "../net/event_loop_thread_pool.h"
+#include "../net/tcp_server.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace mouse;
+
+namespace
+{
+
+const uint16_t kPort = 2041;
+const int kConnections = 16;
+const double kEchoSeconds = 3.0;
+const int kBusyConnections = 4;
+const double kBusySeconds = 2.0;
+const int64_t kMessageCostUs = 200;
+const char kLine[] = "resize me\n";
+
+void runEchoClient()
+{
+    std::vector<int> sockfds;
+    for (int i = 0; i < kConnections; ++i)
+    {
+        sockfds.push_back(connectServer(kPort));
+    }
+    long long echoes = 0;
+    Timestamp end(addTime(Timestamp::now(), kEchoSeconds));
+    while (Timestamp::now() < end)
+    {
+        for (size_t i = 0; i < sockfds.size(); ++i)
+        {
+            char buf[sizeof kLine];
+            size_t received = 0;
+            if (::write(sockfds[i], kLine, sizeof kLine - 1) != sizeof kLine - 1)
+            {
+                ::_exit(1);
+            }
+            while (received < sizeof kLine - 1)
+            {
+                ssize_t n = ::read(sockfds[i], buf + received, sizeof kLine - 1 - received);
+                if (n <= 0)
+                {
+                    printf("connection %zu lost after %lld echoes\n", i, echoes);
+                    ::_exit(1);
+                }
+                received += static_cast<size_t>(n);
+            }
+            if (::memcmp(buf, kLine, sizeof kLine - 1) != 0)
+            {
+                printf("bad echo\n");
+                ::_exit(1);
+            }
+            ++echoes;
+        }
+        ::usleep(1000);
+    }
+    printf("%lld echoes over %d connections\n", echoes, kConnections);
+    ::_exit(0);
+}
+
+void runBusyClient()
+{
+    std::vector<int> sockfds;
+    for (int i = 0; i < kBusyConnections; ++i)
+    {
+        sockfds.push_back(connectServer(kPort));
+    }
+    Timestamp end(addTime(Timestamp::now(), kBusySeconds));
+    while (Timestamp::now() < end)
+    {
+        for (size_t i = 0; i < sockfds.size(); ++i)
+        {
+            if (::write(sockfds[i], kLine, sizeof kLine - 1) <= 0)
+            {
+                ::_exit(1);
+            }
+        }
+        ::usleep(100);
+    }
+    ::_exit(0);
+}
+
+void onEcho(const TcpConnectionPtr& conn, Buffer* buf, Timestamp)
+{
+    conn->send(buf->retrieveAsString());
+}
+
+void onBusyMessage(const TcpConnectionPtr&, Buffer* buf, Timestamp)
+{
+    buf->retrieveAll();
+    burn(kMessageCostUs);
+}
+
+bool resizeRound()
+{
+    pid_t client = ::fork();
+    if (client == 0)
+    {
+        runEchoClient();
+    }
+
+    std::vector<size_t> sizes;
+    int connections = 0;
+    int status = -1;
+    int64_t migrations = 0;
+    {
+        EventLoop loop;
+        TcpServer server(&loop, InetAddress(kPort));
+        server.setThreadsNum(2);
+        server.setConnectionCallback([](const TcpConnectionPtr&) {});
+        server.setMessageCallback(onEcho);
+        server.start();
+        const int kSizes[] = { 4, 1, 3 };
+        for (size_t i = 0; i < sizeof kSizes / sizeof kSizes[0]; ++i)
+        {
+            loop.runAfter(0.5 + 0.7 * static_cast<double>(i),
+                          std::bind(&TcpServer::resizeThreads, &server, kSizes[i]));
+            // after the retired loops are drained
+            loop.runAfter(0.9 + 0.7 * static_cast<double>(i), [&server, &sizes] {
+                sizes.push_back(server.threadPool()->getAllLoops().size());
+            });
+        }
+        // while the client still runs
+        loop.runAfter(kEchoSeconds - 0.2, [&server, &connections, &migrations] {
+            connections = server.admissionStats().connections;
+            migrations = server.migrations();
+        });
+        quitWithClient(&loop, client, &status);
+        loop.startLoop();
+    }
+
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0
+              && connections == kConnections && migrations > 0 && sizes.size() == 3
+              && sizes[0] == 4 && sizes[1] == 1 && sizes[2] == 3;
+    printf("IO loops 2 -> %zu -> %zu -> %zu, %d of %d connections open, %lld moved: %s\n",
+           sizes.size() > 0 ? sizes[0] : 0, sizes.size() > 1 ? sizes[1] : 0,
+           sizes.size() > 2 ? sizes[2] : 0, connections, kConnections,
+           static_cast<long long>(migrations), ok ? "PASS" : "FAIL");
+    return ok;
+}
+
+bool autoscaleRound()
+{
+    pid_t client = ::fork();
+    if (client == 0)
+    {
+        runBusyClient();
+    }
+
+    size_t most = 0;
+    size_t last = 0;
+    {
+        EventLoop loop;
+        TcpServer server(&loop, InetAddress(kPort));
+        server.setAutoscaling(1, 4, 0.2, 0.5, 0.1);
+        server.setConnectionCallback([](const TcpConnectionPtr&) {});
+        server.setMessageCallback(onBusyMessage);
+        server.start();
+        loop.runEvery(0.1, [&server, &most] {
+            most = std::max(most, server.threadPool()->getAllLoops().size());
+        });
+        loop.runAfter(kBusySeconds + 2.5, [&loop, &server, &last] {
+            last = server.threadPool()->getAllLoops().size();
+            loop.quit();
+        });
+        loop.startLoop();
+    }
+
+    bool ok = waitClient(client) && most > 1 && last == 1;
+    printf("autoscaled up to %zu IO loops under load, %zu when idle: %s\n",
+           most, last, ok ? "PASS" : "FAIL");
+    return ok;
+}
+
+}//namespace
+
+int main(int argc, char* argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    // the forked clients leave with _exit()
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    bool ok = resizeRound();
+    ok = autoscaleRound() && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,343 @@
+// Connection scale test, C100K on loopback.
+//
+// A forked client opens the connections one after another, binding them
+// to 127.0.0.1, 127.0.0.2, ... so the ephemeral ports of one source
+// address do not run out. The server greets every connection with its
+// clock, the client reports the time from connect() to the greeting as
+// time to accept. Then the connections stay idle, or trickle one byte
+// messages at a total rate, while the server
+//   - samples its RSS before and after, per connection,
+//   - probes every IO loop with queueInLoop() each 10 ms, the delay until
+//     the probe runs is the loop latency,
+//   - adds a timer per connection and samples RSS again, per timer.
+// RSS does not count kernel socket memory.
+//
+// Both processes need an open file limit above the connections, the
+// connections are cut down to it. The accept backlog
+// (net.core.somaxconn) limits the connect rate, not the result.
+//
+// Usage: scale_test [connections] [io threads] [seconds] [trickle messages per second]
+
+#include "histogram.h"
+
+#include "../net/buffer.h"
+#include "../net/channel.h"
+#include "../net/event_loop.h"
+#include "../net/event_loop_thread_pool.h"
+#include "../net/tcp_server.h"
+#include "../net/timer.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace mouse;
+
+namespace
+{
+
+const uint16_t kPort = 2035;
+const int kConnectionsPerSourceAddress = 20000;
+const useconds_t kProbeIntervalUs = 10 * 1000;
+
+int g_connections = 100000;
+int g_threads = 4;
+double g_seconds = 10.0;
+double g_trickle_rate = 0.0;
+
+std::atomic<int> g_connected(0);
+std::unique_ptr<std::thread> g_prober;
+
+int64_t rssBytes()
+{
+    long pages = 0;
+    long rss = 0;
+    FILE* fp = ::fopen("/proc/self/statm", "r");
+    if (fp)
+    {
+        if (::fscanf(fp, "%ld %ld", &pages, &rss) != 2)
+        {
+            rss = 0;
+        }
+        ::fclose(fp);
+    }
+    return static_cast<int64_t>(rss) * ::sysconf(_SC_PAGESIZE);
+}
+
+double mib(int64_t bytes)
+{
+    return static_cast<double>(bytes) / (1024 * 1024);
+}
+
+int connectFrom(int index)
+{
+    int sockfd = ::socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in local;
+    bzero(&local, sizeof local);
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_LOOPBACK + index / kConnectionsPerSourceAddress);
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::bind(sockfd, reinterpret_cast<struct sockaddr*>(&local), sizeof local) < 0
+            || ::connect(sockfd, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) < 0)
+    {
+        ::close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+void runClient()
+{
+    // waits for the server to listen
+    int first = -1;
+    for (int retry = 0; first < 0 && retry < 100; ++retry)
+    {
+        ::usleep(10 * 1000);
+        first = connectFrom(0);
+    }
+    if (first >= 0)
+    {
+        ::close(first);
+    }
+
+    Histogram accept_latency;
+    std::vector<int> sockfds;
+    sockfds.reserve(static_cast<size_t>(g_connections));
+    Timestamp start(Timestamp::now());
+    for (int i = 0; i < g_connections; ++i)
+    {
+        Timestamp connect_start(Timestamp::now());
+        int sockfd = connectFrom(i);
+        int64_t accepted = 0;
+        if (sockfd < 0 || ::read(sockfd, &accepted, sizeof accepted) != sizeof accepted)
+        {
+            fprintf(stderr, "connection %d: %s\n", i, strerror(errno));
+            ::_exit(1);
+        }
+        accept_latency.record(accepted - connect_start.microsecondsSinceEpoch());
+        sockfds.push_back(sockfd);
+    }
+    double elapsed = timeDifference(Timestamp::now(), start);
+    printf("client: %d connections from %d source addresses in %.2f s, %.0f per second\n",
+           g_connections, (g_connections - 1) / kConnectionsPerSourceAddress + 1,
+           elapsed, g_connections / elapsed);
+    printf("client: time to accept  p50 %lld us  p99 %lld us  p99.9 %lld us  max %lld us\n",
+           static_cast<long long>(accept_latency.percentile(50)),
+           static_cast<long long>(accept_latency.percentile(99)),
+           static_cast<long long>(accept_latency.percentile(99.9)),
+           static_cast<long long>(accept_latency.max()));
+    fflush(stdout);
+
+    // killed by the server
+    size_t next = 0;
+    while (true)
+    {
+        if (g_trickle_rate <= 0.0)
+        {
+            ::pause();
+        }
+        // every millisecond a share of the rate
+        int num = std::max(1, static_cast<int>(g_trickle_rate / 1000));
+        for (int i = 0; i < num; ++i)
+        {
+            if (::write(sockfds[next], "t", 1) != 1)
+            {
+                ::_exit(1);
+            }
+            next = (next + 1) % sockfds.size();
+        }
+        ::usleep(1000);
+    }
+}
+
+void onConnection(const TcpConnectionPtr& conn)
+{
+    if (conn->connected())
+    {
+        int64_t now = Timestamp::now().microsecondsSinceEpoch();
+        conn->send(std::string(reinterpret_cast<const char*>(&now), sizeof now));
+        g_connected.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void onMessage(const TcpConnectionPtr& conn, Buffer* buf, Timestamp)
+{
+    buf->retrieveAll();
+}
+
+// in a thread of its own, the loops are probed from outside
+void probeLoops(const std::vector<EventLoop*>& loops, std::vector<Histogram>* latencies)
+{
+    Timestamp end(addTime(Timestamp::now(), g_seconds));
+    while (Timestamp::now() < end)
+    {
+        for (size_t i = 0; i < loops.size(); ++i)
+        {
+            Histogram* latency = &(*latencies)[i];
+            Timestamp queued(Timestamp::now());
+            loops[i]->queueInLoop([latency, queued] {
+                latency->record(Timestamp::now().microsecondsSinceEpoch()
+                                - queued.microsecondsSinceEpoch());
+            });
+        }
+        ::usleep(kProbeIntervalUs);
+    }
+    // the probes run before these
+    for (size_t i = 0; i < loops.size(); ++i)
+    {
+        std::promise<void> done;
+        loops[i]->queueInLoop([&done] { done.set_value(); });
+        done.get_future().wait();
+    }
+}
+
+void printSizes()
+{
+    printf("sizeof: TcpConnection %zu  Channel %zu  Buffer %zu (+ %zu heap until released)"
+           "  Timer %zu\n",
+           sizeof(TcpConnection), sizeof(Channel), sizeof(Buffer),
+           Buffer::kCheapPrepend + Buffer::kInitialSize, sizeof(Timer));
+    printf("per idle connection: TcpConnection and make_shared control block %zu bytes, "
+           "plus pollfd, Poller map node, TcpServer slab entry\n",
+           sizeof(TcpConnection) + 2 * sizeof(void*));
+}
+
+void finish(EventLoop* loop, pid_t client, int64_t rss_before,
+            std::vector<Histogram>* latencies)
+{
+    g_prober->join();
+    Histogram latency;
+    for (size_t i = 0; i < latencies->size(); ++i)
+    {
+        latency.add((*latencies)[i]);
+    }
+    delete latencies;
+    int64_t rss_steady = rssBytes();
+    printf("loop latency %s %.0f s: p50 %lld us  p99 %lld us  p99.9 %lld us  max %lld us\n",
+           g_trickle_rate > 0.0 ? "trickling" : "idle", g_seconds,
+           static_cast<long long>(latency.percentile(50)),
+           static_cast<long long>(latency.percentile(99)),
+           static_cast<long long>(latency.percentile(99.9)),
+           static_cast<long long>(latency.max()));
+    printf("rss: %.1f MiB after, %lld bytes per connection\n",
+           mib(rss_steady),
+           static_cast<long long>((rss_steady - rss_before) / g_connections));
+
+    std::vector<TimerId> timers;
+    timers.reserve(static_cast<size_t>(g_connections));
+    int64_t rss_without_timers = rssBytes();
+    for (int i = 0; i < g_connections; ++i)
+    {
+        timers.push_back(loop->runAfter(3600.0 + i, [] {}));
+    }
+    int64_t rss_with_timers = rssBytes();
+    printf("rss: %.1f MiB with a timer per connection, %lld bytes per timer\n",
+           mib(rss_with_timers),
+           static_cast<long long>((rss_with_timers - rss_without_timers) / g_connections));
+    for (size_t i = 0; i < timers.size(); ++i)
+    {
+        loop->cancel(timers[i]);
+    }
+    printSizes();
+    fflush(stdout);
+
+    ::kill(client, SIGKILL);
+    ::waitpid(client, NULL, 0);
+    loop->quit();
+}
+
+void run(EventLoop* loop, TcpServer* server, pid_t client, int64_t rss_before)
+{
+    int64_t rss_connected = rssBytes();
+    printf("rss: %.1f MiB before, %.1f MiB with %d connections, %lld bytes per connection\n",
+           mib(rss_before), mib(rss_connected), g_connections,
+           static_cast<long long>((rss_connected - rss_before) / g_connections));
+    fflush(stdout);
+
+    // the base loop is probed too without IO threads, so it keeps running
+    std::vector<EventLoop*> loops(server->threadPool()->getAllLoops());
+    std::vector<Histogram>* latencies = new std::vector<Histogram>(loops.size());
+    g_prober.reset(new std::thread([=] {
+        probeLoops(loops, latencies);
+        loop->runInLoop(std::bind(finish, loop, client, rss_before, latencies));
+    }));
+}
+
+void checkProgress(EventLoop* loop, TcpServer* server, pid_t client, int64_t rss_before)
+{
+    if (::waitpid(client, NULL, WNOHANG) == client)
+    {
+        printf("client failed with %d connections\n", g_connected.load());
+        loop->quit();
+    }
+    else if (g_connected.load() >= g_connections)
+    {
+        // after the client printed
+        loop->runAfter(0.2, std::bind(run, loop, server, client, rss_before));
+    }
+    else
+    {
+        loop->runAfter(0.1, std::bind(checkProgress, loop, server, client, rss_before));
+    }
+}
+
+}//namespace
+
+int main(int argc, char* argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    g_connections = argc > 1 ? atoi(argv[1]) : g_connections;
+    g_threads = argc > 2 ? atoi(argv[2]) : g_threads;
+    g_seconds = argc > 3 ? atof(argv[3]) : g_seconds;
+    g_trickle_rate = argc > 4 ? atof(argv[4]) : g_trickle_rate;
+
+    struct rlimit limit;
+    ::getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    ::setrlimit(RLIMIT_NOFILE, &limit);
+    int max_connections = static_cast<int>(std::min<rlim_t>(limit.rlim_cur - 64, INT32_MAX));
+    if (g_connections > max_connections)
+    {
+        printf("open files are limited to %lu, %d connections instead of %d\n",
+               static_cast<unsigned long>(limit.rlim_cur), max_connections, g_connections);
+        g_connections = max_connections;
+    }
+
+    // fork before IO threads are started
+    pid_t client = ::fork();
+    if (client == 0)
+    {
+        runClient();
+    }
+
+    EventLoop loop;
+    TcpServer server(&loop, InetAddress(kPort));
+    server.setThreadsNum(g_threads);
+    server.setConnectionCallback(onConnection);
+    server.setMessageCallback(onMessage);
+    server.start();
+    int64_t rss_before = rssBytes();
+    loop.runAfter(0.1, std::bind(checkProgress, &loop, &server, client, rss_before));
+    loop.startLoop();
+}
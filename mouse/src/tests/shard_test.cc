@@ -0,0 +1,144 @@
+// Shared-nothing shards with EventLoop::local().
+//
+// Every IO loop counts the messages and bytes of its connections in a
+// local Shard, nothing is shared between loops. A forked client sends
+// kMessages lines over kConnections connections, then the server
+// gathers the shards to one total and checks it. The shards are
+// destroyed with their loops.
+
+#include "fork_client.h"
+
+#include "../net/buffer.h"
+#include "../net/event_loop.h"
+#include "../net/event_loop_thread_pool.h"
+#include "../net/tcp_server.h"
+
+#include <glog/logging.h>
+
+#include <atomic>
+#include <functional>
+#include <vector>
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace mouse;
+
+namespace
+{
+
+const uint16_t kPort = 2039;
+const int kThreads = 4;
+const int kConnections = 16;
+const int kMessages = 1000;
+const char kLine[] = "hello shard\n";
+
+std::atomic<int> g_shards_destroyed(0);
+
+struct Counts
+{
+    Counts() : messages(0), bytes(0) {}
+
+    int64_t messages;
+    int64_t bytes;
+};
+
+struct Shard
+{
+    ~Shard() { g_shards_destroyed.fetch_add(1); }
+
+    Counts counts;
+};
+
+void runClient()
+{
+    std::vector<int> sockfds;
+    for (int i = 0; i < kConnections; ++i)
+    {
+        sockfds.push_back(connectServer(kPort));
+    }
+    for (int i = 0; i < kMessages; ++i)
+    {
+        int sockfd = sockfds[static_cast<size_t>(i % kConnections)];
+        if (::write(sockfd, kLine, sizeof kLine - 1) != sizeof kLine - 1)
+        {
+            ::_exit(1);
+        }
+    }
+    // what is written is still delivered
+    ::_exit(0);
+}
+
+void onMessage(const TcpConnectionPtr& conn, Buffer* buf, Timestamp)
+{
+    Counts* counts = &conn->loop()->local<Shard>()->counts;
+    const void* eol;
+    while ((eol = ::memchr(buf->peek(), '\n', buf->readableBytes())) != NULL)
+    {
+        counts->messages += 1;
+        const char* end = static_cast<const char*>(eol) + 1;
+        counts->bytes += end - buf->peek();
+        buf->retrieveUntil(end);
+    }
+}
+
+Counts shardCounts(EventLoop* loop)
+{
+    return loop->local<Shard>()->counts;
+}
+
+void checkTotal(EventLoop* loop, TcpServer* server, const std::vector<Counts>& shards)
+{
+    Counts total;
+    int busy_shards = 0;
+    for (size_t i = 0; i < shards.size(); ++i)
+    {
+        total.messages += shards[i].messages;
+        total.bytes += shards[i].bytes;
+        busy_shards += shards[i].messages > 0 ? 1 : 0;
+    }
+    if (total.messages < kMessages)
+    {
+        loop->runAfter(0.05, [loop, server] {
+            server->threadPool()->gather<Counts>(shardCounts, loop,
+                    std::bind(checkTotal, loop, server, std::placeholders::_1));
+        });
+        return;
+    }
+    bool ok = total.messages == kMessages
+              && total.bytes == static_cast<int64_t>(kMessages * (sizeof kLine - 1));
+    printf("%lld messages, %lld bytes in %d of %zu shards: %s\n",
+           static_cast<long long>(total.messages), static_cast<long long>(total.bytes),
+           busy_shards, shards.size(), ok ? "PASS" : "FAIL");
+    loop->quit();
+}
+
+}//namespace
+
+int main(int argc, char* argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    pid_t client = ::fork();
+    if (client == 0)
+    {
+        runClient();
+    }
+
+    {
+        EventLoop loop;
+        TcpServer server(&loop, InetAddress(kPort));
+        server.setThreadsNum(kThreads);
+        server.setConnectionCallback([](const TcpConnectionPtr&) {});
+        server.setMessageCallback(onMessage);
+        server.start();
+        checkTotal(&loop, &server, std::vector<Counts>());
+        loop.startLoop();
+    }
+    ::waitpid(client, NULL, 0);
+    printf("%d of %d shards destroyed with their loops: %s\n",
+           g_shards_destroyed.load(), kThreads,
+           g_shards_destroyed.load() == kThreads ? "PASS" : "FAIL");
+}
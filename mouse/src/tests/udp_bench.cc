@@ -0,0 +1,194 @@
+// UDP datagram rate benchmark.
+//
+// Forked senders flood a UdpServer with kPayload byte datagrams over
+// connected sockets, kSenderBatch per sendmmsg(2), and drain the echoes.
+// The server echoes every datagram. Three rounds: one datagram per
+// recvmmsg(2), batches of 64, and batches of 64 with UDP_GRO while the
+// senders coalesce with UDP_SEGMENT. Each reports datagrams received per
+// second, datagrams per receive call and server CPU time per datagram.
+//
+// Usage: udp_bench [seconds] [io threads] [senders]
+
+#include "../net/event_loop.h"
+#include "../net/inet_address.h"
+#include "../net/udp_server.h"
+
+#include <glog/logging.h>
+
+#include <functional>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/udp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace mouse;
+
+namespace
+{
+
+const uint16_t kPort = 2042;
+const size_t kPayload = 64;
+const size_t kSenderBatch = 64;
+
+double cpuSeconds()
+{
+    struct rusage usage;
+    ::getrusage(RUSAGE_SELF, &usage);
+    return static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+        + static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+void drainEchoes(int sockfd)
+{
+    char buf[65536];
+    while (::recv(sockfd, buf, sizeof buf, MSG_DONTWAIT) > 0)
+    {
+    }
+}
+
+void runSender(bool gso)
+{
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int sockfd = ::socket(AF_INET, SOCK_DGRAM, 0);
+    if (::connect(sockfd, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) < 0)
+    {
+        ::perror("connect");
+        ::_exit(1);
+    }
+
+    static char payload[kSenderBatch * kPayload];
+    memset(payload, 'u', sizeof payload);
+    struct iovec iovecs[kSenderBatch];
+    struct mmsghdr headers[kSenderBatch];
+    bzero(headers, sizeof headers);
+    for (size_t i = 0; i < kSenderBatch; ++i)
+    {
+        iovecs[i].iov_base = payload + i * kPayload;
+        iovecs[i].iov_len = kPayload;
+        headers[i].msg_hdr.msg_iov = &iovecs[i];
+        headers[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // the whole batch in one buffer, cut by the kernel
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    struct iovec gso_iovec = { payload, sizeof payload };
+    struct msghdr gso_header;
+    bzero(&gso_header, sizeof gso_header);
+    gso_header.msg_iov = &gso_iovec;
+    gso_header.msg_iovlen = 1;
+    gso_header.msg_control = control;
+    gso_header.msg_controllen = sizeof control;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&gso_header);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t segment_size = static_cast<uint16_t>(kPayload);
+    memcpy(CMSG_DATA(cmsg), &segment_size, sizeof segment_size);
+
+    // killed by the parent
+    while (true)
+    {
+        if (gso)
+        {
+            ::sendmsg(sockfd, &gso_header, 0);
+        }
+        else
+        {
+            ::sendmmsg(sockfd, headers, kSenderBatch, 0);
+        }
+        drainEchoes(sockfd);
+    }
+}
+
+void onDatagrams(UdpSocket* socket, const Datagram* datagrams, size_t count, Timestamp)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        socket->send(InetAddress(*datagrams[i].peer), datagrams[i].data, datagrams[i].len);
+    }
+}
+
+void report(EventLoop* loop, UdpServer* server, const char* round,
+            Timestamp start, double cpu_start, UdpSocketStats stats_start)
+{
+    double elapsed = timeDifference(Timestamp::now(), start);
+    double cpu = cpuSeconds() - cpu_start;
+    UdpSocketStats stats = server->stats();
+    double received = static_cast<double>(stats.received - stats_start.received);
+    double calls = static_cast<double>(stats.receive_calls - stats_start.receive_calls);
+    double sent = static_cast<double>(stats.sent - stats_start.sent);
+    printf("%-14s %.0f datagrams/s  %.1f datagrams/recvmmsg  echoed %.0f  "
+           "server cpu %.2f us/datagram\n",
+           round, received / elapsed, calls > 0 ? received / calls : 0.0,
+           sent, received > 0 ? cpu * 1e6 / received : 0.0);
+    loop->quit();
+}
+
+void runRound(const char* round, double seconds, int threads_num, int senders_num,
+              size_t batch, bool offload)
+{
+    // fork before IO threads are started
+    std::vector<pid_t> senders;
+    for (int i = 0; i < senders_num; ++i)
+    {
+        pid_t pid = ::fork();
+        if (pid == 0)
+        {
+            ::usleep(100 * 1000);
+            runSender(offload);
+        }
+        senders.push_back(pid);
+    }
+
+    {
+        EventLoop loop;
+        UdpServer server(&loop, InetAddress(kPort));
+        server.setThreadsNum(threads_num);
+        server.setReceiveBatch(batch, 2048);
+        server.setGro(offload);
+        server.setDatagramCallback(onDatagrams);
+        server.start();
+
+        // skip the warm up
+        loop.runAfter(0.5, [&] {
+            loop.runAfter(seconds, std::bind(report, &loop, &server, round,
+                                             Timestamp::now(), cpuSeconds(),
+                                             server.stats()));
+        });
+        loop.startLoop();
+
+        for (size_t i = 0; i < senders.size(); ++i)
+        {
+            ::kill(senders[i], SIGKILL);
+            ::waitpid(senders[i], NULL, 0);
+        }
+    }
+}
+
+}//namespace
+
+int main(int argc, char* argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    double seconds = argc > 1 ? atof(argv[1]) : 3.0;
+    int threads_num = argc > 2 ? atoi(argv[2]) : 2;
+    int senders_num = argc > 3 ? atoi(argv[3]) : 2;
+
+    runRound("batch 1", seconds, threads_num, senders_num, 1, false);
+    runRound("batch 64", seconds, threads_num, senders_num, 64, false);
+    runRound("batch 64 gro", seconds, threads_num, senders_num, 64, true);
+}
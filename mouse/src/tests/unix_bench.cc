@@ -0,0 +1,315 @@
+// Loopback TCP against unix domain sockets, on a file system path and in
+// the abstract namespace.
+//
+// A forked client measures, per transport:
+//   latency     round trips of kPingSize bytes through an echo connection,
+//   throughput  kBlockSize byte writes to a sink connection, until the
+//               server has read them all,
+//   fd passing  unix domain only, a pipe passed to the server with
+//               sockets::sendFds() and one passed back with
+//               TcpConnection::sendWithFds(), both checked through the pipe.
+// The first byte of a connection selects its mode.
+//
+// Usage: unix_bench [seconds per measurement]
+
+#include "fork_client.h"
+#include "histogram.h"
+
+#include "../net/buffer.h"
+#include "../net/event_loop.h"
+#include "../net/inet_address.h"
+#include "../net/sockets_ops.h"
+#include "../net/tcp_server.h"
+
+#include <glog/logging.h>
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace mouse;
+
+namespace
+{
+
+const uint16_t kPort = 2043;
+const char kUnixPath[] = "/tmp/mouse_unix_bench.sock";
+const char kAbstractName[] = "mouse_unix_bench";
+const size_t kPingSize = 64;
+const size_t kBlockSize = 64 * 1024;
+const int kFdPasses = 2000;
+const char kPipeMessage[] = "through the pipe";
+
+const char kEcho = 'e';
+const char kSink = 's';
+const char kFds = 'f';
+
+int64_t nowNs()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+int connectMode(const InetAddress& server, char mode)
+{
+    int sockfd = connectServer(server);
+    if (!server.isUnix())
+    {
+        int on = 1;
+        ::setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+    }
+    if (::write(sockfd, &mode, 1) != 1)
+    {
+        ::_exit(1);
+    }
+    return sockfd;
+}
+
+void readFully(int sockfd, char* buf, size_t len)
+{
+    size_t received = 0;
+    while (received < len)
+    {
+        ssize_t n = ::read(sockfd, buf + received, len - received);
+        if (n <= 0)
+        {
+            printf("connection lost\n");
+            ::_exit(1);
+        }
+        received += static_cast<size_t>(n);
+    }
+}
+
+void measureLatency(const InetAddress& server, double seconds)
+{
+    int sockfd = connectMode(server, kEcho);
+    char ping[kPingSize];
+    char pong[kPingSize];
+    memset(ping, 'p', sizeof ping);
+    Histogram histogram;
+    int64_t end = nowNs() + static_cast<int64_t>(seconds * 1e9);
+    int64_t now = nowNs();
+    while (now < end)
+    {
+        if (::write(sockfd, ping, sizeof ping) != sizeof ping)
+        {
+            ::_exit(1);
+        }
+        readFully(sockfd, pong, sizeof pong);
+        int64_t then = now;
+        now = nowNs();
+        histogram.record(now - then);
+    }
+    ::close(sockfd);
+    printf("  latency     %8.0f round trips/s  p50 %.1f us  p99 %.1f us  max %.1f us\n",
+           static_cast<double>(histogram.count()) / seconds,
+           static_cast<double>(histogram.percentile(50)) / 1e3,
+           static_cast<double>(histogram.percentile(99)) / 1e3,
+           static_cast<double>(histogram.max()) / 1e3);
+}
+
+void measureThroughput(const InetAddress& server, double seconds)
+{
+    int sockfd = connectMode(server, kSink);
+    std::vector<char> block(kBlockSize, 'b');
+    int64_t start = nowNs();
+    int64_t end = start + static_cast<int64_t>(seconds * 1e9);
+    double bytes = 0;
+    while (nowNs() < end)
+    {
+        ssize_t n = ::write(sockfd, block.data(), block.size());
+        if (n <= 0)
+        {
+            ::_exit(1);
+        }
+        bytes += static_cast<double>(n);
+    }
+    // the server closes once it has read everything
+    ::shutdown(sockfd, SHUT_WR);
+    char c;
+    while (::read(sockfd, &c, 1) > 0)
+    {
+    }
+    double elapsed = static_cast<double>(nowNs() - start) / 1e9;
+    ::close(sockfd);
+    printf("  throughput  %8.0f MiB/s\n", bytes / elapsed / (1024 * 1024));
+}
+
+void measureFdPassing(const InetAddress& server)
+{
+    int sockfd = connectMode(server, kFds);
+    char ack;
+    readFully(sockfd, &ack, 1);
+
+    int64_t start = nowNs();
+    for (int i = 0; i < kFdPasses; ++i)
+    {
+        // the server writes into our pipe, and passes one of its own back
+        int pipefd[2];
+        if (::pipe(pipefd) < 0 || sockets::sendFds(sockfd, &kFds, 1, &pipefd[1], 1) != 1)
+        {
+            ::_exit(1);
+        }
+        ::close(pipefd[1]);
+        char buf[sizeof kPipeMessage];
+        readFully(pipefd[0], buf, sizeof kPipeMessage);
+        ::close(pipefd[0]);
+
+        int fd = -1;
+        int fds_num = 0;
+        if (sockets::recvFds(sockfd, &ack, 1, &fd, 1, &fds_num) != 1 || fds_num != 1)
+        {
+            printf("  fd passing  no fd back\n");
+            ::_exit(1);
+        }
+        char back[sizeof kPipeMessage];
+        readFully(fd, back, sizeof kPipeMessage);
+        ::close(fd);
+        if (memcmp(buf, kPipeMessage, sizeof buf) != 0
+                || memcmp(back, kPipeMessage, sizeof back) != 0)
+        {
+            printf("  fd passing  bad pipe message\n");
+            ::_exit(1);
+        }
+    }
+    double elapsed = static_cast<double>(nowNs() - start) / 1e9;
+    ::close(sockfd);
+    printf("  fd passing  %8.0f round trips/s, a pipe each way: PASS\n",
+           kFdPasses / elapsed);
+}
+
+void runClient(const InetAddress& server, double seconds)
+{
+    measureLatency(server, seconds);
+    measureThroughput(server, seconds);
+    if (server.isUnix())
+    {
+        measureFdPassing(server);
+    }
+    ::_exit(0);
+}
+
+// the mode of a connection, set by its first byte
+std::map<uint64_t, char> g_modes;
+
+void onFdMessage(const TcpConnectionPtr& conn)
+{
+    std::vector<int> fds(conn->takeReceivedFds());
+    for (size_t i = 0; i < fds.size(); ++i)
+    {
+        if (::write(fds[i], kPipeMessage, sizeof kPipeMessage) != sizeof kPipeMessage)
+        {
+            LOG(ERROR) << "onFdMessage write";
+        }
+        ::close(fds[i]);
+
+        int pipefd[2];
+        if (::pipe2(pipefd, O_CLOEXEC) < 0)
+        {
+            LOG(FATAL) << "pipe";
+        }
+        if (::write(pipefd[1], kPipeMessage, sizeof kPipeMessage) != sizeof kPipeMessage)
+        {
+            LOG(ERROR) << "onFdMessage write";
+        }
+        ::close(pipefd[1]);
+        conn->sendWithFds(std::string(1, kFds), std::vector<int>(1, pipefd[0]));
+    }
+}
+
+void onConnection(const TcpConnectionPtr& conn)
+{
+    if (conn->connected())
+    {
+        conn->setTcpNoDelay(true);
+    }
+    else
+    {
+        g_modes.erase(conn->id());
+    }
+}
+
+void onMessage(const TcpConnectionPtr& conn, Buffer* buf, Timestamp)
+{
+    std::map<uint64_t, char>::iterator it = g_modes.find(conn->id());
+    if (it == g_modes.end())
+    {
+        it = g_modes.insert(std::make_pair(conn->id(), *buf->peek())).first;
+        buf->retrieve(1);
+        if (it->second == kFds)
+        {
+            // before the client passes anything
+            conn->setFdPassing(true);
+            conn->send(std::string(1, kFds));
+        }
+    }
+
+    if (it->second == kEcho)
+    {
+        conn->send(buf->retrieveAsString());
+    }
+    else
+    {
+        buf->retrieveAll();
+        if (it->second == kFds)
+        {
+            onFdMessage(conn);
+        }
+    }
+}
+
+bool runTransport(const char* title, const InetAddress& listen_addr,
+                  const InetAddress& server_addr, double seconds)
+{
+    printf("%s\n", title);
+    pid_t client = ::fork();
+    if (client == 0)
+    {
+        runClient(server_addr, seconds);
+    }
+
+    int status = -1;
+    {
+        EventLoop loop;
+        TcpServer server(&loop, listen_addr);
+        server.setConnectionCallback(onConnection);
+        server.setMessageCallback(onMessage);
+        server.start();
+        quitWithClient(&loop, client, &status);
+        loop.startLoop();
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+}//namespace
+
+int main(int argc, char* argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    double seconds = argc > 1 ? atof(argv[1]) : 2.0;
+
+    ::unlink(kUnixPath);
+    bool ok = runTransport("loopback tcp", InetAddress(kPort),
+                           InetAddress("127.0.0.1", kPort), seconds);
+    ok = runTransport(kUnixPath, InetAddress::unixPath(kUnixPath),
+                      InetAddress::unixPath(kUnixPath), seconds) && ok;
+    ::unlink(kUnixPath);
+    ok = runTransport("abstract @mouse_unix_bench", InetAddress::unixAbstract(kAbstractName),
+                      InetAddress::unixAbstract(kAbstractName), seconds) && ok;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}